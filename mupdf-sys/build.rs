@@ -47,6 +47,93 @@ fn cp_r(dir: &Path, dest: &Path) {
     }
 }
 
+/// Environment variables tuning the C build, see `optimization_flags`
+const OPTIMIZATION_ENV: [&str; 5] = [
+    "MUPDF_SYS_TARGET_CPU",
+    "MUPDF_SYS_LTO",
+    "MUPDF_SYS_PGO_GENERATE",
+    "MUPDF_SYS_PGO_USE",
+    "MUPDF_SYS_CFLAGS",
+];
+
+/// Extra C compiler flags used for both libmupdf and the wrapper:
+///
+/// * `MUPDF_SYS_TARGET_CPU` - CPU to tune for, e.g. `native` or `x86-64-v3`,
+///   defaults to the `-C target-cpu` passed to rustc
+/// * `MUPDF_SYS_LTO` - `thin` or `fat`, emits LLVM bitcode for cross-language
+///   LTO, needs `CC=clang`, `AR=llvm-ar` and `RUSTFLAGS=-Clinker-plugin-lto`
+/// * `MUPDF_SYS_PGO_GENERATE` - directory to write an instrumented build's profiles to
+/// * `MUPDF_SYS_PGO_USE` - profile to optimize with, the `.gcda` directory for gcc
+///   or the merged `.profdata` file for clang
+/// * `MUPDF_SYS_CFLAGS` - any other flags, separated by spaces
+#[cfg(not(target_env = "msvc"))]
+fn optimization_flags() -> Vec<String> {
+    let compiler = cc::Build::new().get_compiler();
+    let mut flags = Vec::new();
+
+    let target_cpu = env::var("MUPDF_SYS_TARGET_CPU").ok().or_else(|| {
+        // Follow the CPU the Rust code is built for
+        let rustflags = env::var("CARGO_ENCODED_RUSTFLAGS").unwrap_or_default();
+        let rustflags: Vec<&str> = rustflags.split('\x1f').collect();
+        rustflags.iter().enumerate().find_map(|(i, flag)| {
+            if let Some(cpu) = flag.strip_prefix("-Ctarget-cpu=") {
+                Some(cpu.to_owned())
+            } else if *flag == "-C" {
+                rustflags
+                    .get(i + 1)
+                    .and_then(|f| f.strip_prefix("target-cpu="))
+                    .map(|cpu| cpu.to_owned())
+            } else {
+                None
+            }
+        })
+    });
+    if let Some(cpu) = target_cpu {
+        let arch = env::var("CARGO_CFG_TARGET_ARCH").unwrap_or_default();
+        if arch == "x86" || arch == "x86_64" {
+            flags.push(format!("-march={}", cpu));
+        } else {
+            flags.push(format!("-mcpu={}", cpu));
+        }
+    }
+
+    match env::var("MUPDF_SYS_LTO").as_deref() {
+        Ok("thin") => flags.push("-flto=thin".to_owned()),
+        Ok("fat") | Ok("full") => flags.push("-flto".to_owned()),
+        Ok(other) => panic!("MUPDF_SYS_LTO must be `thin` or `fat`, got `{}`", other),
+        Err(_) => {}
+    }
+
+    if let Ok(dir) = env::var("MUPDF_SYS_PGO_GENERATE") {
+        flags.push(format!("-fprofile-generate={}", dir));
+        if compiler.is_like_clang() {
+            flags.push("-fprofile-update=atomic".to_owned());
+        } else {
+            flags.push("-fprofile-update=prefer-atomic".to_owned());
+        }
+    } else if let Ok(profile) = env::var("MUPDF_SYS_PGO_USE") {
+        flags.push(format!("-fprofile-use={}", profile));
+        if compiler.is_like_clang() {
+            flags.push("-Wno-profile-instr-unprofiled".to_owned());
+        } else {
+            flags.push("-fprofile-correction".to_owned());
+            flags.push("-Wno-missing-profile".to_owned());
+        }
+    }
+
+    if let Ok(extra) = env::var("MUPDF_SYS_CFLAGS") {
+        flags.extend(extra.split_whitespace().map(|f| f.to_owned()));
+    }
+    flags
+}
+
+#[cfg(target_env = "msvc")]
+fn optimization_flags() -> Vec<String> {
+    env::var("MUPDF_SYS_CFLAGS")
+        .map(|extra| extra.split_whitespace().map(|f| f.to_owned()).collect())
+        .unwrap_or_default()
+}
+
 #[cfg(not(target_env = "msvc"))]
 fn build_libmupdf() {
     use std::process::Command;
@@ -83,6 +170,7 @@ fn build_libmupdf() {
     .into_iter()
     .chain(SKIP_FONTS.iter().cloned())
     .map(|s| format!("-D{}", s))
+    .chain(optimization_flags())
     .collect::<Vec<String>>()
     .join(" ");
     let mut make_flags = vec![
@@ -116,6 +204,16 @@ fn build_libmupdf() {
         format!("XCFLAGS={}", xcflags),
     ];
 
+    // Bitcode objects have to be compiled and archived by the LLVM toolchain
+    // the Rust side links with
+    if env::var("MUPDF_SYS_LTO").is_ok() {
+        for tool in &["CC", "CXX", "AR"] {
+            if let Ok(path) = env::var(tool) {
+                make_flags.push(format!("{}={}", tool, path));
+            }
+        }
+    }
+
     if cfg!(feature = "sys-lib") || cfg!(feature = "sys-lib-freetype") {
         let lib = pkg_config::probe_library("freetype2").unwrap();
         make_flags.push(format!(
@@ -244,6 +342,14 @@ fn build_libmupdf() {
     // println!("cargo:rustc-link-lib=static=mupdf-pkcs7");
     println!("cargo:rustc-link-lib=static=mupdf-third");
     // println!("cargo:rustc-link-lib=static=mupdf-threads");
+
+    // Instrumented gcc objects need the gcov runtime, clang's profile runtime
+    // comes with `-Cprofile-generate` on the Rust side
+    if env::var("MUPDF_SYS_PGO_GENERATE").is_ok()
+        && !cc::Build::new().get_compiler().is_like_clang()
+    {
+        println!("cargo:rustc-link-lib=gcov");
+    }
 }
 
 #[cfg(target_env = "msvc")]
@@ -336,11 +442,17 @@ fn main() {
     fail_on_empty_directory("mupdf");
     println!("cargo:rerun-if-changed=wrapper.h");
     println!("cargo:rerun-if-changed=wrapper.c");
+    for var in &OPTIMIZATION_ENV {
+        println!("cargo:rerun-if-env-changed={}", var);
+    }
 
     build_libmupdf();
 
     let mut build = cc::Build::new();
     build.file("wrapper.c").include("./mupdf/include");
+    for flag in optimization_flags() {
+        build.flag(&flag);
+    }
     if cfg!(target_os = "android") {
         build.flag("-DHAVE_ANDROID").flag_if_supported("-std=c99");
     }
@@ -50,29 +50,44 @@ static const fz_locks_context locks =
         lock,
         unlock};
 
+/* Errors are reported through a per-thread slot so that the failure path
+   never allocates, the message is only copied out if the caller keeps it */
+
+#ifdef _MSC_VER
+#define MUPDF_THREAD_LOCAL __declspec(thread)
+#else
+#define MUPDF_THREAD_LOCAL __thread
+#endif
+
+#define MUPDF_ERROR_MESSAGE_SIZE 256
+
 typedef struct mupdf_error
 {
     int type;
     char *message;
+    char buf[MUPDF_ERROR_MESSAGE_SIZE];
 } mupdf_error_t;
 
+static MUPDF_THREAD_LOCAL mupdf_error_t error_slot;
+
+static mupdf_error_t *mupdf_set_error(int type, const char *message)
+{
+    mupdf_error_t *err = &error_slot;
+    err->type = type;
+    fz_strlcpy(err->buf, message ? message : "", sizeof err->buf);
+    err->message = err->buf;
+    return err;
+}
+
 static void mupdf_save_error(fz_context *ctx, mupdf_error_t **errptr)
 {
     assert(errptr != NULL);
-    int type = fz_caught(ctx);
-    const char *message = fz_caught_message(ctx);
-    mupdf_error_t *err = malloc(sizeof(mupdf_error_t));
-    err->type = type;
-    err->message = strdup(message);
-    *errptr = err;
+    *errptr = mupdf_set_error(fz_caught(ctx), fz_caught_message(ctx));
 }
 
 static mupdf_error_t *mupdf_new_error_from_str(const char *message)
 {
-    mupdf_error_t *err = malloc(sizeof(mupdf_error_t));
-    err->type = FZ_ERROR_GENERIC;
-    err->message = strdup(message);
-    return err;
+    return mupdf_set_error(FZ_ERROR_GENERIC, message);
 }
 
 void mupdf_drop_error(mupdf_error_t *err)
@@ -81,12 +96,9 @@ void mupdf_drop_error(mupdf_error_t *err)
     {
         return;
     }
-    if (err->message != NULL)
-    {
-        free(err->message);
-    }
-    free(err);
-    err = NULL;
+    // The slot is reused by the next error raised on this thread
+    err->type = 0;
+    err->buf[0] = 0;
 }
 
 void mupdf_drop_str(char *s)
@@ -150,6 +162,16 @@ fz_context *mupdf_new_base_context()
     return ctx;
 }
 
+/* MuPDF has no getter for whether color management is enabled */
+bool mupdf_icc_enabled(fz_context *ctx)
+{
+#if FZ_ENABLE_ICC
+    return ctx->icc_enabled;
+#else
+    return false;
+#endif
+}
+
 /* Rect */
 fz_rect mupdf_adjust_rect_for_stroke(fz_context *ctx, fz_rect self, fz_stroke_state *stroke, fz_matrix ctm, mupdf_error_t **errptr)
 {
@@ -743,6 +765,71 @@ fz_pixmap *mupdf_page_to_pixmap(fz_context *ctx, fz_page *page, fz_matrix ctm, f
     return pixmap;
 }
 
+fz_pixmap *mupdf_page_to_pixmap_with_hints(fz_context *ctx, fz_page *page, fz_matrix ctm, fz_colorspace *cs, bool alpha, bool show_extras, int hints, mupdf_error_t **errptr)
+{
+    fz_pixmap *pixmap = NULL;
+    fz_device *dev = NULL;
+    fz_rect rect;
+    fz_var(pixmap);
+    fz_var(dev);
+    fz_try(ctx)
+    {
+        rect = fz_transform_rect(fz_bound_page(ctx, page), ctm);
+        pixmap = fz_new_pixmap_with_bbox(ctx, cs, fz_round_rect(rect), NULL, alpha);
+        if (alpha)
+            fz_clear_pixmap(ctx, pixmap);
+        else
+            fz_clear_pixmap_with_value(ctx, pixmap, 0xFF);
+        dev = fz_new_draw_device(ctx, fz_identity, pixmap);
+        fz_enable_device_hints(ctx, dev, hints);
+        if (show_extras)
+            fz_run_page(ctx, page, dev, ctm, NULL);
+        else
+            fz_run_page_contents(ctx, page, dev, ctm, NULL);
+        fz_close_device(ctx, dev);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_device(ctx, dev);
+    }
+    fz_catch(ctx)
+    {
+        fz_drop_pixmap(ctx, pixmap);
+        pixmap = NULL;
+        mupdf_save_error(ctx, errptr);
+    }
+    return pixmap;
+}
+
+/* Redraw the area of an existing pixmap, e.g. after an annotation changed */
+void mupdf_page_rerender_area(fz_context *ctx, fz_page *page, fz_pixmap *pixmap, fz_matrix ctm, fz_irect area, bool show_extras, int hints, mupdf_error_t **errptr)
+{
+    fz_device *dev = NULL;
+    fz_var(dev);
+    fz_try(ctx)
+    {
+        area = fz_intersect_irect(area, fz_pixmap_bbox(ctx, pixmap));
+        if (fz_is_empty_irect(area))
+            break;
+        fz_clear_pixmap_rect_with_value(ctx, pixmap, pixmap->alpha ? 0 : 0xFF, area);
+        dev = fz_new_draw_device_with_bbox(ctx, fz_identity, pixmap, &area);
+        fz_enable_device_hints(ctx, dev, hints);
+        if (show_extras)
+            fz_run_page(ctx, page, dev, ctm, NULL);
+        else
+            fz_run_page_contents(ctx, page, dev, ctm, NULL);
+        fz_close_device(ctx, dev);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_device(ctx, dev);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+}
+
 fz_buffer *mupdf_page_to_svg(fz_context *ctx, fz_page *page, fz_matrix ctm, fz_cookie *cookie, mupdf_error_t **errptr)
 {
     fz_rect mediabox = fz_bound_page(ctx, page);
@@ -774,6 +861,29 @@ fz_buffer *mupdf_page_to_svg(fz_context *ctx, fz_page *page, fz_matrix ctm, fz_c
     return buf;
 }
 
+/* Stream the SVG of a page to out, text_format is one of FZ_SVG_TEXT_AS_PATH or FZ_SVG_TEXT_AS_TEXT */
+void mupdf_page_write_svg(fz_context *ctx, fz_page *page, fz_output *out, fz_matrix ctm, int text_format, bool reuse_images, fz_cookie *cookie, mupdf_error_t **errptr)
+{
+    fz_device *dev = NULL;
+    fz_var(dev);
+    fz_try(ctx)
+    {
+        fz_rect tbounds = fz_transform_rect(fz_bound_page(ctx, page), ctm);
+        dev = fz_new_svg_device(ctx, out, tbounds.x1 - tbounds.x0, tbounds.y1 - tbounds.y0, text_format, reuse_images);
+        fz_run_page(ctx, page, dev, ctm, cookie);
+        fz_close_device(ctx, dev);
+        fz_close_output(ctx, out);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_device(ctx, dev);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+}
+
 fz_stext_page *mupdf_page_to_text_page(fz_context *ctx, fz_page *page, int flags, mupdf_error_t **errptr)
 {
     fz_stext_page *text_page = NULL;
@@ -1125,223 +1235,3308 @@ fz_pixmap *mupdf_display_list_to_pixmap(fz_context *ctx, fz_display_list *list,
     return pixmap;
 }
 
-fz_stext_page *mupdf_display_list_to_text_page(fz_context *ctx, fz_display_list *list, int flags, mupdf_error_t **errptr)
+/* Like fz_new_pixmap_from_display_list, with device hints and a cookie to follow progress and abort */
+static fz_pixmap *mupdf_render_display_list(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_colorspace *cs, bool alpha, int hints, fz_cookie *cookie)
 {
-    fz_stext_page *text_page = NULL;
-    fz_stext_options opts = {0};
-    opts.flags = flags;
+    fz_pixmap *pixmap;
+    fz_device *dev = NULL;
+    fz_rect rect = fz_transform_rect(fz_bound_display_list(ctx, list), ctm);
+
+    pixmap = fz_new_pixmap_with_bbox(ctx, cs, fz_round_rect(rect), NULL, alpha);
+    fz_var(dev);
     fz_try(ctx)
     {
-        text_page = fz_new_stext_page_from_display_list(ctx, list, &opts);
+        if (alpha)
+            fz_clear_pixmap(ctx, pixmap);
+        else
+            fz_clear_pixmap_with_value(ctx, pixmap, 0xFF);
+        dev = fz_new_draw_device(ctx, fz_identity, pixmap);
+        fz_enable_device_hints(ctx, dev, hints);
+        fz_run_display_list(ctx, list, dev, ctm, fz_infinite_rect, cookie);
+        fz_close_device(ctx, dev);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_device(ctx, dev);
     }
     fz_catch(ctx)
     {
-        mupdf_save_error(ctx, errptr);
+        fz_drop_pixmap(ctx, pixmap);
+        fz_rethrow(ctx);
     }
-    return text_page;
+    return pixmap;
 }
 
-void mupdf_display_list_run(fz_context *ctx, fz_display_list *list, fz_device *device, fz_matrix ctm, fz_rect area, fz_cookie *cookie, mupdf_error_t **errptr)
+fz_pixmap *mupdf_display_list_to_pixmap_with_cookie(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_colorspace *cs, bool alpha, int hints, fz_cookie *cookie, mupdf_error_t **errptr)
 {
+    fz_pixmap *pixmap = NULL;
     fz_try(ctx)
     {
-        fz_run_display_list(ctx, list, device, ctm, area, cookie);
+        pixmap = mupdf_render_display_list(ctx, list, ctm, cs, alpha, hints, cookie);
     }
     fz_catch(ctx)
     {
         mupdf_save_error(ctx, errptr);
     }
+    return pixmap;
 }
 
-fz_quad *mupdf_search_display_list(fz_context *ctx, fz_display_list *list, const char *needle, const int hit_max, int *hit_count, mupdf_error_t **errptr)
+/* Render list at a fraction of the resolution of ctm and scale the result up to full size */
+fz_pixmap *mupdf_display_list_to_preview(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_colorspace *cs, bool alpha, float scale, int hints, mupdf_error_t **errptr)
 {
-    fz_quad *result = NULL;
-    fz_var(result);
+    fz_pixmap *small = NULL;
+    fz_pixmap *pixmap = NULL;
+    fz_irect bbox;
+    fz_var(small);
     fz_try(ctx)
     {
-        result = fz_calloc(ctx, hit_max, sizeof(fz_quad));
-    }
-    fz_catch(ctx)
-    {
-        mupdf_save_error(ctx, errptr);
+        bbox = fz_round_rect(fz_transform_rect(fz_bound_display_list(ctx, list), ctm));
+        small = mupdf_render_display_list(ctx, list, fz_concat(ctm, fz_scale(scale, scale)), cs, alpha, hints, NULL);
+        pixmap = fz_scale_pixmap(ctx, small, bbox.x0, bbox.y0, bbox.x1 - bbox.x0, bbox.y1 - bbox.y0, NULL);
+        if (!pixmap)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "cannot scale preview");
     }
-    if (result == NULL) {
-        return NULL;
-    }
-    fz_try(ctx)
+    fz_always(ctx)
     {
-        *hit_count = fz_search_display_list(ctx, list, needle, result, hit_max);
+        fz_drop_pixmap(ctx, small);
     }
     fz_catch(ctx)
     {
-        fz_free(ctx, result);
         mupdf_save_error(ctx, errptr);
     }
-    return result;
+    return pixmap;
 }
 
-/* PDFObject */
-pdf_obj *mupdf_pdf_clone_obj(fz_context *ctx, pdf_obj *self, mupdf_error_t **errptr)
+fz_stext_page *mupdf_display_list_to_text_page(fz_context *ctx, fz_display_list *list, int flags, mupdf_error_t **errptr)
 {
-    pdf_obj *obj = NULL;
+    fz_stext_page *text_page = NULL;
+    fz_stext_options opts = {0};
+    opts.flags = flags;
     fz_try(ctx)
     {
-        obj = pdf_deep_copy_obj(ctx, self);
+        text_page = fz_new_stext_page_from_display_list(ctx, list, &opts);
     }
     fz_catch(ctx)
     {
         mupdf_save_error(ctx, errptr);
     }
-    return obj;
+    return text_page;
 }
 
-pdf_document *mupdf_pdf_get_bound_document(fz_context *ctx, pdf_obj *obj)
+/* Like mupdf_page_write_svg, display lists can be written on several threads at once */
+void mupdf_display_list_write_svg(fz_context *ctx, fz_display_list *list, fz_output *out, fz_matrix ctm, int text_format, bool reuse_images, fz_cookie *cookie, mupdf_error_t **errptr)
 {
-    pdf_document *pdf = NULL;
+    fz_device *dev = NULL;
+    fz_var(dev);
     fz_try(ctx)
     {
-        pdf = pdf_get_bound_document(ctx, obj);
-        pdf_keep_document(ctx, pdf);
-    }
-    fz_catch(ctx)
-    {
+        fz_rect tbounds = fz_transform_rect(fz_bound_display_list(ctx, list), ctm);
+        dev = fz_new_svg_device(ctx, out, tbounds.x1 - tbounds.x0, tbounds.y1 - tbounds.y0, text_format, reuse_images);
+        fz_run_display_list(ctx, list, dev, ctm, fz_infinite_rect, cookie);
+        fz_close_device(ctx, dev);
+        fz_close_output(ctx, out);
     }
-    return pdf;
-}
-
-bool mupdf_pdf_is_indirect(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
-{
-    int b = 0;
-    fz_try(ctx)
+    fz_always(ctx)
     {
-        b = pdf_is_indirect(ctx, obj);
+        fz_drop_device(ctx, dev);
     }
     fz_catch(ctx)
     {
         mupdf_save_error(ctx, errptr);
     }
-    return b ? true : false;
 }
 
-bool mupdf_pdf_is_null(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+/* OCR
+   Tesseract is set up anew by every OCR device, which costs more than recognizing
+   a page. Several pages are therefore stacked one under the other, separated by
+   a gap, and recognized by a single OCR device. What it outputs is then split
+   back into one display list per page, in page coordinates. */
+
+#define MUPDF_OCR_GAP 72
+
+static fz_device *mupdf_new_ocr_device(fz_context *ctx, fz_device *target, fz_matrix ctm, fz_rect mediabox, const char *language)
 {
-    int b = 0;
-    fz_try(ctx)
-    {
-        b = pdf_is_null(ctx, obj);
-    }
-    fz_catch(ctx)
-    {
-        mupdf_save_error(ctx, errptr);
-    }
-    return b ? true : false;
+#if FZ_VERSION_MAJOR > 1 || (FZ_VERSION_MAJOR == 1 && FZ_VERSION_MINOR >= 19)
+    return fz_new_ocr_device(ctx, target, ctm, mediabox, 1, language, NULL, NULL, NULL);
+#else
+    return fz_new_ocr_device(ctx, target, ctm, mediabox, 1, language, NULL, NULL);
+#endif
 }
 
-bool mupdf_pdf_is_bool(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+/* Recognize the text of count lists at dpi, returning for every list a new list with
+   its content followed by the recognized text, drawn invisibly */
+fz_display_list **mupdf_ocr_display_lists(fz_context *ctx, fz_display_list **lists, int count, float dpi, const char *language, mupdf_error_t **errptr)
 {
-    int b = 0;
-    fz_try(ctx)
+    fz_display_list **results = NULL;
+    fz_matrix *placements = NULL;
+    fz_display_list *stacked = NULL;
+    fz_device *list_dev = NULL;
+    fz_device *ocr_dev = NULL;
+    fz_device *page_dev = NULL;
+    fz_path *path = NULL;
+    fz_rect mediabox = fz_empty_rect;
+    fz_matrix to_pixels = fz_scale(dpi / 72, dpi / 72);
+    fz_matrix from_pixels = fz_scale(72 / dpi, 72 / dpi);
+    float y = 0;
+    int i;
+    fz_var(results);
+    fz_var(placements);
+    fz_var(stacked);
+    fz_var(list_dev);
+    fz_var(ocr_dev);
+    fz_var(page_dev);
+    fz_var(path);
+    fz_try(ctx)
+    {
+        results = fz_calloc(ctx, count, sizeof(*results));
+        placements = fz_malloc_array(ctx, count, fz_matrix);
+        for (i = 0; i < count; i++)
+        {
+            fz_rect bounds = fz_bound_display_list(ctx, lists[i]);
+            placements[i] = fz_translate(-bounds.x0, y - bounds.y0);
+            mediabox = fz_union_rect(mediabox, fz_transform_rect(bounds, placements[i]));
+            y += bounds.y1 - bounds.y0 + MUPDF_OCR_GAP;
+        }
+
+        stacked = fz_new_display_list(ctx, fz_transform_rect(mediabox, to_pixels));
+        list_dev = fz_new_list_device(ctx, stacked);
+        ocr_dev = mupdf_new_ocr_device(ctx, list_dev, to_pixels, mediabox, language);
+        for (i = 0; i < count; i++)
+        {
+            /* Keep every page to its own part of the stack */
+            fz_rect bounds = fz_bound_display_list(ctx, lists[i]);
+            fz_matrix ctm = fz_concat(placements[i], to_pixels);
+            path = fz_new_path(ctx);
+            fz_rectto(ctx, path, bounds.x0, bounds.y0, bounds.x1, bounds.y1);
+            fz_clip_path(ctx, ocr_dev, path, 0, ctm, fz_infinite_rect);
+            fz_drop_path(ctx, path);
+            path = NULL;
+            fz_run_display_list(ctx, lists[i], ocr_dev, ctm, fz_infinite_rect, NULL);
+            fz_pop_clip(ctx, ocr_dev);
+        }
+        fz_close_device(ctx, ocr_dev);
+        fz_close_device(ctx, list_dev);
+
+        for (i = 0; i < count; i++)
+        {
+            fz_rect bounds = fz_bound_display_list(ctx, lists[i]);
+            fz_matrix ctm = fz_concat(from_pixels, fz_invert_matrix(placements[i]));
+            results[i] = fz_new_display_list(ctx, bounds);
+            page_dev = fz_new_list_device(ctx, results[i]);
+            fz_run_display_list(ctx, stacked, page_dev, ctm, bounds, NULL);
+            fz_close_device(ctx, page_dev);
+            fz_drop_device(ctx, page_dev);
+            page_dev = NULL;
+        }
+    }
+    fz_always(ctx)
     {
-        b = pdf_is_bool(ctx, obj);
+        fz_drop_path(ctx, path);
+        fz_drop_device(ctx, page_dev);
+        fz_drop_device(ctx, ocr_dev);
+        fz_drop_device(ctx, list_dev);
+        fz_drop_display_list(ctx, stacked);
+        fz_free(ctx, placements);
     }
     fz_catch(ctx)
     {
+        if (results)
+            for (i = 0; i < count; i++)
+                fz_drop_display_list(ctx, results[i]);
+        fz_free(ctx, results);
+        results = NULL;
         mupdf_save_error(ctx, errptr);
     }
-    return b ? true : false;
+    return results;
 }
 
-bool mupdf_pdf_is_int(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+void mupdf_display_list_run(fz_context *ctx, fz_display_list *list, fz_device *device, fz_matrix ctm, fz_rect area, fz_cookie *cookie, mupdf_error_t **errptr)
 {
-    int b = 0;
     fz_try(ctx)
     {
-        b = pdf_is_int(ctx, obj);
+        fz_run_display_list(ctx, list, device, ctm, area, cookie);
     }
     fz_catch(ctx)
     {
         mupdf_save_error(ctx, errptr);
     }
-    return b ? true : false;
 }
 
-bool mupdf_pdf_is_real(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+fz_quad *mupdf_search_display_list(fz_context *ctx, fz_display_list *list, const char *needle, const int hit_max, int *hit_count, mupdf_error_t **errptr)
 {
-    int b = 0;
+    fz_quad *result = NULL;
+    fz_var(result);
     fz_try(ctx)
     {
-        b = pdf_is_real(ctx, obj);
+        result = fz_calloc(ctx, hit_max, sizeof(fz_quad));
     }
     fz_catch(ctx)
     {
         mupdf_save_error(ctx, errptr);
     }
-    return b ? true : false;
-}
-
-bool mupdf_pdf_is_number(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
-{
-    int b = 0;
+    if (result == NULL) {
+        return NULL;
+    }
     fz_try(ctx)
     {
-        b = pdf_is_number(ctx, obj);
+        *hit_count = fz_search_display_list(ctx, list, needle, result, hit_max);
     }
     fz_catch(ctx)
     {
+        fz_free(ctx, result);
         mupdf_save_error(ctx, errptr);
     }
-    return b ? true : false;
+    return result;
 }
 
-bool mupdf_pdf_is_string(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
-{
-    int b = 0;
-    fz_try(ctx)
-    {
-        b = pdf_is_string(ctx, obj);
-    }
-    fz_catch(ctx)
+/* Display list serialization
+
+   A serialized list starts with a magic number, the format version and the
+   mediabox, followed by the device calls made when running the list, each
+   an opcode and its arguments. Fonts and images are handed to a callback and
+   referenced by the hex MD5 of their encoding, so that a store keeps a
+   single copy however many lists use them.
+
+   Colors in colorspaces other than DeviceGray, DeviceRGB, DeviceBGR and
+   DeviceCMYK are converted to DeviceRGB, and filled Type 3 glyphs are
+   recorded as the drawing operations of their content. Lists that clip to,
+   stroke or hide Type 3 text can't be serialized. */
+
+#define MUPDF_DL_MAGIC 0x4c44554d /* "MUDL" */
+#define MUPDF_DL_VERSION 1
+#define MUPDF_DL_DIGEST 32
+
+enum
+{
+    DL_END,
+    DL_FILL_PATH,
+    DL_STROKE_PATH,
+    DL_CLIP_PATH,
+    DL_CLIP_STROKE_PATH,
+    DL_FILL_TEXT,
+    DL_STROKE_TEXT,
+    DL_CLIP_TEXT,
+    DL_CLIP_STROKE_TEXT,
+    DL_IGNORE_TEXT,
+    DL_FILL_SHADE,
+    DL_FILL_IMAGE,
+    DL_FILL_IMAGE_MASK,
+    DL_CLIP_IMAGE_MASK,
+    DL_POP_CLIP,
+    DL_BEGIN_MASK,
+    DL_END_MASK,
+    DL_BEGIN_GROUP,
+    DL_END_GROUP,
+    DL_BEGIN_TILE,
+    DL_END_TILE,
+    DL_RENDER_FLAGS,
+    DL_BEGIN_LAYER,
+    DL_END_LAYER
+};
+
+enum
+{
+    DL_IMAGE_JPEG = 1,
+    DL_IMAGE_PNG,
+    DL_IMAGE_RAW
+};
+
+enum
+{
+    DL_RESOURCE_FONT = 1,
+    DL_RESOURCE_IMAGE
+};
+
+typedef struct
+{
+    const void *ptr;
+    char digest[MUPDF_DL_DIGEST + 1];
+} dl_ref;
+
+typedef struct
+{
+    fz_device super;
+    fz_buffer *buf;
+    void (*put)(void *opaque, const char *digest, const unsigned char *data, size_t len);
+    void *opaque;
+    dl_ref *refs;
+    int len, cap;
+} dl_writer;
+
+typedef struct
+{
+    const unsigned char *p, *end;
+} dl_cursor;
+
+typedef struct
+{
+    char digest[MUPDF_DL_DIGEST + 1];
+    int kind;
+    fz_font *font;
+    fz_image *image;
+} dl_resource;
+
+typedef struct
+{
+    dl_cursor cur;
+    const unsigned char *(*get)(void *opaque, const char *digest, size_t *len);
+    void *opaque;
+    dl_resource *res;
+    int len, cap;
+    /* Depth of the cached tile being skipped */
+    int skip;
+} dl_reader;
+
+static void dl_digest(fz_context *ctx, fz_buffer *buf, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[16];
+    unsigned char *data;
+    size_t len = fz_buffer_storage(ctx, buf, &data);
+    fz_md5 md5;
+    int i;
+
+    fz_md5_init(&md5);
+    fz_md5_update(&md5, data, len);
+    fz_md5_final(&md5, digest);
+    for (i = 0; i < 16; i++)
     {
-        mupdf_save_error(ctx, errptr);
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 15];
     }
-    return b ? true : false;
+    hex[MUPDF_DL_DIGEST] = 0;
 }
 
-bool mupdf_pdf_is_name(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+/* Writing */
+
+static void dl_put_float(fz_context *ctx, fz_buffer *buf, float f)
 {
-    int b = 0;
-    fz_try(ctx)
-    {
-        b = pdf_is_name(ctx, obj);
-    }
-    fz_catch(ctx)
-    {
-        mupdf_save_error(ctx, errptr);
-    }
-    return b ? true : false;
+    union { float f; uint32_t u; } v;
+    v.f = f;
+    fz_append_int32_le(ctx, buf, (int)v.u);
 }
 
-bool mupdf_pdf_is_array(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+static void dl_put_matrix(fz_context *ctx, fz_buffer *buf, fz_matrix m)
 {
-    int b = 0;
-    fz_try(ctx)
-    {
-        b = pdf_is_array(ctx, obj);
-    }
-    fz_catch(ctx)
-    {
-        mupdf_save_error(ctx, errptr);
-    }
-    return b ? true : false;
+    dl_put_float(ctx, buf, m.a);
+    dl_put_float(ctx, buf, m.b);
+    dl_put_float(ctx, buf, m.c);
+    dl_put_float(ctx, buf, m.d);
+    dl_put_float(ctx, buf, m.e);
+    dl_put_float(ctx, buf, m.f);
 }
 
-bool mupdf_pdf_is_dict(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+static void dl_put_rect(fz_context *ctx, fz_buffer *buf, fz_rect r)
 {
-    int b = 0;
-    fz_try(ctx)
-    {
-        b = pdf_is_dict(ctx, obj);
-    }
+    dl_put_float(ctx, buf, r.x0);
+    dl_put_float(ctx, buf, r.y0);
+    dl_put_float(ctx, buf, r.x1);
+    dl_put_float(ctx, buf, r.y1);
+}
+
+static void dl_put_params(fz_context *ctx, fz_buffer *buf, fz_color_params cp)
+{
+    fz_append_byte(ctx, buf, cp.ri);
+    fz_append_byte(ctx, buf, cp.bp);
+    fz_append_byte(ctx, buf, cp.op);
+    fz_append_byte(ctx, buf, cp.opm);
+}
+
+static void dl_put_string(fz_context *ctx, fz_buffer *buf, const char *s)
+{
+    size_t len = s ? strlen(s) : 0;
+    fz_append_int32_le(ctx, buf, (int)len);
+    fz_append_data(ctx, buf, s, len);
+}
+
+static int dl_colorspace_tag(fz_context *ctx, fz_colorspace *cs)
+{
+    if (!cs)
+        return 0;
+    if (cs == fz_device_gray(ctx))
+        return 1;
+    if (cs == fz_device_rgb(ctx))
+        return 2;
+    if (cs == fz_device_bgr(ctx))
+        return 3;
+    if (cs == fz_device_cmyk(ctx))
+        return 4;
+    return -1;
+}
+
+/* Write the components of a color in cs, as DeviceRGB if cs can't be recorded */
+static void dl_put_components(fz_context *ctx, fz_buffer *buf, fz_colorspace *cs, const float *color, fz_color_params cp)
+{
+    float rgb[3];
+    int i, n;
+
+    if (dl_colorspace_tag(ctx, cs) < 0)
+    {
+        fz_convert_color(ctx, cs, color, fz_device_rgb(ctx), rgb, NULL, cp);
+        color = rgb;
+        cs = fz_device_rgb(ctx);
+    }
+    n = cs ? fz_colorspace_n(ctx, cs) : 0;
+    for (i = 0; i < n; i++)
+        dl_put_float(ctx, buf, color ? color[i] : 0);
+}
+
+static void dl_put_color(fz_context *ctx, fz_buffer *buf, fz_colorspace *cs, const float *color, fz_color_params cp)
+{
+    int tag = dl_colorspace_tag(ctx, cs);
+    fz_append_byte(ctx, buf, tag < 0 ? 2 : tag);
+    dl_put_components(ctx, buf, cs, color, cp);
+}
+
+static void dl_path_moveto(fz_context *ctx, void *arg, float x, float y)
+{
+    fz_append_byte(ctx, arg, 'M');
+    dl_put_float(ctx, arg, x);
+    dl_put_float(ctx, arg, y);
+}
+
+static void dl_path_lineto(fz_context *ctx, void *arg, float x, float y)
+{
+    fz_append_byte(ctx, arg, 'L');
+    dl_put_float(ctx, arg, x);
+    dl_put_float(ctx, arg, y);
+}
+
+static void dl_path_curveto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2, float x3, float y3)
+{
+    fz_append_byte(ctx, arg, 'C');
+    dl_put_float(ctx, arg, x1);
+    dl_put_float(ctx, arg, y1);
+    dl_put_float(ctx, arg, x2);
+    dl_put_float(ctx, arg, y2);
+    dl_put_float(ctx, arg, x3);
+    dl_put_float(ctx, arg, y3);
+}
+
+static void dl_path_closepath(fz_context *ctx, void *arg)
+{
+    fz_append_byte(ctx, arg, 'Z');
+}
+
+static void dl_path_quadto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2)
+{
+    fz_append_byte(ctx, arg, 'Q');
+    dl_put_float(ctx, arg, x1);
+    dl_put_float(ctx, arg, y1);
+    dl_put_float(ctx, arg, x2);
+    dl_put_float(ctx, arg, y2);
+}
+
+static void dl_path_rectto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2)
+{
+    fz_append_byte(ctx, arg, 'R');
+    dl_put_float(ctx, arg, x1);
+    dl_put_float(ctx, arg, y1);
+    dl_put_float(ctx, arg, x2);
+    dl_put_float(ctx, arg, y2);
+}
+
+static const fz_path_walker dl_path_walker = {
+    dl_path_moveto,
+    dl_path_lineto,
+    dl_path_curveto,
+    dl_path_closepath,
+    dl_path_quadto,
+    NULL,
+    NULL,
+    dl_path_rectto
+};
+
+static void dl_put_path(fz_context *ctx, fz_buffer *buf, const fz_path *path)
+{
+    fz_walk_path(ctx, path, &dl_path_walker, buf);
+    fz_append_byte(ctx, buf, 'E');
+}
+
+static void dl_put_stroke(fz_context *ctx, fz_buffer *buf, const fz_stroke_state *stroke)
+{
+    int i;
+    fz_append_byte(ctx, buf, stroke->start_cap);
+    fz_append_byte(ctx, buf, stroke->dash_cap);
+    fz_append_byte(ctx, buf, stroke->end_cap);
+    fz_append_byte(ctx, buf, stroke->linejoin);
+    dl_put_float(ctx, buf, stroke->linewidth);
+    dl_put_float(ctx, buf, stroke->miterlimit);
+    dl_put_float(ctx, buf, stroke->dash_phase);
+    fz_append_int32_le(ctx, buf, stroke->dash_len);
+    for (i = 0; i < stroke->dash_len; i++)
+        dl_put_float(ctx, buf, stroke->dash_list[i]);
+}
+
+static dl_ref *dl_find_ref(dl_writer *wri, const void *ptr)
+{
+    int i;
+    for (i = 0; i < wri->len; i++)
+        if (wri->refs[i].ptr == ptr)
+            return &wri->refs[i];
+    return NULL;
+}
+
+/* Hand an encoded resource to the store and remember its digest */
+static const char *dl_put_resource(fz_context *ctx, dl_writer *wri, const void *ptr, fz_buffer *res)
+{
+    unsigned char *data;
+    size_t len;
+    dl_ref *ref;
+
+    if (wri->len == wri->cap)
+    {
+        int cap = wri->cap ? wri->cap * 2 : 32;
+        wri->refs = fz_realloc(ctx, wri->refs, cap * sizeof(dl_ref));
+        wri->cap = cap;
+    }
+    ref = &wri->refs[wri->len];
+    ref->ptr = ptr;
+    dl_digest(ctx, res, ref->digest);
+    len = fz_buffer_storage(ctx, res, &data);
+    wri->put(wri->opaque, ref->digest, data, len);
+    wri->len++;
+    return ref->digest;
+}
+
+static const char *dl_font_digest(fz_context *ctx, dl_writer *wri, fz_font *font)
+{
+    dl_ref *ref = dl_find_ref(wri, font);
+    fz_buffer *res = NULL;
+    const char *digest = NULL;
+
+    if (ref)
+        return ref->digest;
+
+    fz_var(res);
+    fz_try(ctx)
+    {
+        res = fz_new_buffer(ctx, font->buffer->len + 64);
+        dl_put_string(ctx, res, fz_font_name(ctx, font));
+        fz_append_byte(ctx, res, font->flags.fake_bold | (font->flags.fake_italic << 1));
+        fz_append_buffer(ctx, res, font->buffer);
+        digest = dl_put_resource(ctx, wri, font, res);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_buffer(ctx, res);
+    }
+    fz_catch(ctx)
+    {
+        fz_rethrow(ctx);
+    }
+    return digest;
+}
+
+static const char *dl_image_digest(fz_context *ctx, dl_writer *wri, fz_image *image)
+{
+    dl_ref *ref = dl_find_ref(wri, image);
+    fz_compressed_buffer *cbuf;
+    fz_buffer *res = NULL;
+    fz_pixmap *pix = NULL;
+    fz_pixmap *converted = NULL;
+    fz_output *out = NULL;
+    const char *digest = NULL;
+    int tag, y;
+
+    if (ref)
+        return ref->digest;
+
+    fz_var(res);
+    fz_var(pix);
+    fz_var(converted);
+    fz_var(out);
+    fz_try(ctx)
+    {
+        res = fz_new_buffer(ctx, 1024);
+        cbuf = fz_compressed_image_buffer(ctx, image);
+        tag = dl_colorspace_tag(ctx, image->colorspace);
+        if (cbuf && cbuf->params.type == FZ_IMAGE_JPEG && cbuf->params.u.jpeg.color_transform == -1 &&
+            (tag == 1 || tag == 2) && image->bpc == 8 && !image->imagemask && !image->use_decode && !image->use_colorkey)
+        {
+            /* Keep the original JPEG data */
+            fz_append_byte(ctx, res, DL_IMAGE_JPEG);
+        }
+        else
+        {
+            pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+            if (pix->colorspace && dl_colorspace_tag(ctx, pix->colorspace) < 0)
+            {
+                converted = fz_convert_pixmap(ctx, pix, fz_device_rgb(ctx), NULL, NULL, fz_default_color_params, 1);
+                fz_drop_pixmap(ctx, pix);
+                pix = converted;
+                converted = NULL;
+            }
+            if (pix->s)
+                fz_throw(ctx, FZ_ERROR_GENERIC, "cannot serialize images with spot colors");
+            tag = dl_colorspace_tag(ctx, pix->colorspace);
+            fz_append_byte(ctx, res, (tag == 1 || tag == 2) && !pix->alpha ? DL_IMAGE_PNG : DL_IMAGE_RAW);
+        }
+        fz_append_byte(ctx, res, image->imagemask | (image->interpolate << 1));
+        fz_append_int32_le(ctx, res, image->xres);
+        fz_append_int32_le(ctx, res, image->yres);
+        if (!pix)
+        {
+            fz_append_buffer(ctx, res, cbuf->buffer);
+        }
+        else if ((tag == 1 || tag == 2) && !pix->alpha)
+        {
+            out = fz_new_output_with_buffer(ctx, res);
+            fz_write_pixmap_as_png(ctx, out, pix);
+            fz_close_output(ctx, out);
+        }
+        else
+        {
+            fz_append_byte(ctx, res, tag);
+            fz_append_byte(ctx, res, pix->alpha);
+            fz_append_byte(ctx, res, pix->n);
+            fz_append_int32_le(ctx, res, pix->w);
+            fz_append_int32_le(ctx, res, pix->h);
+            for (y = 0; y < pix->h; y++)
+                fz_append_data(ctx, res, pix->samples + y * pix->stride, (size_t)pix->w * pix->n);
+        }
+        digest = dl_put_resource(ctx, wri, image, res);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_output(ctx, out);
+        fz_drop_pixmap(ctx, pix);
+        fz_drop_pixmap(ctx, converted);
+        fz_drop_buffer(ctx, res);
+    }
+    fz_catch(ctx)
+    {
+        fz_rethrow(ctx);
+    }
+    return digest;
+}
+
+/* Only glyphs of fonts with data are recorded as text, the caller of a fill
+   records Type 3 glyphs itself */
+static void dl_put_text(fz_context *ctx, dl_writer *wri, const fz_text *text, int fill)
+{
+    fz_buffer *buf = wri->buf;
+    fz_text_span *span;
+    int count = 0;
+    int i;
+
+    for (span = text->head; span; span = span->next)
+        if (span->font->buffer)
+            count++;
+        else if (!fill)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "cannot serialize type 3 text that is not filled");
+
+    fz_append_int32_le(ctx, buf, count);
+    for (span = text->head; span; span = span->next)
+    {
+        if (!span->font->buffer)
+            continue;
+        fz_append_data(ctx, buf, dl_font_digest(ctx, wri, span->font), MUPDF_DL_DIGEST);
+        dl_put_matrix(ctx, buf, span->trm);
+        fz_append_byte(ctx, buf, span->wmode);
+        fz_append_byte(ctx, buf, span->bidi_level);
+        fz_append_byte(ctx, buf, span->markup_dir);
+        fz_append_int32_le(ctx, buf, span->language);
+        fz_append_int32_le(ctx, buf, span->len);
+        for (i = 0; i < span->len; i++)
+        {
+            dl_put_float(ctx, buf, span->items[i].x);
+            dl_put_float(ctx, buf, span->items[i].y);
+            fz_append_int32_le(ctx, buf, span->items[i].gid);
+            fz_append_int32_le(ctx, buf, span->items[i].ucs);
+        }
+    }
+}
+
+static int dl_shade_supported(fz_context *ctx, fz_shade *shade)
+{
+    /* Vertex colors of meshes can't be converted without decoding the mesh */
+    return dl_colorspace_tag(ctx, shade->colorspace) > 0 || shade->use_function || shade->type < FZ_MESH_TYPE4;
+}
+
+static void dl_put_shade(fz_context *ctx, fz_buffer *buf, fz_shade *shade, fz_color_params cp)
+{
+    fz_colorspace *cs = shade->colorspace;
+    int n = fz_colorspace_n(ctx, cs);
+    int tag = dl_colorspace_tag(ctx, cs);
+    fz_stream *stm = NULL;
+    fz_buffer *mesh = NULL;
+    int i, count;
+
+    fz_append_int32_le(ctx, buf, shade->type);
+    dl_put_rect(ctx, buf, shade->bbox);
+    dl_put_matrix(ctx, buf, shade->matrix);
+    fz_append_byte(ctx, buf, tag < 0 ? 2 : tag);
+    fz_append_int32_le(ctx, buf, shade->use_background);
+    dl_put_components(ctx, buf, cs, shade->background, cp);
+    fz_append_int32_le(ctx, buf, shade->use_function);
+    if (shade->use_function)
+    {
+        for (i = 0; i < 256; i++)
+        {
+            dl_put_components(ctx, buf, cs, shade->function[i], cp);
+            dl_put_float(ctx, buf, shade->function[i][n]);
+        }
+    }
+
+    switch (shade->type)
+    {
+    case FZ_FUNCTION_BASED:
+        dl_put_matrix(ctx, buf, shade->u.f.matrix);
+        fz_append_int32_le(ctx, buf, shade->u.f.xdivs);
+        fz_append_int32_le(ctx, buf, shade->u.f.ydivs);
+        dl_put_float(ctx, buf, shade->u.f.domain[0][0]);
+        dl_put_float(ctx, buf, shade->u.f.domain[0][1]);
+        dl_put_float(ctx, buf, shade->u.f.domain[1][0]);
+        dl_put_float(ctx, buf, shade->u.f.domain[1][1]);
+        count = (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1);
+        for (i = 0; i < count; i++)
+            dl_put_components(ctx, buf, cs, shade->u.f.fn_vals + i * n, cp);
+        break;
+    case FZ_LINEAR:
+    case FZ_RADIAL:
+        fz_append_int32_le(ctx, buf, shade->u.l_or_r.extend[0]);
+        fz_append_int32_le(ctx, buf, shade->u.l_or_r.extend[1]);
+        for (i = 0; i < 2; i++)
+        {
+            dl_put_float(ctx, buf, shade->u.l_or_r.coords[i][0]);
+            dl_put_float(ctx, buf, shade->u.l_or_r.coords[i][1]);
+            dl_put_float(ctx, buf, shade->u.l_or_r.coords[i][2]);
+        }
+        break;
+    default:
+        fz_append_int32_le(ctx, buf, shade->u.m.vprow);
+        fz_append_int32_le(ctx, buf, shade->u.m.bpflag);
+        fz_append_int32_le(ctx, buf, shade->u.m.bpcoord);
+        fz_append_int32_le(ctx, buf, shade->u.m.bpcomp);
+        dl_put_float(ctx, buf, shade->u.m.x0);
+        dl_put_float(ctx, buf, shade->u.m.x1);
+        dl_put_float(ctx, buf, shade->u.m.y0);
+        dl_put_float(ctx, buf, shade->u.m.y1);
+        count = shade->use_function ? 1 : n;
+        for (i = 0; i < count; i++)
+        {
+            dl_put_float(ctx, buf, shade->u.m.c0[i]);
+            dl_put_float(ctx, buf, shade->u.m.c1[i]);
+        }
+        fz_var(stm);
+        fz_var(mesh);
+        fz_try(ctx)
+        {
+            stm = fz_open_compressed_buffer(ctx, shade->buffer);
+            mesh = fz_read_all(ctx, stm, 1024);
+            fz_append_int32_le(ctx, buf, (int)mesh->len);
+            fz_append_buffer(ctx, buf, mesh);
+        }
+        fz_always(ctx)
+        {
+            fz_drop_stream(ctx, stm);
+            fz_drop_buffer(ctx, mesh);
+        }
+        fz_catch(ctx)
+        {
+            fz_rethrow(ctx);
+        }
+        break;
+    }
+}
+
+static void dl_fill_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    fz_buffer *buf = ((dl_writer *)dev)->buf;
+    fz_append_byte(ctx, buf, DL_FILL_PATH);
+    dl_put_path(ctx, buf, path);
+    fz_append_byte(ctx, buf, even_odd);
+    dl_put_matrix(ctx, buf, ctm);
+    dl_put_color(ctx, buf, cs, color, cp);
+    dl_put_float(ctx, buf, alpha);
+    dl_put_params(ctx, buf, cp);
+}
+
+static void dl_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    fz_buffer *buf = ((dl_writer *)dev)->buf;
+    fz_append_byte(ctx, buf, DL_STROKE_PATH);
+    dl_put_path(ctx, buf, path);
+    dl_put_stroke(ctx, buf, stroke);
+    dl_put_matrix(ctx, buf, ctm);
+    dl_put_color(ctx, buf, cs, color, cp);
+    dl_put_float(ctx, buf, alpha);
+    dl_put_params(ctx, buf, cp);
+}
+
+static void dl_clip_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, fz_matrix ctm, fz_rect scissor)
+{
+    fz_buffer *buf = ((dl_writer *)dev)->buf;
+    fz_append_byte(ctx, buf, DL_CLIP_PATH);
+    dl_put_path(ctx, buf, path);
+    fz_append_byte(ctx, buf, even_odd);
+    dl_put_matrix(ctx, buf, ctm);
+    dl_put_rect(ctx, buf, scissor);
+}
+
+static void dl_clip_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+    fz_buffer *buf = ((dl_writer *)dev)->buf;
+    fz_append_byte(ctx, buf, DL_CLIP_STROKE_PATH);
+    dl_put_path(ctx, buf, path);
+    dl_put_stroke(ctx, buf, stroke);
+    dl_put_matrix(ctx, buf, ctm);
+    dl_put_rect(ctx, buf, scissor);
+}
+
+static void dl_fill_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    dl_writer *wri = (dl_writer *)dev;
+    fz_text_span *span;
+    fz_matrix trm;
+    int i;
+
+    fz_append_byte(ctx, wri->buf, DL_FILL_TEXT);
+    dl_put_text(ctx, wri, text, 1);
+    dl_put_matrix(ctx, wri->buf, ctm);
+    dl_put_color(ctx, wri->buf, cs, color, cp);
+    dl_put_float(ctx, wri->buf, alpha);
+    dl_put_params(ctx, wri->buf, cp);
+
+    /* Record Type 3 glyphs through their content */
+    for (span = text->head; span; span = span->next)
+    {
+        if (span->font->buffer)
+            continue;
+        for (i = 0; i < span->len; i++)
+        {
+            if (span->items[i].gid < 0)
+                continue;
+            trm = span->trm;
+            trm.e = span->items[i].x;
+            trm.f = span->items[i].y;
+            fz_run_t3_glyph(ctx, span->font, span->items[i].gid, fz_concat(trm, ctm), dev);
+        }
+    }
+}
+
+static void dl_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    dl_writer *wri = (dl_writer *)dev;
+    fz_append_byte(ctx, wri->buf, DL_STROKE_TEXT);
+    dl_put_text(ctx, wri, text, 0);
+    dl_put_stroke(ctx, wri->buf, stroke);
+    dl_put_matrix(ctx, wri->buf, ctm);
+    dl_put_color(ctx, wri->buf, cs, color, cp);
+    dl_put_float(ctx, wri->buf, alpha);
+    dl_put_params(ctx, wri->buf, cp);
+}
+
+static void dl_clip_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm, fz_rect scissor)
+{
+    dl_writer *wri = (dl_writer *)dev;
+    fz_append_byte(ctx, wri->buf, DL_CLIP_TEXT);
+    dl_put_text(ctx, wri, text, 0);
+    dl_put_matrix(ctx, wri->buf, ctm);
+    dl_put_rect(ctx, wri->buf, scissor);
+}
+
+static void dl_clip_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+    dl_writer *wri = (dl_writer *)dev;
+    fz_append_byte(ctx, wri->buf, DL_CLIP_STROKE_TEXT);
+    dl_put_text(ctx, wri, text, 0);
+    dl_put_stroke(ctx, wri->buf, stroke);
+    dl_put_matrix(ctx, wri->buf, ctm);
+    dl_put_rect(ctx, wri->buf, scissor);
+}
+
+static void dl_ignore_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm)
+{
+    dl_writer *wri = (dl_writer *)dev;
+    fz_append_byte(ctx, wri->buf, DL_IGNORE_TEXT);
+    dl_put_text(ctx, wri, text, 0);
+    dl_put_matrix(ctx, wri->buf, ctm);
+}
+
+static void dl_fill_shade(fz_context *ctx, fz_device *dev, fz_shade *shade, fz_matrix ctm, float alpha, fz_color_params cp)
+{
+    fz_buffer *buf = ((dl_writer *)dev)->buf;
+    if (!dl_shade_supported(ctx, shade))
+    {
+        fz_warn(ctx, "dropping mesh shading in %s", fz_colorspace_name(ctx, shade->colorspace));
+        return;
+    }
+    fz_append_byte(ctx, buf, DL_FILL_SHADE);
+    dl_put_shade(ctx, buf, shade, cp);
+    dl_put_matrix(ctx, buf, ctm);
+    dl_put_float(ctx, buf, alpha);
+    dl_put_params(ctx, buf, cp);
+}
+
+static void dl_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, float alpha, fz_color_params cp)
+{
+    dl_writer *wri = (dl_writer *)dev;
+    const char *digest = dl_image_digest(ctx, wri, image);
+    fz_append_byte(ctx, wri->buf, DL_FILL_IMAGE);
+    fz_append_data(ctx, wri->buf, digest, MUPDF_DL_DIGEST);
+    dl_put_matrix(ctx, wri->buf, ctm);
+    dl_put_float(ctx, wri->buf, alpha);
+    dl_put_params(ctx, wri->buf, cp);
+}
+
+static void dl_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    dl_writer *wri = (dl_writer *)dev;
+    const char *digest = dl_image_digest(ctx, wri, image);
+    fz_append_byte(ctx, wri->buf, DL_FILL_IMAGE_MASK);
+    fz_append_data(ctx, wri->buf, digest, MUPDF_DL_DIGEST);
+    dl_put_matrix(ctx, wri->buf, ctm);
+    dl_put_color(ctx, wri->buf, cs, color, cp);
+    dl_put_float(ctx, wri->buf, alpha);
+    dl_put_params(ctx, wri->buf, cp);
+}
+
+static void dl_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_rect scissor)
+{
+    dl_writer *wri = (dl_writer *)dev;
+    const char *digest = dl_image_digest(ctx, wri, image);
+    fz_append_byte(ctx, wri->buf, DL_CLIP_IMAGE_MASK);
+    fz_append_data(ctx, wri->buf, digest, MUPDF_DL_DIGEST);
+    dl_put_matrix(ctx, wri->buf, ctm);
+    dl_put_rect(ctx, wri->buf, scissor);
+}
+
+static void dl_pop_clip(fz_context *ctx, fz_device *dev)
+{
+    fz_append_byte(ctx, ((dl_writer *)dev)->buf, DL_POP_CLIP);
+}
+
+static void dl_begin_mask(fz_context *ctx, fz_device *dev, fz_rect area, int luminosity, fz_colorspace *cs, const float *bc, fz_color_params cp)
+{
+    fz_buffer *buf = ((dl_writer *)dev)->buf;
+    fz_append_byte(ctx, buf, DL_BEGIN_MASK);
+    dl_put_rect(ctx, buf, area);
+    fz_append_byte(ctx, buf, luminosity);
+    dl_put_color(ctx, buf, cs, bc, cp);
+    dl_put_params(ctx, buf, cp);
+}
+
+static void dl_end_mask(fz_context *ctx, fz_device *dev)
+{
+    fz_append_byte(ctx, ((dl_writer *)dev)->buf, DL_END_MASK);
+}
+
+static void dl_begin_group(fz_context *ctx, fz_device *dev, fz_rect area, fz_colorspace *cs, int isolated, int knockout, int blendmode, float alpha)
+{
+    fz_buffer *buf = ((dl_writer *)dev)->buf;
+    int tag = dl_colorspace_tag(ctx, cs);
+    fz_append_byte(ctx, buf, DL_BEGIN_GROUP);
+    dl_put_rect(ctx, buf, area);
+    fz_append_byte(ctx, buf, tag < 0 ? 2 : tag);
+    fz_append_byte(ctx, buf, isolated);
+    fz_append_byte(ctx, buf, knockout);
+    fz_append_int32_le(ctx, buf, blendmode);
+    dl_put_float(ctx, buf, alpha);
+}
+
+static void dl_end_group(fz_context *ctx, fz_device *dev)
+{
+    fz_append_byte(ctx, ((dl_writer *)dev)->buf, DL_END_GROUP);
+}
+
+static int dl_begin_tile(fz_context *ctx, fz_device *dev, fz_rect area, fz_rect view, float xstep, float ystep, fz_matrix ctm, int id)
+{
+    fz_buffer *buf = ((dl_writer *)dev)->buf;
+    fz_append_byte(ctx, buf, DL_BEGIN_TILE);
+    dl_put_rect(ctx, buf, area);
+    dl_put_rect(ctx, buf, view);
+    dl_put_float(ctx, buf, xstep);
+    dl_put_float(ctx, buf, ystep);
+    dl_put_matrix(ctx, buf, ctm);
+    fz_append_int32_le(ctx, buf, id);
+    /* Always record the tile content */
+    return 0;
+}
+
+static void dl_end_tile(fz_context *ctx, fz_device *dev)
+{
+    fz_append_byte(ctx, ((dl_writer *)dev)->buf, DL_END_TILE);
+}
+
+static void dl_render_flags(fz_context *ctx, fz_device *dev, int set, int clear)
+{
+    fz_buffer *buf = ((dl_writer *)dev)->buf;
+    fz_append_byte(ctx, buf, DL_RENDER_FLAGS);
+    fz_append_int32_le(ctx, buf, set);
+    fz_append_int32_le(ctx, buf, clear);
+}
+
+static void dl_begin_layer(fz_context *ctx, fz_device *dev, const char *name)
+{
+    fz_buffer *buf = ((dl_writer *)dev)->buf;
+    fz_append_byte(ctx, buf, DL_BEGIN_LAYER);
+    dl_put_string(ctx, buf, name);
+}
+
+static void dl_end_layer(fz_context *ctx, fz_device *dev)
+{
+    fz_append_byte(ctx, ((dl_writer *)dev)->buf, DL_END_LAYER);
+}
+
+static void dl_close_device(fz_context *ctx, fz_device *dev)
+{
+    fz_append_byte(ctx, ((dl_writer *)dev)->buf, DL_END);
+}
+
+static void dl_drop_device(fz_context *ctx, fz_device *dev)
+{
+    fz_free(ctx, ((dl_writer *)dev)->refs);
+}
+
+static fz_device *dl_new_writer(fz_context *ctx, fz_buffer *buf, void (*put)(void *, const char *, const unsigned char *, size_t), void *opaque)
+{
+    dl_writer *wri = fz_new_derived_device(ctx, dl_writer);
+
+    wri->super.close_device = dl_close_device;
+    wri->super.drop_device = dl_drop_device;
+    wri->super.fill_path = dl_fill_path;
+    wri->super.stroke_path = dl_stroke_path;
+    wri->super.clip_path = dl_clip_path;
+    wri->super.clip_stroke_path = dl_clip_stroke_path;
+    wri->super.fill_text = dl_fill_text;
+    wri->super.stroke_text = dl_stroke_text;
+    wri->super.clip_text = dl_clip_text;
+    wri->super.clip_stroke_text = dl_clip_stroke_text;
+    wri->super.ignore_text = dl_ignore_text;
+    wri->super.fill_shade = dl_fill_shade;
+    wri->super.fill_image = dl_fill_image;
+    wri->super.fill_image_mask = dl_fill_image_mask;
+    wri->super.clip_image_mask = dl_clip_image_mask;
+    wri->super.pop_clip = dl_pop_clip;
+    wri->super.begin_mask = dl_begin_mask;
+    wri->super.end_mask = dl_end_mask;
+    wri->super.begin_group = dl_begin_group;
+    wri->super.end_group = dl_end_group;
+    wri->super.begin_tile = dl_begin_tile;
+    wri->super.end_tile = dl_end_tile;
+    wri->super.render_flags = dl_render_flags;
+    wri->super.begin_layer = dl_begin_layer;
+    wri->super.end_layer = dl_end_layer;
+
+    wri->buf = buf;
+    wri->put = put;
+    wri->opaque = opaque;
+    return &wri->super;
+}
+
+/* Reading */
+
+static const unsigned char *dl_get_bytes(fz_context *ctx, dl_cursor *cur, size_t len)
+{
+    const unsigned char *p = cur->p;
+    if ((size_t)(cur->end - cur->p) < len)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "truncated display list data");
+    cur->p += len;
+    return p;
+}
+
+static int dl_get_byte(fz_context *ctx, dl_cursor *cur)
+{
+    return *dl_get_bytes(ctx, cur, 1);
+}
+
+static uint32_t dl_get_u32(fz_context *ctx, dl_cursor *cur)
+{
+    const unsigned char *p = dl_get_bytes(ctx, cur, 4);
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int dl_get_int(fz_context *ctx, dl_cursor *cur)
+{
+    return (int)dl_get_u32(ctx, cur);
+}
+
+/* A count of items of at least item_size bytes each that must still be in the data */
+static int dl_get_count(fz_context *ctx, dl_cursor *cur, size_t item_size)
+{
+    int count = dl_get_int(ctx, cur);
+    if (count < 0 || (size_t)count > (size_t)(cur->end - cur->p) / item_size)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "invalid count in display list data");
+    return count;
+}
+
+static float dl_get_float(fz_context *ctx, dl_cursor *cur)
+{
+    union { float f; uint32_t u; } v;
+    v.u = dl_get_u32(ctx, cur);
+    return v.f;
+}
+
+static fz_matrix dl_get_matrix(fz_context *ctx, dl_cursor *cur)
+{
+    fz_matrix m;
+    m.a = dl_get_float(ctx, cur);
+    m.b = dl_get_float(ctx, cur);
+    m.c = dl_get_float(ctx, cur);
+    m.d = dl_get_float(ctx, cur);
+    m.e = dl_get_float(ctx, cur);
+    m.f = dl_get_float(ctx, cur);
+    return m;
+}
+
+static fz_rect dl_get_rect(fz_context *ctx, dl_cursor *cur)
+{
+    fz_rect r;
+    r.x0 = dl_get_float(ctx, cur);
+    r.y0 = dl_get_float(ctx, cur);
+    r.x1 = dl_get_float(ctx, cur);
+    r.y1 = dl_get_float(ctx, cur);
+    return r;
+}
+
+static fz_color_params dl_get_params(fz_context *ctx, dl_cursor *cur)
+{
+    fz_color_params cp;
+    cp.ri = dl_get_byte(ctx, cur);
+    cp.bp = dl_get_byte(ctx, cur);
+    cp.op = dl_get_byte(ctx, cur);
+    cp.opm = dl_get_byte(ctx, cur);
+    return cp;
+}
+
+static char *dl_get_string(fz_context *ctx, dl_cursor *cur)
+{
+    int len = dl_get_count(ctx, cur, 1);
+    const unsigned char *data = dl_get_bytes(ctx, cur, len);
+    char *s = fz_malloc(ctx, len + 1);
+    memcpy(s, data, len);
+    s[len] = 0;
+    return s;
+}
+
+static fz_colorspace *dl_get_colorspace(fz_context *ctx, dl_cursor *cur)
+{
+    switch (dl_get_byte(ctx, cur))
+    {
+    case 0:
+        return NULL;
+    case 1:
+        return fz_device_gray(ctx);
+    case 2:
+        return fz_device_rgb(ctx);
+    case 3:
+        return fz_device_bgr(ctx);
+    case 4:
+        return fz_device_cmyk(ctx);
+    default:
+        fz_throw(ctx, FZ_ERROR_GENERIC, "invalid colorspace in display list data");
+    }
+}
+
+static void dl_get_components(fz_context *ctx, dl_cursor *cur, fz_colorspace *cs, float *color)
+{
+    int i, n = cs ? fz_colorspace_n(ctx, cs) : 0;
+    for (i = 0; i < n; i++)
+        color[i] = dl_get_float(ctx, cur);
+}
+
+static fz_colorspace *dl_get_color(fz_context *ctx, dl_cursor *cur, float *color)
+{
+    fz_colorspace *cs = dl_get_colorspace(ctx, cur);
+    dl_get_components(ctx, cur, cs, color);
+    return cs;
+}
+
+static fz_path *dl_get_path(fz_context *ctx, dl_cursor *cur)
+{
+    fz_path *path = fz_new_path(ctx);
+    float v[6];
+    int op, i, done = 0;
+
+    fz_try(ctx)
+    {
+        while (!done)
+        {
+            op = dl_get_byte(ctx, cur);
+            for (i = 0; i < (op == 'C' ? 6 : op == 'Q' || op == 'R' ? 4 : op == 'M' || op == 'L' ? 2 : 0); i++)
+                v[i] = dl_get_float(ctx, cur);
+            switch (op)
+            {
+            case 'M':
+                fz_moveto(ctx, path, v[0], v[1]);
+                break;
+            case 'L':
+                fz_lineto(ctx, path, v[0], v[1]);
+                break;
+            case 'C':
+                fz_curveto(ctx, path, v[0], v[1], v[2], v[3], v[4], v[5]);
+                break;
+            case 'Q':
+                fz_quadto(ctx, path, v[0], v[1], v[2], v[3]);
+                break;
+            case 'R':
+                fz_rectto(ctx, path, v[0], v[1], v[2], v[3]);
+                break;
+            case 'Z':
+                fz_closepath(ctx, path);
+                break;
+            case 'E':
+                done = 1;
+                break;
+            default:
+                fz_throw(ctx, FZ_ERROR_GENERIC, "invalid path in display list data");
+            }
+        }
+    }
+    fz_catch(ctx)
+    {
+        fz_drop_path(ctx, path);
+        fz_rethrow(ctx);
+    }
+    return path;
+}
+
+static fz_stroke_state *dl_get_stroke(fz_context *ctx, dl_cursor *cur)
+{
+    int start_cap = dl_get_byte(ctx, cur);
+    int dash_cap = dl_get_byte(ctx, cur);
+    int end_cap = dl_get_byte(ctx, cur);
+    int linejoin = dl_get_byte(ctx, cur);
+    float linewidth = dl_get_float(ctx, cur);
+    float miterlimit = dl_get_float(ctx, cur);
+    float dash_phase = dl_get_float(ctx, cur);
+    int dash_len = dl_get_count(ctx, cur, 4);
+    fz_stroke_state *stroke = fz_new_stroke_state_with_dash_len(ctx, dash_len);
+    int i;
+
+    stroke->start_cap = start_cap;
+    stroke->dash_cap = dash_cap;
+    stroke->end_cap = end_cap;
+    stroke->linejoin = linejoin;
+    stroke->linewidth = linewidth;
+    stroke->miterlimit = miterlimit;
+    stroke->dash_phase = dash_phase;
+    stroke->dash_len = dash_len;
+    for (i = 0; i < dash_len; i++)
+        stroke->dash_list[i] = dl_get_float(ctx, cur);
+    return stroke;
+}
+
+/* Find the resource of a digest, or load its data if it wasn't seen yet.
+   A digest seen before must name a resource of the same kind that loaded. */
+static dl_resource *dl_get_resource(fz_context *ctx, dl_reader *rd, int kind, fz_buffer **data)
+{
+    const unsigned char *digest = dl_get_bytes(ctx, &rd->cur, MUPDF_DL_DIGEST);
+    const unsigned char *bytes;
+    dl_resource *res;
+    size_t len;
+    int i;
+
+    for (i = 0; i < rd->len; i++)
+    {
+        res = &rd->res[i];
+        if (memcmp(res->digest, digest, MUPDF_DL_DIGEST))
+            continue;
+        if (res->kind != kind || (kind == DL_RESOURCE_FONT ? !res->font : !res->image))
+            fz_throw(ctx, FZ_ERROR_GENERIC, "invalid display list resource");
+        return res;
+    }
+
+    if (rd->len == rd->cap)
+    {
+        int cap = rd->cap ? rd->cap * 2 : 32;
+        rd->res = fz_realloc(ctx, rd->res, cap * sizeof(dl_resource));
+        rd->cap = cap;
+    }
+    res = &rd->res[rd->len];
+    memset(res, 0, sizeof(*res));
+    memcpy(res->digest, digest, MUPDF_DL_DIGEST);
+    res->kind = kind;
+    bytes = rd->get(rd->opaque, res->digest, &len);
+    if (!bytes)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "missing display list resource %s", res->digest);
+    *data = fz_new_buffer_from_copied_data(ctx, bytes, len);
+    rd->len++;
+    return res;
+}
+
+static fz_font *dl_get_font(fz_context *ctx, dl_reader *rd)
+{
+    fz_buffer *data = NULL;
+    fz_buffer *font_data = NULL;
+    dl_resource *res = dl_get_resource(ctx, rd, DL_RESOURCE_FONT, &data);
+    dl_cursor cur;
+    char *name = NULL;
+    int style;
+
+    if (!data)
+        return res->font;
+
+    fz_var(font_data);
+    fz_var(name);
+    fz_try(ctx)
+    {
+        cur.p = data->data;
+        cur.end = data->data + data->len;
+        name = dl_get_string(ctx, &cur);
+        style = dl_get_byte(ctx, &cur);
+        font_data = fz_new_buffer_from_copied_data(ctx, cur.p, cur.end - cur.p);
+        res->font = fz_new_font_from_buffer(ctx, name, font_data, 0, 0);
+        res->font->flags.fake_bold = style & 1;
+        res->font->flags.fake_italic = (style >> 1) & 1;
+    }
+    fz_always(ctx)
+    {
+        fz_free(ctx, name);
+        fz_drop_buffer(ctx, font_data);
+        fz_drop_buffer(ctx, data);
+    }
+    fz_catch(ctx)
+    {
+        fz_rethrow(ctx);
+    }
+    return res->font;
+}
+
+static fz_image *dl_get_image(fz_context *ctx, dl_reader *rd)
+{
+    fz_buffer *data = NULL;
+    fz_buffer *file = NULL;
+    fz_pixmap *pix = NULL;
+    dl_resource *res = dl_get_resource(ctx, rd, DL_RESOURCE_IMAGE, &data);
+    fz_colorspace *cs;
+    dl_cursor cur;
+    int kind, flags, xres, yres, alpha, n, w, h, y;
+
+    if (!data)
+        return res->image;
+
+    fz_var(file);
+    fz_var(pix);
+    fz_try(ctx)
+    {
+        cur.p = data->data;
+        cur.end = data->data + data->len;
+        kind = dl_get_byte(ctx, &cur);
+        flags = dl_get_byte(ctx, &cur);
+        xres = dl_get_int(ctx, &cur);
+        yres = dl_get_int(ctx, &cur);
+        if (kind == DL_IMAGE_JPEG || kind == DL_IMAGE_PNG)
+        {
+            file = fz_new_buffer_from_copied_data(ctx, cur.p, cur.end - cur.p);
+            res->image = fz_new_image_from_buffer(ctx, file);
+        }
+        else if (kind == DL_IMAGE_RAW)
+        {
+            cs = dl_get_colorspace(ctx, &cur);
+            alpha = dl_get_byte(ctx, &cur);
+            n = dl_get_byte(ctx, &cur);
+            w = dl_get_int(ctx, &cur);
+            h = dl_get_int(ctx, &cur);
+            /* Check the size against the remaining data before allocating anything */
+            if (alpha > 1 || n == 0 || n != (cs ? fz_colorspace_n(ctx, cs) : 0) + alpha ||
+                w <= 0 || h <= 0 || (size_t)w > (size_t)(cur.end - cur.p) / n / h ||
+                (size_t)w * n * h != (size_t)(cur.end - cur.p))
+                fz_throw(ctx, FZ_ERROR_GENERIC, "invalid image in display list data");
+            pix = fz_new_pixmap(ctx, cs, w, h, NULL, alpha);
+            for (y = 0; y < h; y++)
+                memcpy(pix->samples + y * pix->stride, dl_get_bytes(ctx, &cur, (size_t)w * n), (size_t)w * n);
+            res->image = fz_new_image_from_pixmap(ctx, pix, NULL);
+        }
+        else
+        {
+            fz_throw(ctx, FZ_ERROR_GENERIC, "invalid image in display list data");
+        }
+        res->image->imagemask = flags & 1;
+        res->image->interpolate = (flags >> 1) & 1;
+        res->image->xres = xres;
+        res->image->yres = yres;
+    }
+    fz_always(ctx)
+    {
+        fz_drop_pixmap(ctx, pix);
+        fz_drop_buffer(ctx, file);
+        fz_drop_buffer(ctx, data);
+    }
+    fz_catch(ctx)
+    {
+        fz_rethrow(ctx);
+    }
+    return res->image;
+}
+
+static fz_text *dl_get_text(fz_context *ctx, dl_reader *rd)
+{
+    dl_cursor *cur = &rd->cur;
+    fz_text *text = fz_new_text(ctx);
+    fz_font *font;
+    fz_matrix trm;
+    int spans, wmode, bidi_level, markup_dir, language, len, gid, ucs, i;
+
+    fz_try(ctx)
+    {
+        spans = dl_get_count(ctx, cur, MUPDF_DL_DIGEST);
+        while (spans-- > 0)
+        {
+            font = dl_get_font(ctx, rd);
+            trm = dl_get_matrix(ctx, cur);
+            wmode = dl_get_byte(ctx, cur);
+            bidi_level = dl_get_byte(ctx, cur);
+            markup_dir = dl_get_byte(ctx, cur);
+            language = dl_get_int(ctx, cur);
+            len = dl_get_count(ctx, cur, 16);
+            for (i = 0; i < len; i++)
+            {
+                trm.e = dl_get_float(ctx, cur);
+                trm.f = dl_get_float(ctx, cur);
+                gid = dl_get_int(ctx, cur);
+                ucs = dl_get_int(ctx, cur);
+                fz_show_glyph(ctx, text, font, trm, gid, ucs, wmode, bidi_level, (fz_bidi_direction)markup_dir, (fz_text_language)language);
+            }
+        }
+    }
+    fz_catch(ctx)
+    {
+        fz_drop_text(ctx, text);
+        fz_rethrow(ctx);
+    }
+    return text;
+}
+
+static fz_shade *dl_get_shade(fz_context *ctx, dl_cursor *cur)
+{
+    fz_shade *shade = fz_malloc_struct(ctx, fz_shade);
+    int n, i, k, count;
+
+    FZ_INIT_STORABLE(shade, 1, fz_drop_shade_imp);
+    fz_try(ctx)
+    {
+        shade->type = dl_get_int(ctx, cur);
+        if (shade->type < FZ_FUNCTION_BASED || shade->type > FZ_MESH_TYPE7)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "invalid shading in display list data");
+        shade->bbox = dl_get_rect(ctx, cur);
+        shade->matrix = dl_get_matrix(ctx, cur);
+        shade->colorspace = fz_keep_colorspace(ctx, dl_get_colorspace(ctx, cur));
+        if (!shade->colorspace)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "invalid shading in display list data");
+        n = fz_colorspace_n(ctx, shade->colorspace);
+        shade->use_background = dl_get_int(ctx, cur);
+        dl_get_components(ctx, cur, shade->colorspace, shade->background);
+        shade->use_function = dl_get_int(ctx, cur);
+        if (shade->use_function)
+        {
+            for (i = 0; i < 256; i++)
+            {
+                for (k = 0; k <= n; k++)
+                    shade->function[i][k] = dl_get_float(ctx, cur);
+            }
+        }
+
+        switch (shade->type)
+        {
+        case FZ_FUNCTION_BASED:
+            shade->u.f.matrix = dl_get_matrix(ctx, cur);
+            shade->u.f.xdivs = dl_get_int(ctx, cur);
+            shade->u.f.ydivs = dl_get_int(ctx, cur);
+            if (shade->u.f.xdivs < 0 || shade->u.f.ydivs < 0 || shade->u.f.xdivs > 4096 || shade->u.f.ydivs > 4096)
+                fz_throw(ctx, FZ_ERROR_GENERIC, "invalid shading in display list data");
+            shade->u.f.domain[0][0] = dl_get_float(ctx, cur);
+            shade->u.f.domain[0][1] = dl_get_float(ctx, cur);
+            shade->u.f.domain[1][0] = dl_get_float(ctx, cur);
+            shade->u.f.domain[1][1] = dl_get_float(ctx, cur);
+            count = (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1) * n;
+            if ((size_t)count > (size_t)(cur->end - cur->p) / 4)
+                fz_throw(ctx, FZ_ERROR_GENERIC, "truncated display list data");
+            shade->u.f.fn_vals = fz_malloc(ctx, count * sizeof(float));
+            for (i = 0; i < count; i++)
+                shade->u.f.fn_vals[i] = dl_get_float(ctx, cur);
+            break;
+        case FZ_LINEAR:
+        case FZ_RADIAL:
+            shade->u.l_or_r.extend[0] = dl_get_int(ctx, cur);
+            shade->u.l_or_r.extend[1] = dl_get_int(ctx, cur);
+            for (i = 0; i < 2; i++)
+            {
+                shade->u.l_or_r.coords[i][0] = dl_get_float(ctx, cur);
+                shade->u.l_or_r.coords[i][1] = dl_get_float(ctx, cur);
+                shade->u.l_or_r.coords[i][2] = dl_get_float(ctx, cur);
+            }
+            break;
+        default:
+            shade->u.m.vprow = dl_get_int(ctx, cur);
+            shade->u.m.bpflag = dl_get_int(ctx, cur);
+            shade->u.m.bpcoord = dl_get_int(ctx, cur);
+            shade->u.m.bpcomp = dl_get_int(ctx, cur);
+            shade->u.m.x0 = dl_get_float(ctx, cur);
+            shade->u.m.x1 = dl_get_float(ctx, cur);
+            shade->u.m.y0 = dl_get_float(ctx, cur);
+            shade->u.m.y1 = dl_get_float(ctx, cur);
+            count = shade->use_function ? 1 : n;
+            for (i = 0; i < count; i++)
+            {
+                shade->u.m.c0[i] = dl_get_float(ctx, cur);
+                shade->u.m.c1[i] = dl_get_float(ctx, cur);
+            }
+            count = dl_get_count(ctx, cur, 1);
+            shade->buffer = fz_malloc_struct(ctx, fz_compressed_buffer);
+            shade->buffer->params.type = FZ_IMAGE_RAW;
+            shade->buffer->buffer = fz_new_buffer_from_copied_data(ctx, dl_get_bytes(ctx, cur, count), count);
+            break;
+        }
+    }
+    fz_catch(ctx)
+    {
+        fz_drop_shade(ctx, shade);
+        fz_rethrow(ctx);
+    }
+    return shade;
+}
+
+static void dl_replay_op(fz_context *ctx, dl_reader *rd, fz_device *dev, int op)
+{
+    dl_cursor *cur = &rd->cur;
+    fz_path *path = NULL;
+    fz_stroke_state *stroke = NULL;
+    fz_text *text = NULL;
+    fz_shade *shade = NULL;
+    fz_image *image;
+    char *name = NULL;
+    fz_colorspace *cs;
+    float color[FZ_MAX_COLORS];
+    fz_color_params cp;
+    fz_matrix ctm;
+    fz_rect rect, view;
+    float alpha, xstep, ystep;
+    int even_odd, luminosity, isolated, knockout, blendmode, id, set, clear;
+    int run = rd->skip == 0;
+
+    fz_var(path);
+    fz_var(stroke);
+    fz_var(text);
+    fz_var(shade);
+    fz_var(name);
+    fz_try(ctx)
+    {
+        switch (op)
+        {
+        case DL_FILL_PATH:
+            path = dl_get_path(ctx, cur);
+            even_odd = dl_get_byte(ctx, cur);
+            ctm = dl_get_matrix(ctx, cur);
+            cs = dl_get_color(ctx, cur, color);
+            alpha = dl_get_float(ctx, cur);
+            cp = dl_get_params(ctx, cur);
+            if (run)
+                fz_fill_path(ctx, dev, path, even_odd, ctm, cs, color, alpha, cp);
+            break;
+        case DL_STROKE_PATH:
+            path = dl_get_path(ctx, cur);
+            stroke = dl_get_stroke(ctx, cur);
+            ctm = dl_get_matrix(ctx, cur);
+            cs = dl_get_color(ctx, cur, color);
+            alpha = dl_get_float(ctx, cur);
+            cp = dl_get_params(ctx, cur);
+            if (run)
+                fz_stroke_path(ctx, dev, path, stroke, ctm, cs, color, alpha, cp);
+            break;
+        case DL_CLIP_PATH:
+            path = dl_get_path(ctx, cur);
+            even_odd = dl_get_byte(ctx, cur);
+            ctm = dl_get_matrix(ctx, cur);
+            rect = dl_get_rect(ctx, cur);
+            if (run)
+                fz_clip_path(ctx, dev, path, even_odd, ctm, rect);
+            break;
+        case DL_CLIP_STROKE_PATH:
+            path = dl_get_path(ctx, cur);
+            stroke = dl_get_stroke(ctx, cur);
+            ctm = dl_get_matrix(ctx, cur);
+            rect = dl_get_rect(ctx, cur);
+            if (run)
+                fz_clip_stroke_path(ctx, dev, path, stroke, ctm, rect);
+            break;
+        case DL_FILL_TEXT:
+            text = dl_get_text(ctx, rd);
+            ctm = dl_get_matrix(ctx, cur);
+            cs = dl_get_color(ctx, cur, color);
+            alpha = dl_get_float(ctx, cur);
+            cp = dl_get_params(ctx, cur);
+            if (run)
+                fz_fill_text(ctx, dev, text, ctm, cs, color, alpha, cp);
+            break;
+        case DL_STROKE_TEXT:
+            text = dl_get_text(ctx, rd);
+            stroke = dl_get_stroke(ctx, cur);
+            ctm = dl_get_matrix(ctx, cur);
+            cs = dl_get_color(ctx, cur, color);
+            alpha = dl_get_float(ctx, cur);
+            cp = dl_get_params(ctx, cur);
+            if (run)
+                fz_stroke_text(ctx, dev, text, stroke, ctm, cs, color, alpha, cp);
+            break;
+        case DL_CLIP_TEXT:
+            text = dl_get_text(ctx, rd);
+            ctm = dl_get_matrix(ctx, cur);
+            rect = dl_get_rect(ctx, cur);
+            if (run)
+                fz_clip_text(ctx, dev, text, ctm, rect);
+            break;
+        case DL_CLIP_STROKE_TEXT:
+            text = dl_get_text(ctx, rd);
+            stroke = dl_get_stroke(ctx, cur);
+            ctm = dl_get_matrix(ctx, cur);
+            rect = dl_get_rect(ctx, cur);
+            if (run)
+                fz_clip_stroke_text(ctx, dev, text, stroke, ctm, rect);
+            break;
+        case DL_IGNORE_TEXT:
+            text = dl_get_text(ctx, rd);
+            ctm = dl_get_matrix(ctx, cur);
+            if (run)
+                fz_ignore_text(ctx, dev, text, ctm);
+            break;
+        case DL_FILL_SHADE:
+            shade = dl_get_shade(ctx, cur);
+            ctm = dl_get_matrix(ctx, cur);
+            alpha = dl_get_float(ctx, cur);
+            cp = dl_get_params(ctx, cur);
+            if (run)
+                fz_fill_shade(ctx, dev, shade, ctm, alpha, cp);
+            break;
+        case DL_FILL_IMAGE:
+            image = dl_get_image(ctx, rd);
+            ctm = dl_get_matrix(ctx, cur);
+            alpha = dl_get_float(ctx, cur);
+            cp = dl_get_params(ctx, cur);
+            if (run)
+                fz_fill_image(ctx, dev, image, ctm, alpha, cp);
+            break;
+        case DL_FILL_IMAGE_MASK:
+            image = dl_get_image(ctx, rd);
+            ctm = dl_get_matrix(ctx, cur);
+            cs = dl_get_color(ctx, cur, color);
+            alpha = dl_get_float(ctx, cur);
+            cp = dl_get_params(ctx, cur);
+            if (run)
+                fz_fill_image_mask(ctx, dev, image, ctm, cs, color, alpha, cp);
+            break;
+        case DL_CLIP_IMAGE_MASK:
+            image = dl_get_image(ctx, rd);
+            ctm = dl_get_matrix(ctx, cur);
+            rect = dl_get_rect(ctx, cur);
+            if (run)
+                fz_clip_image_mask(ctx, dev, image, ctm, rect);
+            break;
+        case DL_POP_CLIP:
+            if (run)
+                fz_pop_clip(ctx, dev);
+            break;
+        case DL_BEGIN_MASK:
+            rect = dl_get_rect(ctx, cur);
+            luminosity = dl_get_byte(ctx, cur);
+            cs = dl_get_color(ctx, cur, color);
+            cp = dl_get_params(ctx, cur);
+            if (run)
+                fz_begin_mask(ctx, dev, rect, luminosity, cs, color, cp);
+            break;
+        case DL_END_MASK:
+            if (run)
+                fz_end_mask(ctx, dev);
+            break;
+        case DL_BEGIN_GROUP:
+            rect = dl_get_rect(ctx, cur);
+            cs = dl_get_colorspace(ctx, cur);
+            isolated = dl_get_byte(ctx, cur);
+            knockout = dl_get_byte(ctx, cur);
+            blendmode = dl_get_int(ctx, cur);
+            alpha = dl_get_float(ctx, cur);
+            if (run)
+                fz_begin_group(ctx, dev, rect, cs, isolated, knockout, blendmode, alpha);
+            break;
+        case DL_END_GROUP:
+            if (run)
+                fz_end_group(ctx, dev);
+            break;
+        case DL_BEGIN_TILE:
+            rect = dl_get_rect(ctx, cur);
+            view = dl_get_rect(ctx, cur);
+            xstep = dl_get_float(ctx, cur);
+            ystep = dl_get_float(ctx, cur);
+            ctm = dl_get_matrix(ctx, cur);
+            id = dl_get_int(ctx, cur);
+            /* Like fz_run_display_list, skip the content of tiles the device has cached */
+            if (!run)
+                rd->skip++;
+            else if (fz_begin_tile_id(ctx, dev, rect, view, xstep, ystep, ctm, id))
+                rd->skip = 1;
+            break;
+        case DL_END_TILE:
+            if (rd->skip)
+                rd->skip--;
+            if (rd->skip == 0)
+                fz_end_tile(ctx, dev);
+            break;
+        case DL_RENDER_FLAGS:
+            set = dl_get_int(ctx, cur);
+            clear = dl_get_int(ctx, cur);
+            if (run)
+                fz_render_flags(ctx, dev, set, clear);
+            break;
+        case DL_BEGIN_LAYER:
+            name = dl_get_string(ctx, cur);
+            if (run)
+                fz_begin_layer(ctx, dev, name);
+            break;
+        case DL_END_LAYER:
+            if (run)
+                fz_end_layer(ctx, dev);
+            break;
+        default:
+            fz_throw(ctx, FZ_ERROR_GENERIC, "invalid opcode %d in display list data", op);
+        }
+    }
+    fz_always(ctx)
+    {
+        fz_drop_path(ctx, path);
+        fz_drop_stroke_state(ctx, stroke);
+        fz_drop_text(ctx, text);
+        fz_drop_shade(ctx, shade);
+        fz_free(ctx, name);
+    }
+    fz_catch(ctx)
+    {
+        fz_rethrow(ctx);
+    }
+}
+
+static void dl_drop_reader(fz_context *ctx, dl_reader *rd)
+{
+    int i;
+    for (i = 0; i < rd->len; i++)
+    {
+        fz_drop_font(ctx, rd->res[i].font);
+        fz_drop_image(ctx, rd->res[i].image);
+    }
+    fz_free(ctx, rd->res);
+}
+
+fz_buffer *mupdf_display_list_serialize(fz_context *ctx, fz_display_list *list, void (*put)(void *opaque, const char *digest, const unsigned char *data, size_t len), void *opaque, mupdf_error_t **errptr)
+{
+    fz_buffer *buf = NULL;
+    fz_device *dev = NULL;
+    fz_var(buf);
+    fz_var(dev);
+    fz_try(ctx)
+    {
+        buf = fz_new_buffer(ctx, 4096);
+        fz_append_int32_le(ctx, buf, MUPDF_DL_MAGIC);
+        fz_append_int32_le(ctx, buf, MUPDF_DL_VERSION);
+        dl_put_rect(ctx, buf, fz_bound_display_list(ctx, list));
+        dev = dl_new_writer(ctx, buf, put, opaque);
+        fz_run_display_list(ctx, list, dev, fz_identity, fz_infinite_rect, NULL);
+        fz_close_device(ctx, dev);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_device(ctx, dev);
+    }
+    fz_catch(ctx)
+    {
+        fz_drop_buffer(ctx, buf);
+        buf = NULL;
+        mupdf_save_error(ctx, errptr);
+    }
+    return buf;
+}
+
+fz_display_list *mupdf_display_list_deserialize(fz_context *ctx, const unsigned char *data, size_t len, const unsigned char *(*get)(void *opaque, const char *digest, size_t *len), void *opaque, mupdf_error_t **errptr)
+{
+    fz_display_list *list = NULL;
+    fz_device *dev = NULL;
+    dl_reader rd = { 0 };
+    uint32_t version;
+    int op;
+
+    rd.cur.p = data;
+    rd.cur.end = data + len;
+    rd.get = get;
+    rd.opaque = opaque;
+    fz_var(list);
+    fz_var(dev);
+    fz_var(rd);
+    fz_try(ctx)
+    {
+        if (dl_get_u32(ctx, &rd.cur) != MUPDF_DL_MAGIC)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "not a serialized display list");
+        version = dl_get_u32(ctx, &rd.cur);
+        if (version != MUPDF_DL_VERSION)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "unsupported display list version %u", version);
+        list = fz_new_display_list(ctx, dl_get_rect(ctx, &rd.cur));
+        dev = fz_new_list_device(ctx, list);
+        while ((op = dl_get_byte(ctx, &rd.cur)) != DL_END)
+            dl_replay_op(ctx, &rd, dev, op);
+        fz_close_device(ctx, dev);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_device(ctx, dev);
+        dl_drop_reader(ctx, &rd);
+    }
+    fz_catch(ctx)
+    {
+        fz_drop_display_list(ctx, list);
+        list = NULL;
+        mupdf_save_error(ctx, errptr);
+    }
+    return list;
+}
+
+/* Display list optimization
+
+   The list is run twice. The first run records the extent of every
+   operation and decides which to drop: content outside the mediabox or its
+   clip, top level content covered by a later opaque rectangle, and clips and
+   groups that have no effect or no content. The second run copies the
+   remaining operations to a new list, merging consecutive fills of disjoint
+   paths with the same color into one path.
+
+   Anti-aliased edges are partially covered pixels, so covered content must
+   lie a margin inside its cover, and merged paths a margin apart from each
+   other. With a margin of one unit they share no edge pixel when drawn at
+   72 dpi or more. */
+
+#define OPT_MAX_COVERS 64
+#define OPT_MAX_PIECES 64
+#define OPT_MARGIN 1.0f
+
+enum
+{
+    OPT_KEEP,
+    OPT_CULLED,
+    OPT_COVERED,
+    OPT_COLLAPSED
+};
+
+enum
+{
+    OPT_OTHER,
+    OPT_DRAW,
+    OPT_CLIP,
+    OPT_MASK,
+    OPT_GROUP,
+    OPT_TILE
+};
+
+typedef struct mupdf_optimize_stats
+{
+    int culled;
+    int covered;
+    int collapsed;
+    int merged;
+} mupdf_optimize_stats_t;
+
+typedef struct
+{
+    fz_rect bbox;
+    int end;
+    unsigned char kind;
+    unsigned char drop;
+    /* Opaque rectangle painted by this operation, if any */
+    unsigned char covers;
+    unsigned char top;
+} opt_op;
+
+typedef struct
+{
+    int op;
+    fz_rect clip;
+    fz_rect content;
+    int noop;
+} opt_container;
+
+typedef struct
+{
+    fz_device super;
+    fz_rect mediabox;
+    opt_op *ops;
+    int len, cap;
+    opt_container *stack;
+    int depth, stack_cap;
+    /* Nesting inside tiles, whose content is in pattern space, and groups */
+    int tile;
+    int group;
+} opt_analyzer;
+
+static int opt_rect_contains(fz_rect a, fz_rect b)
+{
+    return b.x0 >= a.x0 && b.y0 >= a.y0 && b.x1 <= a.x1 && b.y1 <= a.y1;
+}
+
+static fz_rect opt_clip(opt_analyzer *an)
+{
+    return an->depth ? an->stack[an->depth - 1].clip : an->mediabox;
+}
+
+typedef struct
+{
+    fz_point p[5];
+    int n;
+    int ok;
+} opt_rect_walk;
+
+static void opt_rect_point(fz_context *ctx, void *arg, float x, float y)
+{
+    opt_rect_walk *w = arg;
+    if (w->n < 5)
+        w->p[w->n].x = x, w->p[w->n].y = y;
+    w->n++;
+}
+
+static void opt_rect_curveto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2, float x3, float y3)
+{
+    ((opt_rect_walk *)arg)->ok = 0;
+}
+
+static void opt_rect_closepath(fz_context *ctx, void *arg)
+{
+}
+
+static void opt_rect_rectto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2)
+{
+    opt_rect_walk *w = arg;
+    opt_rect_point(ctx, arg, x1, y1);
+    opt_rect_point(ctx, arg, x2, y1);
+    opt_rect_point(ctx, arg, x2, y2);
+    opt_rect_point(ctx, arg, x1, y2);
+    w->ok = w->ok && w->n == 4;
+}
+
+static const fz_path_walker opt_rect_walker = {
+    opt_rect_point,
+    opt_rect_point,
+    opt_rect_curveto,
+    opt_rect_closepath,
+    NULL,
+    NULL,
+    NULL,
+    opt_rect_rectto
+};
+
+/* Whether path is a single axis aligned rectangle in device space */
+static int opt_path_is_rect(fz_context *ctx, const fz_path *path, fz_matrix ctm, fz_rect *rect)
+{
+    opt_rect_walk w = { { { 0 } }, 0, 1 };
+    int i, n;
+
+    fz_walk_path(ctx, path, &opt_rect_walker, &w);
+    n = w.n;
+    /* An explicitly closing point is allowed */
+    if (n == 5 && w.p[4].x == w.p[0].x && w.p[4].y == w.p[0].y)
+        n = 4;
+    if (!w.ok || n != 4)
+        return 0;
+    for (i = 0; i < 4; i++)
+        w.p[i] = fz_transform_point(w.p[i], ctm);
+    for (i = 0; i < 4; i++)
+    {
+        fz_point a = w.p[i], b = w.p[(i + 1) % 4];
+        if (a.x != b.x && a.y != b.y)
+            return 0;
+    }
+    *rect = fz_empty_rect;
+    for (i = 0; i < 4; i++)
+        *rect = fz_include_point_in_rect(*rect, w.p[i]);
+    return !fz_is_empty_rect(*rect);
+}
+
+static opt_op *opt_push_op(fz_context *ctx, opt_analyzer *an, int kind, fz_rect bbox)
+{
+    opt_op *op;
+
+    if (an->len == an->cap)
+    {
+        int cap = an->cap ? an->cap * 2 : 256;
+        an->ops = fz_realloc(ctx, an->ops, cap * sizeof(opt_op));
+        an->cap = cap;
+    }
+    op = &an->ops[an->len++];
+    op->kind = kind;
+    op->end = -1;
+    op->covers = 0;
+    op->top = an->depth == 0;
+    op->drop = OPT_KEEP;
+    if (an->tile)
+    {
+        /* Tile content is in pattern space and drawn many times */
+        op->bbox = fz_infinite_rect;
+        return op;
+    }
+    op->bbox = fz_intersect_rect(bbox, opt_clip(an));
+    if (fz_is_empty_rect(op->bbox))
+        op->drop = OPT_CULLED;
+    return op;
+}
+
+static void opt_draw(fz_context *ctx, opt_analyzer *an, fz_rect bbox, float alpha)
+{
+    opt_op *op = opt_push_op(ctx, an, OPT_DRAW, bbox);
+    if (!an->tile && !an->group && alpha == 0)
+        op->drop = OPT_CULLED;
+    if (!op->drop && an->depth)
+    {
+        opt_container *c = &an->stack[an->depth - 1];
+        c->content = fz_union_rect(c->content, op->bbox);
+    }
+}
+
+static void opt_begin(fz_context *ctx, opt_analyzer *an, int kind, fz_rect bbox, int noop)
+{
+    fz_rect parent = opt_clip(an);
+    opt_container *c;
+    opt_op *op;
+
+    op = opt_push_op(ctx, an, kind, bbox);
+    if (an->depth == an->stack_cap)
+    {
+        int cap = an->stack_cap ? an->stack_cap * 2 : 32;
+        an->stack = fz_realloc(ctx, an->stack, cap * sizeof(opt_container));
+        an->stack_cap = cap;
+    }
+    c = &an->stack[an->depth++];
+    c->op = an->len - 1;
+    c->clip = an->tile ? fz_infinite_rect : kind == OPT_GROUP ? parent : op->bbox;
+    c->content = fz_empty_rect;
+    c->noop = noop;
+    if (kind == OPT_TILE)
+        an->tile++;
+    else if (kind == OPT_GROUP)
+        an->group++;
+}
+
+static void opt_end(fz_context *ctx, opt_analyzer *an, int kind)
+{
+    opt_container *c;
+    opt_op *begin;
+    int i;
+
+    if (an->depth == 0 || an->ops[an->stack[an->depth - 1].op].kind != kind)
+    {
+        /* Unbalanced, keep as is */
+        opt_push_op(ctx, an, OPT_OTHER, fz_infinite_rect)->drop = OPT_KEEP;
+        return;
+    }
+    c = &an->stack[--an->depth];
+    begin = &an->ops[c->op];
+    if (kind == OPT_TILE)
+        an->tile--;
+    else if (kind == OPT_GROUP)
+        an->group--;
+    opt_push_op(ctx, an, OPT_OTHER, fz_infinite_rect)->drop = OPT_KEEP;
+    begin = &an->ops[c->op];
+    begin->end = an->len - 1;
+
+    if (an->tile || kind == OPT_TILE)
+    {
+        begin->bbox = fz_infinite_rect;
+    }
+    else if (begin->drop || (kind != OPT_MASK && fz_is_empty_rect(c->content)))
+    {
+        /* Nothing inside can show */
+        int reason = begin->drop ? begin->drop : OPT_COLLAPSED;
+        for (i = c->op; i < an->len; i++)
+            if (!an->ops[i].drop)
+                an->ops[i].drop = reason;
+        begin->bbox = fz_empty_rect;
+    }
+    else
+    {
+        begin->bbox = kind == OPT_MASK ? c->clip : c->content;
+        if (c->noop)
+            begin->drop = an->ops[an->len - 1].drop = OPT_COLLAPSED;
+    }
+
+    if (an->depth && !fz_is_empty_rect(begin->bbox))
+    {
+        opt_container *parent = &an->stack[an->depth - 1];
+        parent->content = fz_union_rect(parent->content, begin->bbox);
+    }
+}
+
+static void opt_fill_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opt_analyzer *an = (opt_analyzer *)dev;
+    fz_rect rect;
+    opt_draw(ctx, an, fz_bound_path(ctx, path, NULL, ctm), alpha);
+    if (an->depth == 0 && alpha == 1 && cs && !cp.op && opt_path_is_rect(ctx, path, ctm, &rect))
+    {
+        an->ops[an->len - 1].covers = 1;
+        an->ops[an->len - 1].bbox = fz_intersect_rect(rect, an->mediabox);
+    }
+}
+
+static void opt_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opt_draw(ctx, (opt_analyzer *)dev, fz_bound_path(ctx, path, stroke, ctm), alpha);
+}
+
+static void opt_clip_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, fz_matrix ctm, fz_rect scissor)
+{
+    opt_analyzer *an = (opt_analyzer *)dev;
+    fz_rect rect;
+    int noop = !an->tile && opt_path_is_rect(ctx, path, ctm, &rect) && opt_rect_contains(rect, opt_clip(an));
+    opt_begin(ctx, an, OPT_CLIP, fz_bound_path(ctx, path, NULL, ctm), noop);
+}
+
+static void opt_clip_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+    opt_begin(ctx, (opt_analyzer *)dev, OPT_CLIP, fz_bound_path(ctx, path, stroke, ctm), 0);
+}
+
+static void opt_fill_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opt_draw(ctx, (opt_analyzer *)dev, fz_bound_text(ctx, text, NULL, ctm), alpha);
+}
+
+static void opt_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opt_draw(ctx, (opt_analyzer *)dev, fz_bound_text(ctx, text, stroke, ctm), alpha);
+}
+
+static void opt_clip_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm, fz_rect scissor)
+{
+    opt_begin(ctx, (opt_analyzer *)dev, OPT_CLIP, fz_bound_text(ctx, text, NULL, ctm), 0);
+}
+
+static void opt_clip_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+    opt_begin(ctx, (opt_analyzer *)dev, OPT_CLIP, fz_bound_text(ctx, text, stroke, ctm), 0);
+}
+
+static void opt_ignore_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm)
+{
+    /* Invisible, but kept for text extraction */
+    opt_push_op(ctx, (opt_analyzer *)dev, OPT_OTHER, fz_infinite_rect)->drop = OPT_KEEP;
+}
+
+static void opt_fill_shade(fz_context *ctx, fz_device *dev, fz_shade *shade, fz_matrix ctm, float alpha, fz_color_params cp)
+{
+    opt_draw(ctx, (opt_analyzer *)dev, fz_bound_shade(ctx, shade, ctm), alpha);
+}
+
+static void opt_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, float alpha, fz_color_params cp)
+{
+    opt_draw(ctx, (opt_analyzer *)dev, fz_transform_rect(fz_unit_rect, ctm), alpha);
+}
+
+static void opt_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opt_draw(ctx, (opt_analyzer *)dev, fz_transform_rect(fz_unit_rect, ctm), alpha);
+}
+
+static void opt_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_rect scissor)
+{
+    opt_begin(ctx, (opt_analyzer *)dev, OPT_CLIP, fz_transform_rect(fz_unit_rect, ctm), 0);
+}
+
+static void opt_pop_clip(fz_context *ctx, fz_device *dev)
+{
+    opt_analyzer *an = (opt_analyzer *)dev;
+    int kind = an->depth ? an->ops[an->stack[an->depth - 1].op].kind : OPT_CLIP;
+    opt_end(ctx, an, kind == OPT_MASK ? OPT_MASK : OPT_CLIP);
+}
+
+static void opt_begin_mask(fz_context *ctx, fz_device *dev, fz_rect area, int luminosity, fz_colorspace *cs, const float *bc, fz_color_params cp)
+{
+    opt_begin(ctx, (opt_analyzer *)dev, OPT_MASK, area, 0);
+}
+
+
+static void opt_begin_group(fz_context *ctx, fz_device *dev, fz_rect area, fz_colorspace *cs, int isolated, int knockout, int blendmode, float alpha)
+{
+    opt_analyzer *an = (opt_analyzer *)dev;
+    /* Inside a mask, clip or group the content is composited as a whole, so
+       removing even a plain group changes how overlapping content blends */
+    int noop = an->depth == 0 && !isolated && !knockout && blendmode == FZ_BLEND_NORMAL && alpha == 1;
+    opt_begin(ctx, an, OPT_GROUP, fz_infinite_rect, noop);
+}
+
+static void opt_end_group(fz_context *ctx, fz_device *dev)
+{
+    opt_end(ctx, (opt_analyzer *)dev, OPT_GROUP);
+}
+
+static int opt_begin_tile(fz_context *ctx, fz_device *dev, fz_rect area, fz_rect view, float xstep, float ystep, fz_matrix ctm, int id)
+{
+    opt_begin(ctx, (opt_analyzer *)dev, OPT_TILE, fz_infinite_rect, 0);
+    return 0;
+}
+
+static void opt_end_tile(fz_context *ctx, fz_device *dev)
+{
+    opt_end(ctx, (opt_analyzer *)dev, OPT_TILE);
+}
+
+static void opt_other(fz_context *ctx, fz_device *dev)
+{
+    opt_push_op(ctx, (opt_analyzer *)dev, OPT_OTHER, fz_infinite_rect)->drop = OPT_KEEP;
+}
+
+static void opt_render_flags(fz_context *ctx, fz_device *dev, int set, int clear)
+{
+    opt_other(ctx, dev);
+}
+
+static void opt_begin_layer(fz_context *ctx, fz_device *dev, const char *name)
+{
+    opt_other(ctx, dev);
+}
+
+static void opt_drop_analyzer(fz_context *ctx, fz_device *dev)
+{
+    opt_analyzer *an = (opt_analyzer *)dev;
+    fz_free(ctx, an->ops);
+    fz_free(ctx, an->stack);
+}
+
+/* Drop top level content hidden by opaque rectangles painted after it */
+static void opt_find_covered(opt_analyzer *an)
+{
+    fz_rect covers[OPT_MAX_COVERS];
+    fz_rect cover;
+    int count = 0;
+    int i, k, smallest;
+
+    for (i = an->len - 1; i >= 0; i--)
+    {
+        opt_op *op = &an->ops[i];
+        if (!op->top || op->drop || op->kind == OPT_OTHER || fz_is_infinite_rect(op->bbox))
+            continue;
+        for (k = 0; k < count; k++)
+            if (opt_rect_contains(covers[k], op->bbox))
+                break;
+        if (k < count)
+        {
+            int end = op->end >= 0 ? op->end : i;
+            for (k = i; k <= end; k++)
+                if (!an->ops[k].drop)
+                    an->ops[k].drop = OPT_COVERED;
+            continue;
+        }
+        if (!op->covers)
+            continue;
+        /* Only the inside of a cover is sure to be fully painted */
+        cover = fz_expand_rect(op->bbox, -OPT_MARGIN);
+        if (fz_is_empty_rect(cover))
+            continue;
+        if (count < OPT_MAX_COVERS)
+        {
+            covers[count++] = cover;
+            continue;
+        }
+        /* Keep the largest covers */
+        smallest = 0;
+        for (k = 1; k < count; k++)
+            if ((covers[k].x1 - covers[k].x0) * (covers[k].y1 - covers[k].y0) <
+                (covers[smallest].x1 - covers[smallest].x0) * (covers[smallest].y1 - covers[smallest].y0))
+                smallest = k;
+        if ((cover.x1 - cover.x0) * (cover.y1 - cover.y0) >
+            (covers[smallest].x1 - covers[smallest].x0) * (covers[smallest].y1 - covers[smallest].y0))
+            covers[smallest] = cover;
+    }
+}
+
+typedef struct
+{
+    fz_device super;
+    fz_device *target;
+    const opt_op *ops;
+    int len;
+    int seq;
+    /* Pending fill, in device space once a second path has been merged */
+    fz_path *path;
+    fz_rect pieces[OPT_MAX_PIECES];
+    int count;
+    int even_odd;
+    fz_matrix ctm;
+    fz_colorspace *cs;
+    float color[FZ_MAX_COLORS];
+    float alpha;
+    fz_color_params cp;
+    int merged;
+} opt_filter;
+
+typedef struct
+{
+    fz_path *path;
+    fz_matrix ctm;
+} opt_append;
+
+static void opt_append_moveto(fz_context *ctx, void *arg, float x, float y)
+{
+    opt_append *a = arg;
+    fz_point p = fz_transform_point_xy(x, y, a->ctm);
+    fz_moveto(ctx, a->path, p.x, p.y);
+}
+
+static void opt_append_lineto(fz_context *ctx, void *arg, float x, float y)
+{
+    opt_append *a = arg;
+    fz_point p = fz_transform_point_xy(x, y, a->ctm);
+    fz_lineto(ctx, a->path, p.x, p.y);
+}
+
+static void opt_append_curveto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2, float x3, float y3)
+{
+    opt_append *a = arg;
+    fz_point p1 = fz_transform_point_xy(x1, y1, a->ctm);
+    fz_point p2 = fz_transform_point_xy(x2, y2, a->ctm);
+    fz_point p3 = fz_transform_point_xy(x3, y3, a->ctm);
+    fz_curveto(ctx, a->path, p1.x, p1.y, p2.x, p2.y, p3.x, p3.y);
+}
+
+static void opt_append_closepath(fz_context *ctx, void *arg)
+{
+    fz_closepath(ctx, ((opt_append *)arg)->path);
+}
+
+static const fz_path_walker opt_append_walker = {
+    opt_append_moveto,
+    opt_append_lineto,
+    opt_append_curveto,
+    opt_append_closepath
+};
+
+static void opt_flush(fz_context *ctx, opt_filter *flt)
+{
+    fz_path *path = flt->path;
+    if (!path)
+        return;
+    flt->path = NULL;
+    fz_try(ctx)
+    {
+        fz_fill_path(ctx, flt->target, path, flt->even_odd, flt->ctm, flt->cs, flt->color, flt->alpha, flt->cp);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_path(ctx, path);
+        fz_drop_colorspace(ctx, flt->cs);
+        flt->cs = NULL;
+    }
+    fz_catch(ctx)
+    {
+        fz_rethrow(ctx);
+    }
+}
+
+/* Whether the operation is kept, flushing the pending fill if so */
+static int opt_next(fz_context *ctx, opt_filter *flt)
+{
+    int seq = flt->seq++;
+    if (seq < flt->len && flt->ops[seq].drop)
+        return 0;
+    opt_flush(ctx, flt);
+    return 1;
+}
+
+static int opt_same_style(fz_context *ctx, opt_filter *flt, int even_odd, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    int i, n;
+    if (flt->even_odd != even_odd || flt->cs != cs || flt->alpha != alpha || memcmp(&flt->cp, &cp, sizeof cp))
+        return 0;
+    n = cs ? fz_colorspace_n(ctx, cs) : 0;
+    for (i = 0; i < n; i++)
+        if (flt->color[i] != color[i])
+            return 0;
+    return 1;
+}
+
+static void opt_filter_fill_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    fz_rect bbox;
+    opt_append append;
+    int seq = flt->seq++;
+    int i, n;
+
+    if (seq < flt->len && flt->ops[seq].drop)
+        return;
+
+    bbox = fz_bound_path(ctx, path, NULL, ctm);
+    if (flt->path && flt->count < OPT_MAX_PIECES && opt_same_style(ctx, flt, even_odd, cs, color, alpha, cp))
+    {
+        /* Overlapping paths can't be merged without changing their winding,
+           nor paths close enough to share an anti-aliased edge pixel */
+        for (i = 0; i < flt->count; i++)
+            if (!fz_is_empty_rect(fz_intersect_rect(flt->pieces[i], fz_expand_rect(bbox, OPT_MARGIN))))
+                break;
+        if (i == flt->count)
+        {
+            if (flt->count == 1)
+            {
+                fz_transform_path(ctx, flt->path, flt->ctm);
+                flt->ctm = fz_identity;
+            }
+            append.path = flt->path;
+            append.ctm = ctm;
+            fz_walk_path(ctx, path, &opt_append_walker, &append);
+            flt->pieces[flt->count++] = bbox;
+            flt->merged++;
+            return;
+        }
+    }
+
+    opt_flush(ctx, flt);
+    flt->path = fz_clone_path(ctx, (fz_path *)path);
+    flt->pieces[0] = bbox;
+    flt->count = 1;
+    flt->even_odd = even_odd;
+    flt->ctm = ctm;
+    flt->cs = fz_keep_colorspace(ctx, cs);
+    n = cs ? fz_colorspace_n(ctx, cs) : 0;
+    for (i = 0; i < n; i++)
+        flt->color[i] = color[i];
+    flt->alpha = alpha;
+    flt->cp = cp;
+}
+
+static void opt_filter_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_stroke_path(ctx, flt->target, path, stroke, ctm, cs, color, alpha, cp);
+}
+
+static void opt_filter_clip_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, fz_matrix ctm, fz_rect scissor)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_clip_path(ctx, flt->target, path, even_odd, ctm, scissor);
+}
+
+static void opt_filter_clip_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_clip_stroke_path(ctx, flt->target, path, stroke, ctm, scissor);
+}
+
+static void opt_filter_fill_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_fill_text(ctx, flt->target, text, ctm, cs, color, alpha, cp);
+}
+
+static void opt_filter_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_stroke_text(ctx, flt->target, text, stroke, ctm, cs, color, alpha, cp);
+}
+
+static void opt_filter_clip_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm, fz_rect scissor)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_clip_text(ctx, flt->target, text, ctm, scissor);
+}
+
+static void opt_filter_clip_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_clip_stroke_text(ctx, flt->target, text, stroke, ctm, scissor);
+}
+
+static void opt_filter_ignore_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_ignore_text(ctx, flt->target, text, ctm);
+}
+
+static void opt_filter_fill_shade(fz_context *ctx, fz_device *dev, fz_shade *shade, fz_matrix ctm, float alpha, fz_color_params cp)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_fill_shade(ctx, flt->target, shade, ctm, alpha, cp);
+}
+
+static void opt_filter_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, float alpha, fz_color_params cp)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_fill_image(ctx, flt->target, image, ctm, alpha, cp);
+}
+
+static void opt_filter_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_fill_image_mask(ctx, flt->target, image, ctm, cs, color, alpha, cp);
+}
+
+static void opt_filter_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_rect scissor)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_clip_image_mask(ctx, flt->target, image, ctm, scissor);
+}
+
+static void opt_filter_pop_clip(fz_context *ctx, fz_device *dev)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_pop_clip(ctx, flt->target);
+}
+
+static void opt_filter_begin_mask(fz_context *ctx, fz_device *dev, fz_rect area, int luminosity, fz_colorspace *cs, const float *bc, fz_color_params cp)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_begin_mask(ctx, flt->target, area, luminosity, cs, bc, cp);
+}
+
+static void opt_filter_end_mask(fz_context *ctx, fz_device *dev)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_end_mask(ctx, flt->target);
+}
+
+static void opt_filter_begin_group(fz_context *ctx, fz_device *dev, fz_rect area, fz_colorspace *cs, int isolated, int knockout, int blendmode, float alpha)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_begin_group(ctx, flt->target, area, cs, isolated, knockout, blendmode, alpha);
+}
+
+static void opt_filter_end_group(fz_context *ctx, fz_device *dev)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_end_group(ctx, flt->target);
+}
+
+static int opt_filter_begin_tile(fz_context *ctx, fz_device *dev, fz_rect area, fz_rect view, float xstep, float ystep, fz_matrix ctm, int id)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_begin_tile_id(ctx, flt->target, area, view, xstep, ystep, ctm, id);
+    /* The content is always needed to keep operations in step with the analysis */
+    return 0;
+}
+
+static void opt_filter_end_tile(fz_context *ctx, fz_device *dev)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_end_tile(ctx, flt->target);
+}
+
+static void opt_filter_render_flags(fz_context *ctx, fz_device *dev, int set, int clear)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_render_flags(ctx, flt->target, set, clear);
+}
+
+static void opt_filter_begin_layer(fz_context *ctx, fz_device *dev, const char *name)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_begin_layer(ctx, flt->target, name);
+}
+
+static void opt_filter_end_layer(fz_context *ctx, fz_device *dev)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    if (opt_next(ctx, flt))
+        fz_end_layer(ctx, flt->target);
+}
+
+static void opt_filter_close_device(fz_context *ctx, fz_device *dev)
+{
+    opt_flush(ctx, (opt_filter *)dev);
+}
+
+static void opt_filter_drop_device(fz_context *ctx, fz_device *dev)
+{
+    opt_filter *flt = (opt_filter *)dev;
+    fz_drop_path(ctx, flt->path);
+    fz_drop_colorspace(ctx, flt->cs);
+}
+
+fz_display_list *mupdf_optimize_display_list(fz_context *ctx, fz_display_list *list, mupdf_optimize_stats_t *stats, mupdf_error_t **errptr)
+{
+    fz_display_list *result = NULL;
+    opt_analyzer *an = NULL;
+    opt_filter *flt = NULL;
+    fz_device *target = NULL;
+    int i;
+
+    fz_var(result);
+    fz_var(an);
+    fz_var(flt);
+    fz_var(target);
+    fz_try(ctx)
+    {
+        an = fz_new_derived_device(ctx, opt_analyzer);
+        an->super.drop_device = opt_drop_analyzer;
+        an->super.fill_path = opt_fill_path;
+        an->super.stroke_path = opt_stroke_path;
+        an->super.clip_path = opt_clip_path;
+        an->super.clip_stroke_path = opt_clip_stroke_path;
+        an->super.fill_text = opt_fill_text;
+        an->super.stroke_text = opt_stroke_text;
+        an->super.clip_text = opt_clip_text;
+        an->super.clip_stroke_text = opt_clip_stroke_text;
+        an->super.ignore_text = opt_ignore_text;
+        an->super.fill_shade = opt_fill_shade;
+        an->super.fill_image = opt_fill_image;
+        an->super.fill_image_mask = opt_fill_image_mask;
+        an->super.clip_image_mask = opt_clip_image_mask;
+        an->super.pop_clip = opt_pop_clip;
+        an->super.begin_mask = opt_begin_mask;
+        an->super.end_mask = opt_other;
+        an->super.begin_group = opt_begin_group;
+        an->super.end_group = opt_end_group;
+        an->super.begin_tile = opt_begin_tile;
+        an->super.end_tile = opt_end_tile;
+        an->super.render_flags = opt_render_flags;
+        an->super.begin_layer = opt_begin_layer;
+        an->super.end_layer = opt_other;
+        an->mediabox = fz_bound_display_list(ctx, list);
+        if (fz_is_empty_rect(an->mediabox))
+            an->mediabox = fz_infinite_rect;
+        fz_run_display_list(ctx, list, &an->super, fz_identity, fz_infinite_rect, NULL);
+        fz_close_device(ctx, &an->super);
+        opt_find_covered(an);
+
+        result = fz_new_display_list(ctx, an->mediabox);
+        target = fz_new_list_device(ctx, result);
+        flt = fz_new_derived_device(ctx, opt_filter);
+        flt->super.close_device = opt_filter_close_device;
+        flt->super.drop_device = opt_filter_drop_device;
+        flt->super.fill_path = opt_filter_fill_path;
+        flt->super.stroke_path = opt_filter_stroke_path;
+        flt->super.clip_path = opt_filter_clip_path;
+        flt->super.clip_stroke_path = opt_filter_clip_stroke_path;
+        flt->super.fill_text = opt_filter_fill_text;
+        flt->super.stroke_text = opt_filter_stroke_text;
+        flt->super.clip_text = opt_filter_clip_text;
+        flt->super.clip_stroke_text = opt_filter_clip_stroke_text;
+        flt->super.ignore_text = opt_filter_ignore_text;
+        flt->super.fill_shade = opt_filter_fill_shade;
+        flt->super.fill_image = opt_filter_fill_image;
+        flt->super.fill_image_mask = opt_filter_fill_image_mask;
+        flt->super.clip_image_mask = opt_filter_clip_image_mask;
+        flt->super.pop_clip = opt_filter_pop_clip;
+        flt->super.begin_mask = opt_filter_begin_mask;
+        flt->super.end_mask = opt_filter_end_mask;
+        flt->super.begin_group = opt_filter_begin_group;
+        flt->super.end_group = opt_filter_end_group;
+        flt->super.begin_tile = opt_filter_begin_tile;
+        flt->super.end_tile = opt_filter_end_tile;
+        flt->super.render_flags = opt_filter_render_flags;
+        flt->super.begin_layer = opt_filter_begin_layer;
+        flt->super.end_layer = opt_filter_end_layer;
+        flt->target = target;
+        flt->ops = an->ops;
+        flt->len = an->len;
+        fz_run_display_list(ctx, list, &flt->super, fz_identity, fz_infinite_rect, NULL);
+        fz_close_device(ctx, &flt->super);
+        fz_close_device(ctx, target);
+
+        if (stats)
+        {
+            memset(stats, 0, sizeof *stats);
+            for (i = 0; i < an->len; i++)
+            {
+                if (an->ops[i].drop == OPT_CULLED)
+                    stats->culled++;
+                else if (an->ops[i].drop == OPT_COVERED)
+                    stats->covered++;
+                else if (an->ops[i].drop == OPT_COLLAPSED)
+                    stats->collapsed++;
+            }
+            stats->merged = flt->merged;
+        }
+    }
+    fz_always(ctx)
+    {
+        fz_drop_device(ctx, (fz_device *)flt);
+        fz_drop_device(ctx, target);
+        fz_drop_device(ctx, (fz_device *)an);
+    }
+    fz_catch(ctx)
+    {
+        fz_drop_display_list(ctx, result);
+        result = NULL;
+        mupdf_save_error(ctx, errptr);
+    }
+    return result;
+}
+
+/* Display list spatial index
+
+   The bounds of a list are split into a grid and every operation is copied
+   into the list of each cell it touches, so that rendering an area within
+   one cell only visits the operations that can show there. Clips, masks,
+   groups and tiles are copied to every cell their content may reach, which
+   keeps each cell list balanced. */
+
+typedef struct
+{
+    int x0, y0, x1, y1;
+} idx_range;
+
+typedef struct
+{
+    fz_device super;
+    fz_rect bounds;
+    int cols, rows;
+    fz_device **cells;
+    idx_range *stack;
+    int depth, cap;
+    /* Tile content is in pattern space, it goes wherever the tile does */
+    int tile;
+} idx_device;
+
+#define IDX_FOR_EACH(idx, r, x, y) \
+    for (y = (r).y0; y <= (r).y1; y++) \
+        for (x = (r).x0; x <= (r).x1; x++)
+
+#define IDX_CELL(idx, x, y) ((idx)->cells[(y) * (idx)->cols + (x)])
+
+static idx_range idx_current(idx_device *idx)
+{
+    idx_range all;
+    if (idx->depth)
+        return idx->stack[idx->depth - 1];
+    all.x0 = 0;
+    all.y0 = 0;
+    all.x1 = idx->cols - 1;
+    all.y1 = idx->rows - 1;
+    return all;
+}
+
+static int idx_clamp(float v, int n)
+{
+    if (!(v > 0))
+        return 0;
+    if (v >= n)
+        return n - 1;
+    return (int)v;
+}
+
+/* The cells touched by rect, within the current container */
+static idx_range idx_cells(idx_device *idx, fz_rect rect)
+{
+    idx_range parent = idx_current(idx);
+    idx_range r;
+    float cw = (idx->bounds.x1 - idx->bounds.x0) / idx->cols;
+    float ch = (idx->bounds.y1 - idx->bounds.y0) / idx->rows;
+
+    if (idx->tile || fz_is_infinite_rect(rect))
+        return parent;
+    if (fz_is_empty_rect(rect))
+    {
+        r.x0 = r.y0 = 0;
+        r.x1 = r.y1 = -1;
+        return r;
+    }
+    r.x0 = fz_maxi(parent.x0, idx_clamp((rect.x0 - idx->bounds.x0) / cw, idx->cols));
+    r.y0 = fz_maxi(parent.y0, idx_clamp((rect.y0 - idx->bounds.y0) / ch, idx->rows));
+    r.x1 = fz_mini(parent.x1, idx_clamp((rect.x1 - idx->bounds.x0) / cw, idx->cols));
+    r.y1 = fz_mini(parent.y1, idx_clamp((rect.y1 - idx->bounds.y0) / ch, idx->rows));
+    return r;
+}
+
+static idx_range idx_push(fz_context *ctx, idx_device *idx, fz_rect rect)
+{
+    idx_range r = idx_cells(idx, rect);
+    if (idx->depth == idx->cap)
+    {
+        int cap = idx->cap ? idx->cap * 2 : 32;
+        idx->stack = fz_realloc(ctx, idx->stack, cap * sizeof(idx_range));
+        idx->cap = cap;
+    }
+    idx->stack[idx->depth++] = r;
+    return r;
+}
+
+static idx_range idx_pop(fz_context *ctx, idx_device *idx)
+{
+    idx_range r = idx_current(idx);
+    if (idx->depth)
+        idx->depth--;
+    return r;
+}
+
+static void idx_fill_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_cells(idx, fz_bound_path(ctx, path, NULL, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_fill_path(ctx, IDX_CELL(idx, x, y), path, even_odd, ctm, cs, color, alpha, cp);
+}
+
+static void idx_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_cells(idx, fz_bound_path(ctx, path, stroke, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_stroke_path(ctx, IDX_CELL(idx, x, y), path, stroke, ctm, cs, color, alpha, cp);
+}
+
+static void idx_clip_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, fz_matrix ctm, fz_rect scissor)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_push(ctx, idx, fz_bound_path(ctx, path, NULL, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_clip_path(ctx, IDX_CELL(idx, x, y), path, even_odd, ctm, scissor);
+}
+
+static void idx_clip_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_push(ctx, idx, fz_bound_path(ctx, path, stroke, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_clip_stroke_path(ctx, IDX_CELL(idx, x, y), path, stroke, ctm, scissor);
+}
+
+static void idx_fill_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_cells(idx, fz_bound_text(ctx, text, NULL, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_fill_text(ctx, IDX_CELL(idx, x, y), text, ctm, cs, color, alpha, cp);
+}
+
+static void idx_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_cells(idx, fz_bound_text(ctx, text, stroke, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_stroke_text(ctx, IDX_CELL(idx, x, y), text, stroke, ctm, cs, color, alpha, cp);
+}
+
+static void idx_clip_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm, fz_rect scissor)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_push(ctx, idx, fz_bound_text(ctx, text, NULL, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_clip_text(ctx, IDX_CELL(idx, x, y), text, ctm, scissor);
+}
+
+static void idx_clip_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_push(ctx, idx, fz_bound_text(ctx, text, stroke, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_clip_stroke_text(ctx, IDX_CELL(idx, x, y), text, stroke, ctm, scissor);
+}
+
+static void idx_ignore_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_cells(idx, fz_bound_text(ctx, text, NULL, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_ignore_text(ctx, IDX_CELL(idx, x, y), text, ctm);
+}
+
+static void idx_fill_shade(fz_context *ctx, fz_device *dev, fz_shade *shade, fz_matrix ctm, float alpha, fz_color_params cp)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_cells(idx, fz_bound_shade(ctx, shade, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_fill_shade(ctx, IDX_CELL(idx, x, y), shade, ctm, alpha, cp);
+}
+
+static void idx_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, float alpha, fz_color_params cp)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_cells(idx, fz_transform_rect(fz_unit_rect, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_fill_image(ctx, IDX_CELL(idx, x, y), image, ctm, alpha, cp);
+}
+
+static void idx_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_cells(idx, fz_transform_rect(fz_unit_rect, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_fill_image_mask(ctx, IDX_CELL(idx, x, y), image, ctm, cs, color, alpha, cp);
+}
+
+static void idx_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_rect scissor)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_push(ctx, idx, fz_transform_rect(fz_unit_rect, ctm));
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_clip_image_mask(ctx, IDX_CELL(idx, x, y), image, ctm, scissor);
+}
+
+static void idx_pop_clip(fz_context *ctx, fz_device *dev)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_pop(ctx, idx);
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_pop_clip(ctx, IDX_CELL(idx, x, y));
+}
+
+static void idx_begin_mask(fz_context *ctx, fz_device *dev, fz_rect area, int luminosity, fz_colorspace *cs, const float *bc, fz_color_params cp)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_push(ctx, idx, area);
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_begin_mask(ctx, IDX_CELL(idx, x, y), area, luminosity, cs, bc, cp);
+}
+
+static void idx_end_mask(fz_context *ctx, fz_device *dev)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_current(idx);
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_end_mask(ctx, IDX_CELL(idx, x, y));
+}
+
+static void idx_begin_group(fz_context *ctx, fz_device *dev, fz_rect area, fz_colorspace *cs, int isolated, int knockout, int blendmode, float alpha)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_push(ctx, idx, area);
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_begin_group(ctx, IDX_CELL(idx, x, y), area, cs, isolated, knockout, blendmode, alpha);
+}
+
+static void idx_end_group(fz_context *ctx, fz_device *dev)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_pop(ctx, idx);
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_end_group(ctx, IDX_CELL(idx, x, y));
+}
+
+static int idx_begin_tile(fz_context *ctx, fz_device *dev, fz_rect area, fz_rect view, float xstep, float ystep, fz_matrix ctm, int id)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_push(ctx, idx, area);
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_begin_tile_id(ctx, IDX_CELL(idx, x, y), area, view, xstep, ystep, ctm, id);
+    idx->tile++;
+    return 0;
+}
+
+static void idx_end_tile(fz_context *ctx, fz_device *dev)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r;
+    int x, y;
+    if (idx->tile)
+        idx->tile--;
+    r = idx_pop(ctx, idx);
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_end_tile(ctx, IDX_CELL(idx, x, y));
+}
+
+static void idx_render_flags(fz_context *ctx, fz_device *dev, int set, int clear)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_current(idx);
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_render_flags(ctx, IDX_CELL(idx, x, y), set, clear);
+}
+
+static void idx_begin_layer(fz_context *ctx, fz_device *dev, const char *name)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_current(idx);
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_begin_layer(ctx, IDX_CELL(idx, x, y), name);
+}
+
+static void idx_end_layer(fz_context *ctx, fz_device *dev)
+{
+    idx_device *idx = (idx_device *)dev;
+    idx_range r = idx_current(idx);
+    int x, y;
+    IDX_FOR_EACH(idx, r, x, y)
+        fz_end_layer(ctx, IDX_CELL(idx, x, y));
+}
+
+static void idx_close_device(fz_context *ctx, fz_device *dev)
+{
+    idx_device *idx = (idx_device *)dev;
+    int i;
+    for (i = 0; i < idx->cols * idx->rows; i++)
+        fz_close_device(ctx, idx->cells[i]);
+}
+
+static void idx_drop_device(fz_context *ctx, fz_device *dev)
+{
+    idx_device *idx = (idx_device *)dev;
+    int i;
+    if (idx->cells)
+        for (i = 0; i < idx->cols * idx->rows; i++)
+            fz_drop_device(ctx, idx->cells[i]);
+    fz_free(ctx, idx->cells);
+    fz_free(ctx, idx->stack);
+}
+
+/* Split list into a cols by rows grid over bounds, returning the list of each cell, row by row */
+fz_display_list **mupdf_index_display_list(fz_context *ctx, fz_display_list *list, fz_rect bounds, int cols, int rows, mupdf_error_t **errptr)
+{
+    fz_display_list **cells = NULL;
+    idx_device *idx = NULL;
+    fz_rect cell;
+    int i, n;
+
+    fz_var(cells);
+    fz_var(idx);
+    fz_try(ctx)
+    {
+        if (cols < 1 || rows < 1 || cols > 4096 || rows > 4096 || fz_is_empty_rect(bounds) || fz_is_infinite_rect(bounds))
+            fz_throw(ctx, FZ_ERROR_GENERIC, "invalid display list index grid");
+        cells = fz_calloc(ctx, (size_t)cols * rows, sizeof(fz_display_list *));
+        idx = fz_new_derived_device(ctx, idx_device);
+        idx->super.close_device = idx_close_device;
+        idx->super.drop_device = idx_drop_device;
+        idx->super.fill_path = idx_fill_path;
+        idx->super.stroke_path = idx_stroke_path;
+        idx->super.clip_path = idx_clip_path;
+        idx->super.clip_stroke_path = idx_clip_stroke_path;
+        idx->super.fill_text = idx_fill_text;
+        idx->super.stroke_text = idx_stroke_text;
+        idx->super.clip_text = idx_clip_text;
+        idx->super.clip_stroke_text = idx_clip_stroke_text;
+        idx->super.ignore_text = idx_ignore_text;
+        idx->super.fill_shade = idx_fill_shade;
+        idx->super.fill_image = idx_fill_image;
+        idx->super.fill_image_mask = idx_fill_image_mask;
+        idx->super.clip_image_mask = idx_clip_image_mask;
+        idx->super.pop_clip = idx_pop_clip;
+        idx->super.begin_mask = idx_begin_mask;
+        idx->super.end_mask = idx_end_mask;
+        idx->super.begin_group = idx_begin_group;
+        idx->super.end_group = idx_end_group;
+        idx->super.begin_tile = idx_begin_tile;
+        idx->super.end_tile = idx_end_tile;
+        idx->super.render_flags = idx_render_flags;
+        idx->super.begin_layer = idx_begin_layer;
+        idx->super.end_layer = idx_end_layer;
+        idx->bounds = bounds;
+        idx->cols = cols;
+        idx->rows = rows;
+        idx->cells = fz_calloc(ctx, (size_t)cols * rows, sizeof(fz_device *));
+        for (n = 0; n < cols * rows; n++)
+        {
+            cell.x0 = bounds.x0 + (bounds.x1 - bounds.x0) * (n % cols) / cols;
+            cell.x1 = bounds.x0 + (bounds.x1 - bounds.x0) * (n % cols + 1) / cols;
+            cell.y0 = bounds.y0 + (bounds.y1 - bounds.y0) * (n / cols) / rows;
+            cell.y1 = bounds.y0 + (bounds.y1 - bounds.y0) * (n / cols + 1) / rows;
+            cells[n] = fz_new_display_list(ctx, cell);
+            idx->cells[n] = fz_new_list_device(ctx, cells[n]);
+        }
+        fz_run_display_list(ctx, list, &idx->super, fz_identity, fz_infinite_rect, NULL);
+        fz_close_device(ctx, &idx->super);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_device(ctx, (fz_device *)idx);
+    }
+    fz_catch(ctx)
+    {
+        if (cells)
+            for (i = 0; i < cols * rows; i++)
+                fz_drop_display_list(ctx, cells[i]);
+        fz_free(ctx, cells);
+        cells = NULL;
+        mupdf_save_error(ctx, errptr);
+    }
+    return cells;
+}
+
+/* PDFObject */
+pdf_obj *mupdf_pdf_clone_obj(fz_context *ctx, pdf_obj *self, mupdf_error_t **errptr)
+{
+    pdf_obj *obj = NULL;
+    fz_try(ctx)
+    {
+        obj = pdf_deep_copy_obj(ctx, self);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return obj;
+}
+
+pdf_document *mupdf_pdf_get_bound_document(fz_context *ctx, pdf_obj *obj)
+{
+    pdf_document *pdf = NULL;
+    fz_try(ctx)
+    {
+        pdf = pdf_get_bound_document(ctx, obj);
+        pdf_keep_document(ctx, pdf);
+    }
+    fz_catch(ctx)
+    {
+    }
+    return pdf;
+}
+
+bool mupdf_pdf_is_indirect(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+{
+    int b = 0;
+    fz_try(ctx)
+    {
+        b = pdf_is_indirect(ctx, obj);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return b ? true : false;
+}
+
+bool mupdf_pdf_is_null(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+{
+    int b = 0;
+    fz_try(ctx)
+    {
+        b = pdf_is_null(ctx, obj);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return b ? true : false;
+}
+
+bool mupdf_pdf_is_bool(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+{
+    int b = 0;
+    fz_try(ctx)
+    {
+        b = pdf_is_bool(ctx, obj);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return b ? true : false;
+}
+
+bool mupdf_pdf_is_int(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+{
+    int b = 0;
+    fz_try(ctx)
+    {
+        b = pdf_is_int(ctx, obj);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return b ? true : false;
+}
+
+bool mupdf_pdf_is_real(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+{
+    int b = 0;
+    fz_try(ctx)
+    {
+        b = pdf_is_real(ctx, obj);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return b ? true : false;
+}
+
+bool mupdf_pdf_is_number(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+{
+    int b = 0;
+    fz_try(ctx)
+    {
+        b = pdf_is_number(ctx, obj);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return b ? true : false;
+}
+
+bool mupdf_pdf_is_string(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+{
+    int b = 0;
+    fz_try(ctx)
+    {
+        b = pdf_is_string(ctx, obj);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return b ? true : false;
+}
+
+bool mupdf_pdf_is_name(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+{
+    int b = 0;
+    fz_try(ctx)
+    {
+        b = pdf_is_name(ctx, obj);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return b ? true : false;
+}
+
+bool mupdf_pdf_is_array(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+{
+    int b = 0;
+    fz_try(ctx)
+    {
+        b = pdf_is_array(ctx, obj);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return b ? true : false;
+}
+
+bool mupdf_pdf_is_dict(fz_context *ctx, pdf_obj *obj, mupdf_error_t **errptr)
+{
+    int b = 0;
+    fz_try(ctx)
+    {
+        b = pdf_is_dict(ctx, obj);
+    }
     fz_catch(ctx)
     {
         mupdf_save_error(ctx, errptr);
@@ -1912,6 +5107,89 @@ fz_buffer *mupdf_buffer_from_base64(fz_context *ctx, const char *s, mupdf_error_
     return buf;
 }
 
+/* Output */
+
+/* Callbacks of an output implemented by the caller, returning non-zero on failure */
+typedef int(mupdf_output_write_fn)(void *state, const void *data, size_t n);
+typedef int(mupdf_output_seek_fn)(void *state, int64_t offset, int whence);
+typedef int64_t(mupdf_output_tell_fn)(void *state);
+
+typedef struct
+{
+    void *state;
+    mupdf_output_write_fn *write;
+    mupdf_output_seek_fn *seek;
+    mupdf_output_tell_fn *tell;
+} mupdf_callback_output;
+
+static void mupdf_callback_output_write(fz_context *ctx, void *opaque, const void *data, size_t n)
+{
+    mupdf_callback_output *cb = opaque;
+    if (cb->write(cb->state, data, n))
+        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot write to output");
+}
+
+static void mupdf_callback_output_seek(fz_context *ctx, void *opaque, int64_t offset, int whence)
+{
+    mupdf_callback_output *cb = opaque;
+    if (cb->seek(cb->state, offset, whence))
+        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot seek in output");
+}
+
+static int64_t mupdf_callback_output_tell(fz_context *ctx, void *opaque)
+{
+    mupdf_callback_output *cb = opaque;
+    int64_t pos = cb->tell(cb->state);
+    if (pos < 0)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot tell output position");
+    return pos;
+}
+
+static void mupdf_callback_output_drop(fz_context *ctx, void *opaque)
+{
+    fz_free(ctx, opaque);
+}
+
+/* Buffered output through the callbacks, seek and tell may be NULL for streams */
+fz_output *mupdf_new_callback_output(fz_context *ctx, void *state, mupdf_output_write_fn *write, mupdf_output_seek_fn *seek, mupdf_output_tell_fn *tell, mupdf_error_t **errptr)
+{
+    mupdf_callback_output *cb = NULL;
+    fz_output *out = NULL;
+    fz_var(cb);
+    fz_try(ctx)
+    {
+        cb = fz_malloc_struct(ctx, mupdf_callback_output);
+        cb->state = state;
+        cb->write = write;
+        cb->seek = seek;
+        cb->tell = tell;
+        out = fz_new_output(ctx, 8192, cb, mupdf_callback_output_write, NULL, mupdf_callback_output_drop);
+        if (seek)
+            out->seek = mupdf_callback_output_seek;
+        if (tell)
+            out->tell = mupdf_callback_output_tell;
+    }
+    fz_catch(ctx)
+    {
+        if (!out)
+            fz_free(ctx, cb);
+        mupdf_save_error(ctx, errptr);
+    }
+    return out;
+}
+
+void mupdf_close_output(fz_context *ctx, fz_output *out, mupdf_error_t **errptr)
+{
+    fz_try(ctx)
+    {
+        fz_close_output(ctx, out);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+}
+
 /* Document */
 fz_document *mupdf_open_document(fz_context *ctx, const char *filename, mupdf_error_t **errptr)
 {
@@ -2164,6 +5442,235 @@ fz_location mupdf_resolve_link(fz_context *ctx, fz_document *doc, const char *ur
     return loc;
 }
 
+/* Named destinations */
+
+typedef struct mupdf_named_dest
+{
+    char *name;
+    int page;
+    float x, y;
+} mupdf_named_dest_t;
+
+typedef struct
+{
+    mupdf_named_dest_t *items;
+    int len, cap;
+} named_dests;
+
+static void named_dests_add(fz_context *ctx, pdf_document *pdf, named_dests *dests, pdf_obj *name, pdf_obj *dest)
+{
+    pdf_obj *pageobj, *kind;
+    fz_matrix page_ctm;
+    fz_point p = {0, 0};
+    int has_point = 0;
+    int page;
+
+    if (!pdf_is_name(ctx, name))
+        return;
+    if (pdf_is_dict(ctx, dest))
+        dest = pdf_dict_get(ctx, dest, PDF_NAME(D));
+    if (!pdf_is_array(ctx, dest))
+        return;
+
+    pageobj = pdf_array_get(ctx, dest, 0);
+    if (pdf_is_int(ctx, pageobj))
+    {
+        page = pdf_to_int(ctx, pageobj);
+        if (page < 0 || page >= pdf_count_pages(ctx, pdf))
+            return;
+        pageobj = pdf_lookup_page_obj(ctx, pdf, page);
+    }
+    else
+        page = pdf_lookup_page_number(ctx, pdf, pageobj);
+    if (page < 0)
+        return;
+
+    /* Same target points as pdf_parse_link_dest */
+    kind = pdf_array_get(ctx, dest, 1);
+    if (pdf_name_eq(ctx, kind, PDF_NAME(XYZ)))
+    {
+        p.x = pdf_to_real(ctx, pdf_array_get(ctx, dest, 2));
+        p.y = pdf_to_real(ctx, pdf_array_get(ctx, dest, 3));
+        has_point = 1;
+    }
+    else if (pdf_name_eq(ctx, kind, PDF_NAME(FitR)))
+    {
+        p.x = pdf_to_real(ctx, pdf_array_get(ctx, dest, 2));
+        p.y = pdf_to_real(ctx, pdf_array_get(ctx, dest, 5));
+        has_point = 1;
+    }
+    else if (pdf_name_eq(ctx, kind, PDF_NAME(FitH)) || pdf_name_eq(ctx, kind, PDF_NAME(FitBH)))
+    {
+        p.y = pdf_to_real(ctx, pdf_array_get(ctx, dest, 2));
+        has_point = 1;
+    }
+    else if (pdf_name_eq(ctx, kind, PDF_NAME(FitV)) || pdf_name_eq(ctx, kind, PDF_NAME(FitBV)))
+    {
+        p.x = pdf_to_real(ctx, pdf_array_get(ctx, dest, 2));
+        has_point = 1;
+    }
+    if (has_point)
+    {
+        pdf_page_obj_transform(ctx, pageobj, NULL, &page_ctm);
+        p = fz_transform_point(p, page_ctm);
+    }
+
+    if (dests->len == dests->cap)
+    {
+        int cap = dests->cap ? dests->cap * 2 : 64;
+        dests->items = fz_realloc_array(ctx, dests->items, cap, mupdf_named_dest_t);
+        dests->cap = cap;
+    }
+    dests->items[dests->len].name = fz_strdup(ctx, pdf_to_name(ctx, name));
+    dests->items[dests->len].page = page;
+    dests->items[dests->len].x = p.x;
+    dests->items[dests->len].y = p.y;
+    dests->len++;
+}
+
+static void named_dests_add_dict(fz_context *ctx, pdf_document *pdf, named_dests *dests, pdf_obj *dict)
+{
+    int i, n = pdf_dict_len(ctx, dict);
+    for (i = 0; i < n; i++)
+    {
+        fz_try(ctx)
+            named_dests_add(ctx, pdf, dests, pdf_dict_get_key(ctx, dict, i), pdf_dict_get_val(ctx, dict, i));
+        fz_catch(ctx)
+        {
+            fz_rethrow_if(ctx, FZ_ERROR_MEMORY);
+            fz_warn(ctx, "skipping broken named destination");
+        }
+    }
+}
+
+/* Resolve every named destination of a PDF document in one pass over the
+   Dests name tree, with the page tree loaded once for all lookups. Entries
+   of the legacy Root/Dests dictionary come last since they take precedence.
+   Returns NULL with a count of 0 for other document types. */
+mupdf_named_dest_t *mupdf_load_named_dests(fz_context *ctx, fz_document *doc, int *count, mupdf_error_t **errptr)
+{
+    pdf_document *pdf = pdf_specifics(ctx, doc);
+    named_dests dests = {NULL, 0, 0};
+    pdf_obj *tree = NULL;
+    int i;
+    *count = 0;
+    if (!pdf)
+        return NULL;
+    fz_var(dests);
+    fz_var(tree);
+    fz_try(ctx)
+    {
+        pdf_load_page_tree(ctx, pdf);
+        tree = pdf_load_name_tree(ctx, pdf, PDF_NAME(Dests));
+        named_dests_add_dict(ctx, pdf, &dests, tree);
+        named_dests_add_dict(ctx, pdf, &dests, pdf_dict_getl(ctx, pdf_trailer(ctx, pdf), PDF_NAME(Root), PDF_NAME(Dests), NULL));
+    }
+    fz_always(ctx)
+    {
+        pdf_drop_obj(ctx, tree);
+        pdf_drop_page_tree(ctx, pdf);
+    }
+    fz_catch(ctx)
+    {
+        for (i = 0; i < dests.len; i++)
+            fz_free(ctx, dests.items[i].name);
+        fz_free(ctx, dests.items);
+        mupdf_save_error(ctx, errptr);
+        return NULL;
+    }
+    *count = dests.len;
+    return dests.items;
+}
+
+/* Link annotations */
+
+typedef struct mupdf_page_link
+{
+    int page;
+    fz_rect rect;
+    char *uri;
+    /* Page number of internal links, -1 if unresolvable, 0 for external ones */
+    int target;
+} mupdf_page_link_t;
+
+/* Collect the Link annotations of every page of a PDF document straight from
+   the page objects, without loading pages or parsing their contents. */
+mupdf_page_link_t *mupdf_pdf_all_links(fz_context *ctx, pdf_document *pdf, int *count, mupdf_error_t **errptr)
+{
+    mupdf_page_link_t *links = NULL;
+    char *uri = NULL;
+    int len = 0, cap = 0;
+    int i, k, n, annot_count;
+    fz_var(links);
+    fz_var(uri);
+    fz_var(len);
+    fz_var(cap);
+    fz_try(ctx)
+    {
+        pdf_load_page_tree(ctx, pdf);
+        n = pdf_count_pages(ctx, pdf);
+        for (i = 0; i < n; i++)
+        {
+            pdf_obj *pageobj = pdf_lookup_page_obj(ctx, pdf, i);
+            pdf_obj *annots = pdf_dict_get(ctx, pageobj, PDF_NAME(Annots));
+            fz_matrix page_ctm;
+            annot_count = pdf_array_len(ctx, annots);
+            if (annot_count == 0)
+                continue;
+            pdf_page_obj_transform(ctx, pageobj, NULL, &page_ctm);
+            for (k = 0; k < annot_count; k++)
+            {
+                pdf_obj *annot = pdf_array_get(ctx, annots, k);
+                pdf_obj *dest, *action;
+                if (!pdf_name_eq(ctx, pdf_dict_get(ctx, annot, PDF_NAME(Subtype)), PDF_NAME(Link)))
+                    continue;
+
+                /* Same lookup order as pdf_load_link_annots */
+                dest = pdf_dict_get(ctx, annot, PDF_NAME(Dest));
+                if (dest)
+                    uri = pdf_parse_link_dest(ctx, pdf, dest);
+                else
+                {
+                    action = pdf_dict_get(ctx, annot, PDF_NAME(A));
+                    if (!action)
+                        action = pdf_dict_geta(ctx, pdf_dict_get(ctx, annot, PDF_NAME(AA)), PDF_NAME(U), PDF_NAME(D));
+                    uri = pdf_parse_link_action(ctx, pdf, action, i);
+                }
+                if (!uri)
+                    continue;
+
+                if (len == cap)
+                {
+                    cap = cap ? cap * 2 : 64;
+                    links = fz_realloc_array(ctx, links, cap, mupdf_page_link_t);
+                }
+                links[len].page = i;
+                links[len].rect = fz_transform_rect(pdf_to_rect(ctx, pdf_dict_get(ctx, annot, PDF_NAME(Rect))), page_ctm);
+                links[len].uri = uri;
+                links[len].target = fz_is_external_link(ctx, uri) ? 0 : pdf_resolve_link(ctx, pdf, uri, NULL, NULL);
+                uri = NULL;
+                len++;
+            }
+        }
+    }
+    fz_always(ctx)
+    {
+        pdf_drop_page_tree(ctx, pdf);
+    }
+    fz_catch(ctx)
+    {
+        fz_free(ctx, uri);
+        for (i = 0; i < len; i++)
+            fz_free(ctx, links[i].uri);
+        fz_free(ctx, links);
+        links = NULL;
+        len = 0;
+        mupdf_save_error(ctx, errptr);
+    }
+    *count = len;
+    return links;
+}
+
 fz_colorspace *mupdf_document_output_intent(fz_context *ctx, fz_document *doc, mupdf_error_t **errptr)
 {
     fz_colorspace *cs = NULL;
@@ -2214,6 +5721,28 @@ pdf_document *mupdf_pdf_open_document_from_bytes(fz_context *ctx, fz_buffer *byt
     return pdf;
 }
 
+/* Open a document over memory owned by the caller, which must outlive the document */
+pdf_document *mupdf_pdf_open_document_from_shared_bytes(fz_context *ctx, const unsigned char *data, size_t len, mupdf_error_t **errptr)
+{
+    pdf_document *pdf = NULL;
+    fz_stream *stream = NULL;
+    fz_var(stream);
+    fz_try(ctx)
+    {
+        stream = fz_open_memory(ctx, data, len);
+        pdf = pdf_open_document_with_stream(ctx, stream);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_stream(ctx, stream);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return pdf;
+}
+
 pdf_obj *mupdf_pdf_add_object(fz_context *ctx, pdf_document *pdf, pdf_obj *obj, mupdf_error_t **errptr)
 {
     pdf_obj *ind = NULL;
@@ -2346,6 +5875,60 @@ fz_buffer *mupdf_pdf_write_document(fz_context *ctx, pdf_document *pdf, pdf_writ
     return buf;
 }
 
+/* Output into a buffer whose contents will follow `base` bytes written elsewhere */
+typedef struct
+{
+    fz_buffer *buf;
+    int64_t base;
+} mupdf_offset_output;
+
+static void mupdf_offset_output_write(fz_context *ctx, void *opaque, const void *data, size_t n)
+{
+    fz_append_data(ctx, ((mupdf_offset_output *)opaque)->buf, data, n);
+}
+
+static int64_t mupdf_offset_output_tell(fz_context *ctx, void *opaque)
+{
+    mupdf_offset_output *state = opaque;
+    return state->base + (int64_t)state->buf->len;
+}
+
+/* Write the changes made to a document as an incremental update, to be appended to
+   the `base` bytes of the file it was opened from. Writes the whole document when it
+   can't be saved incrementally, `incremental` tells which one was written. */
+fz_buffer *mupdf_pdf_write_changes(fz_context *ctx, pdf_document *pdf, pdf_write_options pwo, size_t base, bool *incremental, mupdf_error_t **errptr)
+{
+    mupdf_offset_output state = {NULL, 0};
+    fz_output *out = NULL;
+    fz_var(out);
+    fz_var(state);
+    fz_try(ctx)
+    {
+        *incremental = pdf_can_be_saved_incrementally(ctx, pdf);
+        pwo.do_incremental = *incremental;
+        state.buf = fz_new_buffer(ctx, 8192);
+        state.base = *incremental ? (int64_t)base : 0;
+        out = fz_new_output(ctx, 0, &state, mupdf_offset_output_write, NULL, NULL);
+        out->tell = mupdf_offset_output_tell;
+        /* The original file may not end with a newline */
+        if (*incremental)
+            fz_write_byte(ctx, out, '\n');
+        pdf_write_document(ctx, pdf, out, &pwo);
+        fz_close_output(ctx, out);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_output(ctx, out);
+    }
+    fz_catch(ctx)
+    {
+        fz_drop_buffer(ctx, state.buf);
+        state.buf = NULL;
+        mupdf_save_error(ctx, errptr);
+    }
+    return state.buf;
+}
+
 void mupdf_pdf_enable_js(fz_context *ctx, pdf_document *pdf, mupdf_error_t **errptr)
 {
     fz_try(ctx)
@@ -2388,15 +5971,57 @@ void mupdf_pdf_calculate_form(fz_context *ctx, pdf_document *pdf, mupdf_error_t
 {
     fz_try(ctx)
     {
-        if (pdf->recalculate)
+        if (pdf->recalculate)
+        {
+            pdf_calculate_form(ctx, pdf);
+        }
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+}
+
+/* Set many form fields at once: values are set without running their triggers,
+   then the form is calculated once and every page's appearances are regenerated
+   in a single pass. Returns the number of fields set. */
+int mupdf_pdf_fill_fields(fz_context *ctx, pdf_document *pdf, const char **names, const char **values, int count, mupdf_error_t **errptr)
+{
+    pdf_obj *fields, *field;
+    pdf_page *page = NULL;
+    int i, n, filled = 0;
+    fz_var(page);
+    fz_var(filled);
+    fz_try(ctx)
+    {
+        fields = pdf_dict_getp(ctx, pdf_trailer(ctx, pdf), "Root/AcroForm/Fields");
+        if (!fields)
+            break;
+        for (i = 0; i < count; i++)
         {
-            pdf_calculate_form(ctx, pdf);
+            field = pdf_lookup_field(ctx, fields, names[i]);
+            if (field && pdf_set_field_value(ctx, pdf, field, values[i], 1))
+                filled++;
+        }
+        if (!filled)
+            break;
+        pdf->recalculate = 1;
+        pdf_calculate_form(ctx, pdf);
+        n = pdf_count_pages(ctx, pdf);
+        for (i = 0; i < n; i++)
+        {
+            page = pdf_load_page(ctx, pdf, i);
+            pdf_update_page(ctx, page);
+            fz_drop_page(ctx, (fz_page *)page);
+            page = NULL;
         }
     }
     fz_catch(ctx)
     {
+        fz_drop_page(ctx, (fz_page *)page);
         mupdf_save_error(ctx, errptr);
     }
+    return filled;
 }
 
 pdf_obj *mupdf_pdf_trailer(fz_context *ctx, pdf_document *pdf, mupdf_error_t **errptr)
@@ -2443,6 +6068,135 @@ int mupdf_pdf_count_objects(fz_context *ctx, pdf_document *pdf, mupdf_error_t **
     return count;
 }
 
+/* Copy obj from another document, renumbering its references through map */
+static pdf_obj *merge_copy(fz_context *ctx, pdf_document *dst, pdf_obj *obj, const int *map, int n)
+{
+    pdf_obj *copy = NULL;
+    pdf_obj *val = NULL;
+    int i, len, num;
+    if (pdf_is_indirect(ctx, obj))
+    {
+        num = pdf_to_num(ctx, obj);
+        if (num <= 0 || num >= n || !map[num])
+            return NULL;
+        return pdf_new_indirect(ctx, dst, map[num], map[num] == num ? pdf_to_gen(ctx, obj) : 0);
+    }
+    if (!pdf_is_dict(ctx, obj) && !pdf_is_array(ctx, obj))
+        return pdf_keep_obj(ctx, obj);
+    fz_var(copy);
+    fz_var(val);
+    fz_try(ctx)
+    {
+        len = pdf_is_dict(ctx, obj) ? pdf_dict_len(ctx, obj) : pdf_array_len(ctx, obj);
+        if (pdf_is_dict(ctx, obj))
+        {
+            copy = pdf_new_dict(ctx, dst, len);
+            for (i = 0; i < len; i++)
+            {
+                val = merge_copy(ctx, dst, pdf_dict_get_val(ctx, obj, i), map, n);
+                pdf_dict_put(ctx, copy, pdf_dict_get_key(ctx, obj, i), val ? val : PDF_NULL);
+                pdf_drop_obj(ctx, val);
+                val = NULL;
+            }
+        }
+        else
+        {
+            copy = pdf_new_array(ctx, dst, len);
+            for (i = 0; i < len; i++)
+            {
+                val = merge_copy(ctx, dst, pdf_array_get(ctx, obj, i), map, n);
+                pdf_array_push(ctx, copy, val ? val : PDF_NULL);
+                pdf_drop_obj(ctx, val);
+                val = NULL;
+            }
+        }
+    }
+    fz_catch(ctx)
+    {
+        pdf_drop_obj(ctx, val);
+        pdf_drop_obj(ctx, copy);
+        fz_rethrow(ctx);
+    }
+    return copy;
+}
+
+/* Apply to dst the objects src changed or created since it was opened from a copy of
+   dst whose first base_len objects match. Objects created in src are added as new
+   objects of dst. An unedited src has no incremental section to take them from. */
+void mupdf_pdf_merge_changes(fz_context *ctx, pdf_document *dst, pdf_document *src, int base_len, mupdf_error_t **errptr)
+{
+    int *map = NULL;
+    pdf_obj *obj = NULL;
+    pdf_obj *copy = NULL;
+    pdf_obj *ref = NULL;
+    fz_buffer *buf = NULL;
+    int n, num;
+    fz_var(map);
+    fz_var(obj);
+    fz_var(copy);
+    fz_var(ref);
+    fz_var(buf);
+    if (src->num_incremental_sections == 0)
+        return;
+    fz_try(ctx)
+    {
+        n = pdf_xref_len(ctx, src);
+        map = fz_calloc(ctx, n, sizeof(int));
+        for (num = 1; num < n; num++)
+        {
+            if (num < base_len)
+                map[num] = num;
+            else if (pdf_xref_is_incremental(ctx, src, num))
+            {
+                obj = pdf_load_object(ctx, src, num);
+                if (obj)
+                    map[num] = pdf_create_object(ctx, dst);
+                pdf_drop_obj(ctx, obj);
+                obj = NULL;
+            }
+        }
+        for (num = 1; num < n; num++)
+        {
+            if (!map[num] || !pdf_xref_is_incremental(ctx, src, num))
+                continue;
+            obj = pdf_load_object(ctx, src, num);
+            if (obj)
+            {
+                copy = merge_copy(ctx, dst, obj, map, n);
+                pdf_update_object(ctx, dst, map[num], copy ? copy : PDF_NULL);
+                ref = pdf_new_indirect(ctx, src, num, 0);
+                if (pdf_is_stream(ctx, ref))
+                {
+                    buf = pdf_load_raw_stream_number(ctx, src, num);
+                    pdf_drop_obj(ctx, ref);
+                    ref = pdf_new_indirect(ctx, dst, map[num], 0);
+                    pdf_update_stream(ctx, dst, ref, buf, 1);
+                    fz_drop_buffer(ctx, buf);
+                    buf = NULL;
+                }
+                pdf_drop_obj(ctx, ref);
+                ref = NULL;
+                pdf_drop_obj(ctx, copy);
+                copy = NULL;
+            }
+            pdf_drop_obj(ctx, obj);
+            obj = NULL;
+        }
+    }
+    fz_always(ctx)
+    {
+        fz_drop_buffer(ctx, buf);
+        pdf_drop_obj(ctx, ref);
+        pdf_drop_obj(ctx, copy);
+        pdf_drop_obj(ctx, obj);
+        fz_free(ctx, map);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+}
+
 pdf_graft_map *mupdf_pdf_new_graft_map(fz_context *ctx, pdf_document *pdf, mupdf_error_t **errptr)
 {
     pdf_graft_map *map = NULL;
@@ -2577,6 +6331,242 @@ void mupdf_pdf_delete_page(fz_context *ctx, pdf_document *pdf, int page_no, mupd
     }
 }
 
+/* Image optimization
+
+   Images are downsampled to a target resolution in three steps: the resolution
+   each image XObject is drawn at is measured by running every page, the images
+   drawn above a threshold are decoded and scaled, which needs no access to the
+   document and can run on several threads, and finally their streams are
+   replaced in the document. */
+
+typedef struct mupdf_image_usage
+{
+    int num;
+    fz_image *image;
+    /* Highest resolution the image is drawn at, 0 if it is never drawn */
+    float dpi;
+} mupdf_image_usage_t;
+
+typedef struct
+{
+    fz_device super;
+    fz_hash_table *table;
+} img_usage_device;
+
+static void img_usage_record(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm)
+{
+    mupdf_image_usage_t *usage = fz_hash_find(ctx, ((img_usage_device *)dev)->table, &image);
+    float sx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
+    float sy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
+    if (!usage || sx <= 0 || sy <= 0)
+        return;
+    usage->dpi = fz_max(usage->dpi, fz_max(image->w * 72 / sx, image->h * 72 / sy));
+}
+
+static void img_usage_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, float alpha, fz_color_params color_params)
+{
+    img_usage_record(ctx, dev, image, ctm);
+}
+
+static void img_usage_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params color_params)
+{
+    img_usage_record(ctx, dev, image, ctm);
+}
+
+static void img_usage_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_rect scissor)
+{
+    img_usage_record(ctx, dev, image, ctm);
+}
+
+/* Whether obj is an image XObject that can be replaced by 8 bit samples */
+static int img_usage_is_candidate(fz_context *ctx, pdf_obj *obj)
+{
+    return pdf_is_stream(ctx, obj) &&
+        pdf_name_eq(ctx, pdf_dict_get(ctx, obj, PDF_NAME(Subtype)), PDF_NAME(Image)) &&
+        !pdf_dict_get_bool(ctx, obj, PDF_NAME(ImageMask)) &&
+        !pdf_is_array(ctx, pdf_dict_get(ctx, obj, PDF_NAME(Mask)));
+}
+
+/* The image XObjects of pdf with the highest resolution each is drawn at on any page */
+mupdf_image_usage_t *mupdf_pdf_image_usage(fz_context *ctx, pdf_document *pdf, int *count, mupdf_error_t **errptr)
+{
+    mupdf_image_usage_t *images = NULL;
+    fz_hash_table *table = NULL;
+    img_usage_device *dev = NULL;
+    fz_page *page = NULL;
+    pdf_obj *ref = NULL;
+    int len = 0, cap = 0;
+    int i, n;
+    fz_var(images);
+    fz_var(table);
+    fz_var(dev);
+    fz_var(page);
+    fz_var(ref);
+    fz_var(len);
+    fz_var(cap);
+    fz_try(ctx)
+    {
+        n = pdf_xref_len(ctx, pdf);
+        for (i = 1; i < n; i++)
+        {
+            fz_try(ctx)
+            {
+                ref = pdf_new_indirect(ctx, pdf, i, 0);
+                if (img_usage_is_candidate(ctx, ref))
+                {
+                    if (len == cap)
+                    {
+                        cap = cap ? cap * 2 : 16;
+                        images = fz_realloc_array(ctx, images, cap, mupdf_image_usage_t);
+                    }
+                    images[len].num = i;
+                    images[len].dpi = 0;
+                    images[len].image = pdf_load_image(ctx, pdf, ref);
+                    len++;
+                }
+            }
+            fz_always(ctx)
+            {
+                pdf_drop_obj(ctx, ref);
+                ref = NULL;
+            }
+            fz_catch(ctx)
+            {
+                fz_rethrow_if(ctx, FZ_ERROR_MEMORY);
+                fz_warn(ctx, "skipping image object %d", i);
+            }
+        }
+
+        /* Pages load the same fz_image from the store while we hold them */
+        table = fz_new_hash_table(ctx, len * 2 + 1, sizeof(fz_image *), -1, NULL);
+        for (i = 0; i < len; i++)
+            fz_hash_insert(ctx, table, &images[i].image, &images[i]);
+
+        dev = fz_new_derived_device(ctx, img_usage_device);
+        dev->super.fill_image = img_usage_fill_image;
+        dev->super.fill_image_mask = img_usage_fill_image_mask;
+        dev->super.clip_image_mask = img_usage_clip_image_mask;
+        dev->table = table;
+
+        n = pdf_count_pages(ctx, pdf);
+        for (i = 0; i < n; i++)
+        {
+            page = fz_load_page(ctx, &pdf->super, i);
+            fz_run_page(ctx, page, (fz_device *)dev, fz_identity, NULL);
+            fz_drop_page(ctx, page);
+            page = NULL;
+        }
+        fz_close_device(ctx, (fz_device *)dev);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_page(ctx, page);
+        fz_drop_device(ctx, (fz_device *)dev);
+        fz_drop_hash_table(ctx, table);
+    }
+    fz_catch(ctx)
+    {
+        for (i = 0; i < len; i++)
+            fz_drop_image(ctx, images[i].image);
+        fz_free(ctx, images);
+        images = NULL;
+        len = 0;
+        mupdf_save_error(ctx, errptr);
+    }
+    *count = len;
+    return images;
+}
+
+/* Decode image and scale it to w by h, returning its samples Flate compressed.
+   Returns NULL when the image can't be stored as plain samples of its own
+   colorspace or when the result isn't smaller than the original data. */
+fz_buffer *mupdf_downsample_image(fz_context *ctx, fz_image *image, int *w, int *h, mupdf_error_t **errptr)
+{
+    fz_pixmap *pix = NULL;
+    fz_pixmap *scaled = NULL;
+    fz_buffer *buf = NULL;
+    fz_compressed_buffer *original;
+    unsigned char *samples = NULL;
+    unsigned char *data;
+    size_t len, stride;
+    int y;
+    fz_var(pix);
+    fz_var(scaled);
+    fz_var(buf);
+    fz_var(samples);
+    fz_try(ctx)
+    {
+        pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+        if (pix->alpha || pix->s || pix->colorspace != image->colorspace)
+            break;
+        scaled = fz_scale_pixmap(ctx, pix, 0, 0, *w, *h, NULL);
+        if (!scaled)
+            break;
+        /* Pack the rows, the scaled pixmap may be padded */
+        stride = (size_t)scaled->w * scaled->n;
+        samples = fz_malloc(ctx, stride * scaled->h);
+        for (y = 0; y < scaled->h; y++)
+            memcpy(samples + y * stride, scaled->samples + y * scaled->stride, stride);
+        data = fz_new_deflated_data(ctx, &len, samples, stride * scaled->h, FZ_DEFLATE_DEFAULT);
+        buf = fz_new_buffer_from_data(ctx, data, len);
+        original = fz_compressed_image_buffer(ctx, image);
+        if (original && original->buffer && buf->len >= original->buffer->len)
+        {
+            fz_drop_buffer(ctx, buf);
+            buf = NULL;
+            break;
+        }
+        *w = scaled->w;
+        *h = scaled->h;
+    }
+    fz_always(ctx)
+    {
+        fz_free(ctx, samples);
+        fz_drop_pixmap(ctx, scaled);
+        fz_drop_pixmap(ctx, pix);
+    }
+    fz_catch(ctx)
+    {
+        fz_drop_buffer(ctx, buf);
+        buf = NULL;
+        mupdf_save_error(ctx, errptr);
+    }
+    return buf;
+}
+
+/* Replace the samples of image object num by w by h 8 bit samples, Flate compressed */
+void mupdf_pdf_replace_image_samples(fz_context *ctx, pdf_document *pdf, int num, fz_buffer *buf, int w, int h, int n, mupdf_error_t **errptr)
+{
+    pdf_obj *ref = NULL;
+    fz_var(ref);
+    fz_try(ctx)
+    {
+        ref = pdf_new_indirect(ctx, pdf, num, 0);
+        pdf_dict_put_int(ctx, ref, PDF_NAME(Width), w);
+        pdf_dict_put_int(ctx, ref, PDF_NAME(Height), h);
+        pdf_dict_put_int(ctx, ref, PDF_NAME(BitsPerComponent), 8);
+        pdf_dict_put(ctx, ref, PDF_NAME(Filter), PDF_NAME(FlateDecode));
+        pdf_dict_del(ctx, ref, PDF_NAME(DecodeParms));
+        /* The decoded samples already went through the Decode array */
+        pdf_dict_del(ctx, ref, PDF_NAME(Decode));
+        pdf_dict_del(ctx, ref, PDF_NAME(SMaskInData));
+        /* JPX images may take their colorspace from the codestream */
+        if (!pdf_dict_get(ctx, ref, PDF_NAME(ColorSpace)))
+            pdf_dict_put(ctx, ref, PDF_NAME(ColorSpace), n == 1 ? PDF_NAME(DeviceGray) : n == 4 ? PDF_NAME(DeviceCMYK) : PDF_NAME(DeviceRGB));
+        pdf_update_stream(ctx, pdf, ref, buf, 1);
+        /* Later loads must not find the old image in the store */
+        pdf_remove_item(ctx, fz_drop_image_imp, ref);
+    }
+    fz_always(ctx)
+    {
+        pdf_drop_obj(ctx, ref);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+}
+
 /* Device */
 fz_device *mupdf_new_draw_device(fz_context *ctx, fz_pixmap *pixmap, fz_irect clip, mupdf_error_t **errptr)
 {
@@ -2937,6 +6927,51 @@ bool mupdf_pdf_update_page(fz_context *ctx, pdf_page *page, mupdf_error_t **errp
     return updated;
 }
 
+/* Like pdf_update_page, returning the area covered by each annotation whose
+   appearance changed, before and after the update, in page coordinates. Areas
+   annotations covered before their /Rect was edited must be kept by the caller */
+fz_rect *mupdf_pdf_update_page_with_damage(fz_context *ctx, pdf_page *page, int *count, mupdf_error_t **errptr)
+{
+    fz_rect *rects = NULL;
+    fz_rect before;
+    pdf_annot *annot;
+    int len = 0, cap = 0;
+    int widgets;
+    fz_var(rects);
+    fz_var(len);
+    fz_var(cap);
+    fz_try(ctx)
+    {
+        if (page->doc->recalculate)
+            pdf_calculate_form(ctx, page->doc);
+        for (widgets = 0; widgets < 2; widgets++)
+        {
+            annot = widgets ? pdf_first_widget(ctx, page) : pdf_first_annot(ctx, page);
+            for (; annot; annot = widgets ? pdf_next_widget(ctx, annot) : pdf_next_annot(ctx, annot))
+            {
+                before = pdf_bound_annot(ctx, annot);
+                if (!pdf_update_annot(ctx, annot))
+                    continue;
+                if (len == cap)
+                {
+                    cap = cap ? cap * 2 : 8;
+                    rects = fz_realloc_array(ctx, rects, cap, fz_rect);
+                }
+                rects[len++] = fz_union_rect(before, pdf_bound_annot(ctx, annot));
+            }
+        }
+    }
+    fz_catch(ctx)
+    {
+        fz_free(ctx, rects);
+        rects = NULL;
+        len = 0;
+        mupdf_save_error(ctx, errptr);
+    }
+    *count = len;
+    return rects;
+}
+
 bool mupdf_pdf_redact_page(fz_context *ctx, pdf_page *page, mupdf_error_t **errptr)
 {
     bool redacted = false;
@@ -2951,6 +6986,48 @@ bool mupdf_pdf_redact_page(fz_context *ctx, pdf_page *page, mupdf_error_t **errp
     return redacted;
 }
 
+bool mupdf_pdf_redact_page_with_options(fz_context *ctx, pdf_page *page, pdf_redact_options opts, mupdf_error_t **errptr)
+{
+    bool redacted = false;
+    fz_try(ctx)
+    {
+        redacted = pdf_redact_page(ctx, page->doc, page, &opts);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return redacted;
+}
+
+/* Mark the regions, in page coordinates, for redaction and apply every redaction of the page */
+bool mupdf_pdf_redact_regions(fz_context *ctx, pdf_page *page, const fz_rect *rects, int count, pdf_redact_options opts, mupdf_error_t **errptr)
+{
+    bool redacted = false;
+    pdf_annot *annot = NULL;
+    int i;
+    fz_var(annot);
+    fz_try(ctx)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (fz_is_empty_rect(rects[i]))
+                continue;
+            annot = pdf_create_annot(ctx, page, PDF_ANNOT_REDACT);
+            pdf_set_annot_rect(ctx, annot, rects[i]);
+            pdf_drop_annot(ctx, annot);
+            annot = NULL;
+        }
+        redacted = pdf_redact_page(ctx, page->doc, page, &opts);
+    }
+    fz_catch(ctx)
+    {
+        pdf_drop_annot(ctx, annot);
+        mupdf_save_error(ctx, errptr);
+    }
+    return redacted;
+}
+
 void mupdf_pdf_filter_page_contents(fz_context *ctx, pdf_page *page, pdf_filter_options *filter, mupdf_error_t **errptr)
 {
     fz_try(ctx)
@@ -3057,6 +7134,32 @@ int mupdf_pdf_annot_type(fz_context *ctx, pdf_annot *annot, mupdf_error_t **errp
     return subtype;
 }
 
+fz_rect mupdf_pdf_bound_annot(fz_context *ctx, pdf_annot *annot, mupdf_error_t **errptr)
+{
+    fz_rect rect = fz_empty_rect;
+    fz_try(ctx)
+    {
+        rect = pdf_bound_annot(ctx, annot);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return rect;
+}
+
+void mupdf_pdf_set_annot_rect(fz_context *ctx, pdf_annot *annot, fz_rect rect, mupdf_error_t **errptr)
+{
+    fz_try(ctx)
+    {
+        pdf_set_annot_rect(ctx, annot, rect);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+}
+
 const char *mupdf_pdf_annot_author(fz_context *ctx, pdf_annot *annot, mupdf_error_t **errptr)
 {
     const char *author = NULL;
@@ -3110,12 +7213,28 @@ fz_document_writer *mupdf_new_document_writer(fz_context *ctx, const char *filen
     return writer;
 }
 
+/* The writer takes ownership of out */
+fz_document_writer *mupdf_new_document_writer_with_output(fz_context *ctx, fz_output *out, const char *format, const char *options, mupdf_error_t **errptr)
+{
+    fz_document_writer *writer = NULL;
+    fz_try(ctx)
+    {
+        writer = fz_new_document_writer_with_output(ctx, out, format, options);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+    return writer;
+}
+
 fz_device *mupdf_document_writer_begin_page(fz_context *ctx, fz_document_writer *writer, fz_rect mediabox, mupdf_error_t **errptr)
 {
     fz_device *device = NULL;
     fz_try(ctx)
     {
-        device = fz_begin_page(ctx, writer, mediabox);
+        /* The writer drops its reference when the page ends */
+        device = fz_keep_device(ctx, fz_begin_page(ctx, writer, mediabox));
     }
     fz_catch(ctx)
     {
@@ -3136,6 +7255,117 @@ void mupdf_document_writer_end_page(fz_context *ctx, fz_document_writer *writer,
     }
 }
 
+void mupdf_close_document_writer(fz_context *ctx, fz_document_writer *writer, mupdf_error_t **errptr)
+{
+    fz_try(ctx)
+    {
+        fz_close_document_writer(ctx, writer);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+}
+
+/* Parallel raster output: pages are drawn on worker threads the way the raster
+   document writers draw them, then copied into the page of the writer. */
+
+/* Same transform as fz_new_draw_device_with_options */
+static fz_matrix mupdf_draw_options_transform(fz_draw_options *opts, fz_rect mediabox)
+{
+    float page_w = mediabox.x1 - mediabox.x0;
+    float page_h = mediabox.y1 - mediabox.y0;
+    float x_scale, y_scale;
+    if (opts->width > 0)
+    {
+        x_scale = opts->width / page_w;
+        if (opts->height > 0)
+            y_scale = opts->height / page_h;
+        else
+            y_scale = floorf(page_h * x_scale + 0.5f) / page_h;
+    }
+    else if (opts->height > 0)
+    {
+        y_scale = opts->height / page_h;
+        x_scale = floorf(page_w * y_scale + 0.5f) / page_w;
+    }
+    else
+    {
+        x_scale = floorf(page_w * opts->x_resolution / 72.0f + 0.5f) / page_w;
+        y_scale = floorf(page_h * opts->y_resolution / 72.0f + 0.5f) / page_h;
+    }
+    return fz_pre_rotate(fz_scale(x_scale, y_scale), opts->rotate);
+}
+
+/* Same colorspace as fz_new_pixmap_writer forces over the options for these formats */
+static void mupdf_draw_options_format(fz_context *ctx, fz_draw_options *opts, const char *format)
+{
+    if (!fz_strcasecmp(format, "pgm") || !fz_strcasecmp(format, "pbm"))
+        opts->colorspace = fz_device_gray(ctx);
+    else if (!fz_strcasecmp(format, "ppm"))
+        opts->colorspace = fz_device_rgb(ctx);
+    else if (!fz_strcasecmp(format, "pkm"))
+        opts->colorspace = fz_device_cmyk(ctx);
+}
+
+/* Draw list into the pixmap a raster writer created with the same options would draw into */
+fz_pixmap *mupdf_document_writer_draw_page(fz_context *ctx, fz_display_list *list, const char *format, const char *options, mupdf_error_t **errptr)
+{
+    fz_draw_options opts;
+    fz_pixmap *pix = NULL;
+    fz_device *dev = NULL;
+    fz_var(pix);
+    fz_var(dev);
+    fz_try(ctx)
+    {
+        fz_parse_draw_options(ctx, &opts, options);
+        mupdf_draw_options_format(ctx, &opts, format);
+        dev = fz_new_draw_device_with_options(ctx, &opts, fz_bound_display_list(ctx, list), &pix);
+        fz_run_display_list(ctx, list, dev, fz_identity, fz_infinite_rect, NULL);
+        fz_close_device(ctx, dev);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_device(ctx, dev);
+    }
+    fz_catch(ctx)
+    {
+        fz_drop_pixmap(ctx, pix);
+        pix = NULL;
+        mupdf_save_error(ctx, errptr);
+    }
+    return pix;
+}
+
+/* Write a page drawn by mupdf_document_writer_draw_page, the pixmap lands on the
+   pixels of the page of the writer one to one and in the same colorspace */
+void mupdf_document_writer_write_drawn_page(fz_context *ctx, fz_document_writer *writer, fz_rect mediabox, fz_pixmap *pix, const char *options, mupdf_error_t **errptr)
+{
+    fz_draw_options opts;
+    fz_image *image = NULL;
+    fz_device *dev;
+    fz_matrix ctm;
+    fz_var(image);
+    fz_try(ctx)
+    {
+        fz_parse_draw_options(ctx, &opts, options);
+        ctm = fz_make_matrix(pix->w, 0, 0, pix->h, pix->x, pix->y);
+        ctm = fz_concat(ctm, fz_invert_matrix(mupdf_draw_options_transform(&opts, mediabox)));
+        image = fz_new_image_from_pixmap(ctx, pix, NULL);
+        dev = fz_begin_page(ctx, writer, mediabox);
+        fz_fill_image(ctx, dev, image, ctm, 1, fz_default_color_params);
+        fz_end_page(ctx, writer);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_image(ctx, image);
+    }
+    fz_catch(ctx)
+    {
+        mupdf_save_error(ctx, errptr);
+    }
+}
+
 /* Bitmap */
 fz_bitmap *mupdf_new_bitmap_from_pixmap(fz_context *ctx, fz_pixmap *pixmap, mupdf_error_t **errptr)
 {
@@ -94,6 +94,11 @@ impl Context {
         }
     }
 
+    /// Whether color management is enabled for the current thread
+    pub fn icc_enabled(&self) -> bool {
+        unsafe { mupdf_icc_enabled(self.inner) }
+    }
+
     pub fn aa_level(&self) -> i32 {
         unsafe { fz_aa_level(self.inner) }
     }
@@ -186,5 +191,6 @@ mod test {
         assert_eq!(ctx.graphics_min_line_width(), 0.0);
         assert!(ctx.use_document_css());
         assert!(ctx.user_css().is_none());
+        assert!(ctx.icc_enabled());
     }
 }
@@ -24,6 +24,11 @@ impl Cookie {
         }
     }
 
+    /// Whether rendering was asked to abort
+    pub fn aborted(&self) -> bool {
+        unsafe { (*self.inner).abort != 0 }
+    }
+
     /// Communicates rendering progress back to the application.
     /// Increments as a page is being rendered.
     pub fn progress(&self) -> i32 {
@@ -0,0 +1,79 @@
+use std::collections::hash_map::{HashMap, Iter};
+use std::ffi::CStr;
+use std::slice;
+
+use mupdf_sys::*;
+
+use crate::{context, Document, Error, Point};
+
+/// Target of a named destination
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct Destination {
+    pub page: u32,
+    pub x: f32,
+    pub y: f32,
+}
+
+impl Destination {
+    pub fn point(&self) -> Point {
+        Point::new(self.x, self.y)
+    }
+}
+
+/// The named destinations of a document, resolved once so that links and
+/// outline entries pointing at them don't each search the Dests name tree.
+#[derive(Debug, Clone, Default)]
+pub struct DestinationMap {
+    dests: HashMap<String, Destination>,
+}
+
+impl DestinationMap {
+    pub(crate) fn load(doc: &Document) -> Result<Self, Error> {
+        let mut count = 0;
+        let ptr = unsafe { ffi_try!(mupdf_load_named_dests(context(), doc.inner, &mut count)) };
+        let mut dests = HashMap::with_capacity(count as usize);
+        if ptr.is_null() {
+            return Ok(Self { dests });
+        }
+        unsafe {
+            for dest in slice::from_raw_parts(ptr, count as usize) {
+                let name = CStr::from_ptr(dest.name).to_string_lossy().into_owned();
+                dests.insert(
+                    name,
+                    Destination {
+                        page: dest.page as u32,
+                        x: dest.x,
+                        y: dest.y,
+                    },
+                );
+                fz_free(context(), dest.name as _);
+            }
+            fz_free(context(), ptr as _);
+        }
+        Ok(Self { dests })
+    }
+
+    pub fn get(&self, name: &str) -> Option<&Destination> {
+        self.dests.get(name)
+    }
+
+    /// Look up the target of an internal link URI naming a destination,
+    /// either `#name` or `#nameddest=name`
+    pub fn resolve(&self, uri: &str) -> Option<&Destination> {
+        let name = uri.strip_prefix('#')?;
+        let name = name.strip_prefix("nameddest=").unwrap_or(name);
+        self.dests.get(name)
+    }
+
+    pub fn len(&self) -> usize {
+        self.dests.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.dests.is_empty()
+    }
+
+    pub fn iter(&self) -> Iter<'_, String, Destination> {
+        self.dests.iter()
+    }
+}
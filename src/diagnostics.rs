@@ -0,0 +1,236 @@
+use std::cell::RefCell;
+use std::ffi::CStr;
+use std::mem;
+use std::os::raw::{c_char, c_void};
+use std::ptr;
+
+use mupdf_sys::*;
+
+use crate::context;
+
+/// Number of distinct warnings kept by `capture`, further ones are only counted
+pub const DEFAULT_MAX_WARNINGS: usize = 64;
+
+/// A warning emitted by MuPDF, e.g. about a repaired xref or a broken stream.
+#[derive(Debug, Clone, PartialEq)]
+pub struct Warning {
+    pub message: String,
+    /// How many times this exact message was emitted
+    pub count: u32,
+}
+
+/// Warnings collected while running an operation.
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct Diagnostics {
+    pub warnings: Vec<Warning>,
+    /// Number of warnings dropped because the distinct warning limit was reached
+    pub suppressed: u32,
+}
+
+impl Diagnostics {
+    pub fn is_empty(&self) -> bool {
+        self.warnings.is_empty() && self.suppressed == 0
+    }
+
+    /// Total number of warnings emitted, including repeated and suppressed ones
+    pub fn total(&self) -> u32 {
+        self.warnings.iter().map(|w| w.count).sum::<u32>() + self.suppressed
+    }
+}
+
+struct Collector {
+    diagnostics: Diagnostics,
+    max_warnings: usize,
+    // Whether the previous warning was dropped by the limit
+    last_suppressed: bool,
+}
+
+impl Collector {
+    fn push(&mut self, message: &str) {
+        let diagnostics = &mut self.diagnostics;
+        // MuPDF folds consecutive identical warnings into a single summary line
+        if let Some(times) = message
+            .strip_prefix("... repeated ")
+            .and_then(|rest| rest.strip_suffix(" times..."))
+            .and_then(|n| n.parse::<u32>().ok())
+        {
+            let extra = times.saturating_sub(1);
+            if self.last_suppressed {
+                diagnostics.suppressed += extra;
+            } else if let Some(last) = diagnostics.warnings.last_mut() {
+                last.count += extra;
+            }
+            return;
+        }
+        self.last_suppressed = false;
+        if let Some(idx) = diagnostics
+            .warnings
+            .iter()
+            .position(|w| w.message == message)
+        {
+            // Keep the most recent warning last so repeats are attributed to it
+            let mut warning = diagnostics.warnings.remove(idx);
+            warning.count += 1;
+            diagnostics.warnings.push(warning);
+        } else if diagnostics.warnings.len() < self.max_warnings {
+            diagnostics.warnings.push(Warning {
+                message: message.to_string(),
+                count: 1,
+            });
+        } else {
+            diagnostics.suppressed += 1;
+            self.last_suppressed = true;
+        }
+    }
+}
+
+thread_local! {
+    // A stack, so that captures can be nested
+    static COLLECTORS: RefCell<Vec<Collector>> = RefCell::new(Vec::new());
+}
+
+unsafe extern "C" fn warning_callback(_user: *mut c_void, message: *const c_char) {
+    if message.is_null() {
+        return;
+    }
+    let message = CStr::from_ptr(message).to_string_lossy();
+    COLLECTORS.with(|collectors| {
+        if let Ok(mut collectors) = collectors.try_borrow_mut() {
+            if let Some(collector) = collectors.last_mut() {
+                collector.push(&message);
+            }
+        }
+    });
+}
+
+struct CaptureGuard {
+    ctx: *mut fz_context,
+}
+
+impl CaptureGuard {
+    fn new(max_warnings: usize) -> Self {
+        let ctx = context();
+        unsafe {
+            // Warnings pending from before the capture belong to no one
+            fz_flush_warnings(ctx);
+        }
+        COLLECTORS.with(|collectors| {
+            collectors.borrow_mut().push(Collector {
+                diagnostics: Diagnostics::default(),
+                max_warnings,
+                last_suppressed: false,
+            })
+        });
+        unsafe {
+            fz_set_warning_callback(ctx, Some(warning_callback), ptr::null_mut());
+        }
+        Self { ctx }
+    }
+
+    fn finish(self) -> Diagnostics {
+        let diagnostics = self.pop();
+        mem::forget(self);
+        diagnostics
+    }
+
+    fn pop(&self) -> Diagnostics {
+        unsafe {
+            fz_flush_warnings(self.ctx);
+        }
+        let (collector, empty) = COLLECTORS.with(|collectors| {
+            let mut collectors = collectors.borrow_mut();
+            let collector = collectors.pop();
+            (collector, collectors.is_empty())
+        });
+        if empty {
+            // Back to the default set up by the base context: warnings are discarded
+            unsafe {
+                fz_set_warning_callback(self.ctx, None, ptr::null_mut());
+            }
+        }
+        collector.map(|c| c.diagnostics).unwrap_or_default()
+    }
+}
+
+impl Drop for CaptureGuard {
+    fn drop(&mut self) {
+        self.pop();
+    }
+}
+
+/// Run `f` and collect the warnings MuPDF emits on the current thread meanwhile.
+///
+/// Identical warnings are reported once with a count and at most
+/// [`DEFAULT_MAX_WARNINGS`] distinct warnings are kept.
+pub fn capture<T, F>(f: F) -> (T, Diagnostics)
+where
+    F: FnOnce() -> T,
+{
+    capture_with_limit(DEFAULT_MAX_WARNINGS, f)
+}
+
+/// Like [`capture`], keeping at most `max_warnings` distinct warnings.
+pub fn capture_with_limit<T, F>(max_warnings: usize, f: F) -> (T, Diagnostics)
+where
+    F: FnOnce() -> T,
+{
+    let guard = CaptureGuard::new(max_warnings);
+    let ret = f();
+    (ret, guard.finish())
+}
+
+#[cfg(test)]
+mod test {
+    use std::ffi::CString;
+
+    use mupdf_sys::*;
+
+    use super::{capture, capture_with_limit, Warning};
+    use crate::context;
+
+    fn warn(msg: &str) {
+        let c_msg = CString::new(msg).unwrap();
+        unsafe {
+            fz_warn(context(), b"%s\0".as_ptr() as _, c_msg.as_ptr());
+        }
+    }
+
+    #[test]
+    fn test_capture_warnings() {
+        let (_, diagnostics) = capture(|| {
+            warn("a");
+            warn("a");
+            warn("a");
+            warn("b");
+            warn("a");
+        });
+        assert_eq!(
+            diagnostics.warnings,
+            [
+                Warning {
+                    message: "b".to_string(),
+                    count: 1
+                },
+                Warning {
+                    message: "a".to_string(),
+                    count: 4
+                },
+            ]
+        );
+        assert_eq!(diagnostics.total(), 5);
+
+        let (_, diagnostics) = capture(|| ());
+        assert!(diagnostics.is_empty());
+    }
+
+    #[test]
+    fn test_capture_warnings_limit() {
+        let (_, diagnostics) = capture_with_limit(2, || {
+            for i in 0..5 {
+                warn(&format!("warning {}", i));
+            }
+        });
+        assert_eq!(diagnostics.warnings.len(), 2);
+        assert_eq!(diagnostics.suppressed, 3);
+    }
+}
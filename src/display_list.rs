@@ -1,13 +1,116 @@
-use std::ffi::CString;
+use std::ffi::{CStr, CString};
+use std::io::{self, Write};
+use std::os::raw::{c_char, c_void};
+use std::panic::{self, AssertUnwindSafe};
+use std::ptr;
 use std::slice;
 
 use mupdf_sys::*;
 
 use crate::{
-    context, Colorspace, Cookie, Device, Error, Image, Matrix, Pixmap, Quad, Rect, TextPage,
-    TextPageOptions,
+    context, Buffer, Colorspace, Cookie, Device, Error, Image, Matrix, Output, Pixmap, Quad, Rect,
+    RenderOptions, ResourceStore, SvgOptions, TextPage, TextPageOptions,
 };
 
+struct PutState<'a> {
+    store: &'a mut dyn ResourceStore,
+    error: Option<io::Error>,
+}
+
+unsafe extern "C" fn put_resource(
+    opaque: *mut c_void,
+    digest: *const c_char,
+    data: *const u8,
+    len: usize,
+) {
+    let state = &mut *(opaque as *mut PutState);
+    if state.error.is_some() {
+        return;
+    }
+    let ret = panic::catch_unwind(AssertUnwindSafe(|| -> io::Result<()> {
+        let digest = CStr::from_ptr(digest).to_string_lossy();
+        if !state.store.contains(&digest)? {
+            state.store.put(&digest, slice::from_raw_parts(data, len))?;
+        }
+        Ok(())
+    }));
+    match ret {
+        Ok(Ok(())) => {}
+        Ok(Err(err)) => state.error = Some(err),
+        Err(_) => {
+            state.error = Some(io::Error::new(
+                io::ErrorKind::Other,
+                "resource store panicked",
+            ))
+        }
+    }
+}
+
+struct GetState<'a> {
+    store: &'a dyn ResourceStore,
+    // MuPDF copies the data before asking for the next resource
+    current: Vec<u8>,
+    error: Option<io::Error>,
+}
+
+unsafe extern "C" fn get_resource(
+    opaque: *mut c_void,
+    digest: *const c_char,
+    len: *mut usize,
+) -> *const u8 {
+    let state = &mut *(opaque as *mut GetState);
+    let ret = panic::catch_unwind(AssertUnwindSafe(|| {
+        let digest = CStr::from_ptr(digest).to_string_lossy();
+        state.store.get(&digest)
+    }));
+    match ret {
+        Ok(Ok(Some(data))) => {
+            state.current = data;
+            *len = state.current.len();
+            state.current.as_ptr()
+        }
+        Ok(Ok(None)) => ptr::null(),
+        Ok(Err(err)) => {
+            state.error = Some(err);
+            ptr::null()
+        }
+        Err(_) => {
+            state.error = Some(io::Error::new(
+                io::ErrorKind::Other,
+                "resource store panicked",
+            ));
+            ptr::null()
+        }
+    }
+}
+
+/// Resolution of the preview of [`DisplayList::render_progressive`] relative to the final render
+pub const PREVIEW_SCALE: f32 = 0.5;
+
+/// What [`DisplayList::optimize_with_stats`] removed, counted in operations.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct OptimizeStats {
+    /// Operations outside the mediabox or their clip
+    pub culled: u32,
+    /// Operations hidden by a later opaque rectangle
+    pub covered: u32,
+    /// Clips and groups without effect or content, along with their content
+    pub collapsed: u32,
+    /// Path fills merged into the previous fill
+    pub merged: u32,
+}
+
+impl From<mupdf_optimize_stats_t> for OptimizeStats {
+    fn from(stats: mupdf_optimize_stats_t) -> Self {
+        Self {
+            culled: stats.culled as u32,
+            covered: stats.covered as u32,
+            collapsed: stats.collapsed as u32,
+            merged: stats.merged as u32,
+        }
+    }
+}
+
 #[derive(Debug)]
 pub struct DisplayList {
     pub(crate) inner: *mut fz_display_list,
@@ -23,6 +126,110 @@ impl DisplayList {
         Ok(Self { inner })
     }
 
+    /// Encode the list in a compact binary form, putting the fonts and images
+    /// it uses in `store`.
+    ///
+    /// Colors in colorspaces other than the device ones are stored as RGB.
+    pub fn serialize(&self, store: &mut dyn ResourceStore) -> Result<Vec<u8>, Error> {
+        let mut state = PutState { store, error: None };
+        let buf = unsafe {
+            Buffer::from_raw(ffi_try!(mupdf_display_list_serialize(
+                context(),
+                self.inner,
+                Some(put_resource),
+                &mut state as *mut PutState as *mut c_void
+            )))
+        };
+        if let Some(err) = state.error {
+            return Err(err.into());
+        }
+        let data = unsafe {
+            let mut ptr = ptr::null_mut();
+            let len = fz_buffer_storage(context(), buf.inner, &mut ptr);
+            slice::from_raw_parts(ptr, len).to_vec()
+        };
+        Ok(data)
+    }
+
+    /// Rebuild a list encoded by [`DisplayList::serialize`], loading its resources from `store`.
+    pub fn deserialize(data: &[u8], store: &dyn ResourceStore) -> Result<Self, Error> {
+        let mut state = GetState {
+            store,
+            current: Vec::new(),
+            error: None,
+        };
+        let opaque = &mut state as *mut GetState as *mut c_void;
+        let ret: Result<*mut fz_display_list, Error> = (|| unsafe {
+            Ok(ffi_try!(mupdf_display_list_deserialize(
+                context(),
+                data.as_ptr(),
+                data.len(),
+                Some(get_resource),
+                opaque
+            )))
+        })();
+        match (ret, state.error) {
+            // The store failing is the more useful error
+            (Err(_), Some(err)) => Err(err.into()),
+            (ret, _) => ret.map(|inner| Self { inner }),
+        }
+    }
+
+    /// Build a list that renders the same with fewer operations.
+    ///
+    /// Content outside the mediabox or hidden under opaque rectangles is
+    /// removed, as are clips and groups that have no effect, and consecutive
+    /// fills of disjoint paths in the same color are merged.
+    pub fn optimize(&self) -> Result<DisplayList, Error> {
+        self.optimize_with_stats().map(|(list, _)| list)
+    }
+
+    pub fn optimize_with_stats(&self) -> Result<(DisplayList, OptimizeStats), Error> {
+        let mut stats = mupdf_optimize_stats_t {
+            culled: 0,
+            covered: 0,
+            collapsed: 0,
+            merged: 0,
+        };
+        let inner = unsafe {
+            ffi_try!(mupdf_optimize_display_list(
+                context(),
+                self.inner,
+                &mut stats
+            ))
+        };
+        Ok((Self { inner }, stats.into()))
+    }
+
+    /// Split the list into a grid of `cols` by `rows` cells over its bounds.
+    pub fn build_index(&self, cols: u32, rows: u32) -> Result<DisplayListIndex, Error> {
+        let bounds = self.bounds();
+        let ctx = context();
+        let cells = unsafe {
+            let cells = ffi_try!(mupdf_index_display_list(
+                ctx,
+                self.inner,
+                bounds.into(),
+                cols as i32,
+                rows as i32
+            ));
+            let lists = slice::from_raw_parts(cells, cols as usize * rows as usize)
+                .iter()
+                .map(|&inner| DisplayList::from_raw(inner))
+                .collect();
+            fz_free(ctx, cells as _);
+            lists
+        };
+        let list = unsafe { DisplayList::from_raw(fz_keep_display_list(ctx, self.inner)) };
+        Ok(DisplayListIndex {
+            list,
+            bounds,
+            cols,
+            rows,
+            cells,
+        })
+    }
+
     pub fn bounds(&self) -> Rect {
         let rect = unsafe { fz_bound_display_list(context(), self.inner) };
         rect.into()
@@ -41,6 +248,94 @@ impl DisplayList {
         }
     }
 
+    pub fn to_pixmap_with_cookie(
+        &self,
+        ctm: &Matrix,
+        cs: &Colorspace,
+        alpha: bool,
+        cookie: &Cookie,
+    ) -> Result<Pixmap, Error> {
+        unsafe {
+            let inner = ffi_try!(mupdf_display_list_to_pixmap_with_cookie(
+                context(),
+                self.inner,
+                ctm.into(),
+                cs.inner,
+                alpha,
+                0,
+                cookie.inner
+            ));
+            Ok(Pixmap::from_raw(inner))
+        }
+    }
+
+    /// Render with the quality settings of `options` instead of those of the thread context.
+    pub fn to_pixmap_with_options(
+        &self,
+        ctm: &Matrix,
+        cs: &Colorspace,
+        alpha: bool,
+        options: &RenderOptions,
+        cookie: Option<&Cookie>,
+    ) -> Result<Pixmap, Error> {
+        let _guard = options.apply();
+        unsafe {
+            let inner = ffi_try!(mupdf_display_list_to_pixmap_with_cookie(
+                context(),
+                self.inner,
+                ctm.into(),
+                cs.inner,
+                alpha,
+                options.device_hints(),
+                cookie.map_or(ptr::null_mut(), |cookie| cookie.inner)
+            ));
+            Ok(Pixmap::from_raw(inner))
+        }
+    }
+
+    /// Render a quick preview with [`RenderOptions::fast`] at [`PREVIEW_SCALE`],
+    /// scaled up to full size and handed to `preview`, then render with `options`.
+    ///
+    /// Images are decoded at the preview resolution only. When `cookie` aborts
+    /// the full quality render, the preview is returned instead.
+    pub fn render_progressive<F>(
+        &self,
+        ctm: &Matrix,
+        cs: &Colorspace,
+        alpha: bool,
+        options: &RenderOptions,
+        cookie: &Cookie,
+        preview: F,
+    ) -> Result<Pixmap, Error>
+    where
+        F: FnOnce(&Pixmap),
+    {
+        let quick = {
+            let fast = RenderOptions::fast();
+            let _guard = fast.apply();
+            unsafe {
+                Pixmap::from_raw(ffi_try!(mupdf_display_list_to_preview(
+                    context(),
+                    self.inner,
+                    ctm.into(),
+                    cs.inner,
+                    alpha,
+                    PREVIEW_SCALE,
+                    fast.device_hints()
+                )))
+            }
+        };
+        preview(&quick);
+        if cookie.aborted() {
+            return Ok(quick);
+        }
+        let full = self.to_pixmap_with_options(ctm, cs, alpha, options, Some(cookie))?;
+        if cookie.aborted() {
+            return Ok(quick);
+        }
+        Ok(full)
+    }
+
     pub fn to_text_page(&self, opts: TextPageOptions) -> Result<TextPage, Error> {
         unsafe {
             let inner = ffi_try!(mupdf_display_list_to_text_page(
@@ -52,6 +347,29 @@ impl DisplayList {
         }
     }
 
+    /// Write the list as SVG to `w`, see `Page::write_svg`
+    pub fn write_svg<W: Write>(
+        &self,
+        ctm: &Matrix,
+        options: &SvgOptions,
+        w: &mut W,
+    ) -> Result<(), Error> {
+        let mut out = Output::new(w)?;
+        let ret = (|| unsafe {
+            ffi_try!(mupdf_display_list_write_svg(
+                context(),
+                self.inner,
+                out.inner,
+                ctm.into(),
+                options.text_format as _,
+                options.reuse_images,
+                ptr::null_mut()
+            ));
+            Ok(())
+        })();
+        out.check(ret)
+    }
+
     pub fn to_image(&self, width: f32, height: f32) -> Result<Image, Error> {
         Image::from_display_list(self, width, height)
     }
@@ -125,6 +443,84 @@ impl DisplayList {
     }
 }
 
+/// A display list along with a grid of per cell lists, so that rendering an
+/// area within one cell only visits the operations that touch that cell.
+#[derive(Debug)]
+pub struct DisplayListIndex {
+    list: DisplayList,
+    bounds: Rect,
+    cols: u32,
+    rows: u32,
+    cells: Vec<DisplayList>,
+}
+
+impl DisplayListIndex {
+    pub fn cols(&self) -> u32 {
+        self.cols
+    }
+
+    pub fn rows(&self) -> u32 {
+        self.rows
+    }
+
+    /// The operations of the list touching the cell at `col`, `row`
+    pub fn cell(&self, col: u32, row: u32) -> Option<&DisplayList> {
+        if col >= self.cols || row >= self.rows {
+            return None;
+        }
+        self.cells.get((row * self.cols + col) as usize)
+    }
+
+    /// The cell holding everything that shows in `area` when rendering with `ctm`
+    fn cell_for(&self, ctm: &Matrix, area: Rect) -> Option<&DisplayList> {
+        if area == Rect::INF {
+            return None;
+        }
+        let mut inverse: fz_matrix = Matrix::IDENTITY.into();
+        if unsafe { fz_try_invert_matrix(&mut inverse, ctm.into()) } != 0 {
+            return None;
+        }
+        // Antialiasing and minimum line widths reach past the exact bounds
+        let margin = 2.0;
+        let area = Rect::new(
+            area.x0 - margin,
+            area.y0 - margin,
+            area.x1 + margin,
+            area.y1 + margin,
+        );
+        let area: Rect = unsafe { fz_transform_rect(area.into(), inverse) }.into();
+        // Operations outside the bounds were put in the edge cells
+        let clamp = |v: f32, n: u32| {
+            if !(v > 0.0) {
+                0
+            } else if v >= n as f32 {
+                n - 1
+            } else {
+                v as u32
+            }
+        };
+        let cell_w = self.bounds.width() / self.cols as f32;
+        let cell_h = self.bounds.height() / self.rows as f32;
+        let col = clamp((area.x0 - self.bounds.x0) / cell_w, self.cols);
+        let row = clamp((area.y0 - self.bounds.y0) / cell_h, self.rows);
+        if clamp((area.x1 - self.bounds.x0) / cell_w, self.cols) != col
+            || clamp((area.y1 - self.bounds.y0) / cell_h, self.rows) != row
+        {
+            return None;
+        }
+        self.cell(col, row)
+    }
+
+    /// Like [`DisplayList::run`], only visiting the operations of a single
+    /// cell when `area` falls within one.
+    pub fn run(&self, device: &Device, ctm: &Matrix, area: Rect) -> Result<(), Error> {
+        match self.cell_for(ctm, area) {
+            Some(cell) => cell.run(device, ctm, area),
+            None => self.list.run(device, ctm, area),
+        }
+    }
+}
+
 impl Drop for DisplayList {
     fn drop(&mut self) {
         if !self.inner.is_null() {
@@ -141,7 +537,7 @@ unsafe impl Sync for DisplayList {}
 
 #[cfg(test)]
 mod test {
-    use crate::Document;
+    use crate::{Device, Document};
 
     #[test]
     fn test_display_list_search() {
@@ -178,6 +574,242 @@ mod test {
         assert_eq!(hits.len(), 0);
     }
 
+    #[test]
+    fn test_display_list_serialize() {
+        use crate::resource_store::MemoryStore;
+        use crate::DisplayList;
+
+        let doc = Document::open("tests/files/dummy.pdf").unwrap();
+        let page0 = doc.load_page(0).unwrap();
+        let list = page0.to_display_list(false).unwrap();
+
+        let mut store = MemoryStore::new();
+        let data = list.serialize(&mut store).unwrap();
+        assert_eq!(&data[..4], b"MUDL");
+        // The font is stored out of line
+        assert_eq!(store.len(), 1);
+
+        let copy = DisplayList::deserialize(&data, &store).unwrap();
+        assert_eq!(copy.bounds(), list.bounds());
+        assert_eq!(
+            copy.search("Dummy", 1).unwrap(),
+            list.search("Dummy", 1).unwrap()
+        );
+
+        assert!(DisplayList::deserialize(&data, &MemoryStore::new()).is_err());
+        assert!(DisplayList::deserialize(&data[..data.len() - 1], &store).is_err());
+        assert!(DisplayList::deserialize(b"not a list", &store).is_err());
+    }
+
+    #[test]
+    fn test_display_list_deserialize_mismatched_resource() {
+        use crate::resource_store::{MemoryStore, ResourceStore};
+        use crate::{ColorParams, Colorspace, DisplayList, Image, Matrix, Pixmap};
+
+        let doc = Document::open("tests/files/dummy.pdf").unwrap();
+        let page0 = doc.load_page(0).unwrap();
+        let list = DisplayList::new(page0.bounds().unwrap()).unwrap();
+        let device = Device::from_display_list(&list).unwrap();
+        page0.run(&device, &Matrix::IDENTITY).unwrap();
+        let mut pixmap = Pixmap::new_with_w_h(&Colorspace::device_rgb(), 2, 2, false).unwrap();
+        pixmap.clear().unwrap();
+        let image = Image::from_pixmap(&pixmap).unwrap();
+        device
+            .fill_image(
+                &image,
+                &Matrix::new_scale(10.0, 10.0),
+                1.0,
+                ColorParams::default(),
+            )
+            .unwrap();
+        drop(device);
+
+        let mut store = MemoryStore::new();
+        let mut data = list.serialize(&mut store).unwrap();
+        assert_eq!(store.len(), 2);
+        // The stored digests in the order they are referenced: the font, then the image
+        let mut digests: Vec<(usize, Vec<u8>)> = Vec::new();
+        for pos in 0..data.len().saturating_sub(31) {
+            let digest = &data[pos..pos + 32];
+            let is_hex = digest
+                .iter()
+                .all(|c| c.is_ascii_digit() || (b'a'..=b'f').contains(c));
+            if is_hex
+                && store
+                    .contains(std::str::from_utf8(digest).unwrap())
+                    .unwrap()
+            {
+                digests.push((pos, digest.to_vec()));
+            }
+        }
+        let font = digests[0].1.clone();
+        let (image_pos, image) = digests.last().unwrap().clone();
+        assert_ne!(font, image);
+
+        // Name the font where the image is expected
+        data[image_pos..image_pos + 32].copy_from_slice(&font);
+        assert!(DisplayList::deserialize(&data, &store).is_err());
+    }
+
+    #[test]
+    fn test_display_list_optimize() {
+        use crate::{ColorParams, Colorspace, DisplayList, Matrix, Path, Rect};
+
+        let rgb = Colorspace::device_rgb();
+        let list = DisplayList::new(Rect::new(0.0, 0.0, 100.0, 100.0)).unwrap();
+        let device = Device::from_display_list(&list).unwrap();
+        let fill_square = |x: i32, y: i32, size: i32, color: &[f32]| {
+            let mut path = Path::new().unwrap();
+            path.rect(x, y, x + size, y + size).unwrap();
+            device
+                .fill_path(
+                    &path,
+                    false,
+                    &Matrix::IDENTITY,
+                    &rgb,
+                    color,
+                    1.0,
+                    ColorParams::default(),
+                )
+                .unwrap();
+        };
+        let red = [1.0, 0.0, 0.0];
+        // Off the page
+        fill_square(200, 200, 10, &red);
+        // Covered by the background painted next
+        fill_square(10, 10, 10, &red);
+        fill_square(0, 0, 100, &[1.0, 1.0, 1.0]);
+        // Two disjoint squares in the same color
+        fill_square(10, 10, 10, &red);
+        fill_square(50, 50, 10, &red);
+        // Closes the device
+        drop(device);
+
+        let (optimized, stats) = list.optimize_with_stats().unwrap();
+        assert_eq!(stats.culled, 1);
+        assert_eq!(stats.covered, 1);
+        assert_eq!(stats.merged, 1);
+
+        let before = list.to_pixmap(&Matrix::IDENTITY, &rgb, false).unwrap();
+        let after = optimized.to_pixmap(&Matrix::IDENTITY, &rgb, false).unwrap();
+        assert_eq!(before.samples(), after.samples());
+    }
+
+    #[test]
+    fn test_display_list_optimize_keeps_compositing() {
+        use crate::{BlendMode, ColorParams, Colorspace, DisplayList, Matrix, Path, Rect};
+
+        let rgb = Colorspace::device_rgb();
+        let gray = Colorspace::device_gray();
+        let area = Rect::new(0.0, 0.0, 100.0, 100.0);
+        let list = DisplayList::new(area).unwrap();
+        let device = Device::from_display_list(&list).unwrap();
+        let fill = |x0: f32, y0: f32, x1: f32, y1: f32, cs: &Colorspace, color: &[f32], alpha| {
+            let mut path = Path::new().unwrap();
+            path.move_to(x0, y0).unwrap();
+            path.line_to(x1, y0).unwrap();
+            path.line_to(x1, y1).unwrap();
+            path.line_to(x0, y1).unwrap();
+            path.close().unwrap();
+            device
+                .fill_path(
+                    &path,
+                    false,
+                    &Matrix::IDENTITY,
+                    cs,
+                    color,
+                    alpha,
+                    ColorParams::default(),
+                )
+                .unwrap();
+        };
+        // A half transparent soft mask over a group of overlapping translucent fills,
+        // laid out the way PDF soft masks are run
+        device
+            .begin_mask(area, true, &gray, &[0.0], ColorParams::default())
+            .unwrap();
+        fill(0.0, 0.0, 100.0, 100.0, &gray, &[0.5], 1.0);
+        device.end_mask().unwrap();
+        device
+            .begin_group(area, &rgb, false, false, BlendMode::Normal, 1.0)
+            .unwrap();
+        fill(10.0, 10.0, 60.0, 60.0, &rgb, &[1.0, 0.0, 0.0], 0.5);
+        fill(40.0, 40.0, 90.0, 90.0, &rgb, &[0.0, 0.0, 1.0], 0.5);
+        device.end_group().unwrap();
+        device.pop_clip().unwrap();
+        // Squares touching at a fractional edge share anti-aliased pixels
+        fill(10.5, 92.0, 20.5, 98.0, &rgb, &[0.0, 1.0, 0.0], 1.0);
+        fill(20.5, 92.0, 30.5, 98.0, &rgb, &[0.0, 1.0, 0.0], 1.0);
+        drop(device);
+
+        let (optimized, stats) = list.optimize_with_stats().unwrap();
+        assert_eq!(stats.collapsed, 0);
+        assert_eq!(stats.merged, 0);
+
+        let before = list.to_pixmap(&Matrix::IDENTITY, &rgb, false).unwrap();
+        let after = optimized.to_pixmap(&Matrix::IDENTITY, &rgb, false).unwrap();
+        assert_eq!(before.samples(), after.samples());
+    }
+
+    #[test]
+    fn test_display_list_index() {
+        use crate::{Colorspace, IRect, Matrix, Pixmap, Rect};
+
+        let doc = Document::open("tests/files/dummy.pdf").unwrap();
+        let page0 = doc.load_page(0).unwrap();
+        let list = page0.to_display_list(false).unwrap();
+        let index = list.build_index(4, 4).unwrap();
+        assert!(index.cell(3, 3).unwrap().is_empty());
+        assert!(index.cell(4, 0).is_none());
+
+        // The "Dummy PDF file" title is in the top left cell
+        let ctm = Matrix::IDENTITY;
+        let area = IRect::new(50, 60, 120, 90);
+        let render = |run: &dyn Fn(&Device) -> Result<(), crate::Error>| {
+            let mut pixmap = Pixmap::new_with_rect(&Colorspace::device_rgb(), area, false).unwrap();
+            pixmap.clear_with(255).unwrap();
+            let device = Device::from_pixmap(&pixmap).unwrap();
+            run(&device).unwrap();
+            drop(device);
+            pixmap
+        };
+        let rect = Rect::new(50.0, 60.0, 120.0, 90.0);
+        let full = render(&|device| list.run(device, &ctm, rect));
+        let indexed = render(&|device| index.run(device, &ctm, rect));
+        assert_eq!(full.samples(), indexed.samples());
+        assert!(full.samples().iter().any(|&v| v != 255));
+    }
+
+    #[test]
+    fn test_display_list_render_progressive() {
+        use crate::{Colorspace, Context, Cookie, Matrix, RenderOptions};
+
+        let doc = Document::open("tests/files/dummy.pdf").unwrap();
+        let page0 = doc.load_page(0).unwrap();
+        let list = page0.to_display_list(false).unwrap();
+        let cs = Colorspace::device_rgb();
+        let aa_level = Context::get().aa_level();
+
+        let cookie = Cookie::new().unwrap();
+        let mut previewed = None;
+        let full = list
+            .render_progressive(
+                &Matrix::IDENTITY,
+                &cs,
+                false,
+                &RenderOptions::print(),
+                &cookie,
+                |preview| {
+                    previewed = Some((preview.width(), preview.height()));
+                    assert_eq!(Context::get().aa_level(), aa_level);
+                },
+            )
+            .unwrap();
+        assert_eq!(previewed, Some((full.width(), full.height())));
+        let expected = list.to_pixmap(&Matrix::IDENTITY, &cs, false).unwrap();
+        assert_eq!(full.samples(), expected.samples());
+    }
+
     #[test]
     fn test_multi_threaded_display_list_search() {
         use crossbeam_utils::thread;
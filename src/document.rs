@@ -1,11 +1,20 @@
 use std::ffi::{CStr, CString};
-use std::io::Write;
+use std::io::{self, Write};
 use std::ptr;
+use std::slice;
+use std::thread;
 
 use mupdf_sys::*;
 
+#[cfg(feature = "ocr")]
+use crate::ocr::{self, OcrOptions};
 use crate::pdf::PdfDocument;
-use crate::{context, Buffer, Colorspace, Cookie, Error, Outline, Page};
+use crate::{
+    context, diagnostics, Buffer, Colorspace, Cookie, DestinationMap, Diagnostics, Error, Link,
+    Matrix, Outline, Page, SvgOptions,
+};
+#[cfg(feature = "ocr")]
+use crate::{DisplayList, TextPage, TextPageOptions};
 
 #[derive(Debug, Clone, Copy, PartialEq)]
 pub enum MetadataName {
@@ -62,6 +71,12 @@ impl Document {
         Ok(Self { inner })
     }
 
+    /// Open a document, also returning the warnings emitted while opening it,
+    /// such as reports about a repaired xref table.
+    pub fn open_with_diagnostics(filename: &str) -> (Result<Self, Error>, Diagnostics) {
+        diagnostics::capture(|| Self::open(filename))
+    }
+
     pub fn from_bytes(bytes: &[u8], magic: &str) -> Result<Self, Error> {
         let c_magic = CString::new(magic)?;
         let len = bytes.len();
@@ -132,6 +147,28 @@ impl Document {
         Ok(None)
     }
 
+    /// Named destinations of the document, empty for non-PDF documents
+    pub fn destinations(&self) -> Result<DestinationMap, Error> {
+        DestinationMap::load(self)
+    }
+
+    /// Resolve many link URIs at once, looking up named destinations in a
+    /// destination map built once for all of them.
+    pub fn resolve_links_bulk(&self, uris: &[&str]) -> Result<Vec<Option<Location>>, Error> {
+        let dests = self.destinations()?;
+        uris.iter()
+            .map(|uri| {
+                if let Some(dest) = dests.resolve(uri) {
+                    return Ok(Some(Location {
+                        chapter: 0,
+                        page: dest.page as i32,
+                    }));
+                }
+                self.resolve_link(uri)
+            })
+            .collect()
+    }
+
     pub fn is_reflowable(&self) -> Result<bool, Error> {
         let ret = unsafe { ffi_try!(mupdf_is_document_reflowable(context(), self.inner)) };
         Ok(ret)
@@ -220,6 +257,181 @@ impl Document {
         }
     }
 
+    /// Every link of the document with the number of the page it is on.
+    ///
+    /// Links of PDF documents are read from the link annotations of the page
+    /// objects without loading the pages, other documents load every page.
+    pub fn all_links(&self) -> Result<Vec<(u32, Link)>, Error> {
+        let pdf = unsafe { pdf_specifics(context(), self.inner) };
+        if pdf.is_null() {
+            return self.page_range_links(0, self.page_count()?);
+        }
+        let mut count = 0;
+        let ptr = unsafe { ffi_try!(mupdf_pdf_all_links(context(), pdf, &mut count)) };
+        if ptr.is_null() {
+            return Ok(Vec::new());
+        }
+        let mut links = Vec::with_capacity(count as usize);
+        unsafe {
+            for link in slice::from_raw_parts(ptr, count as usize) {
+                let uri = CStr::from_ptr(link.uri).to_string_lossy().into_owned();
+                links.push((
+                    link.page as u32,
+                    Link {
+                        bounds: link.rect.into(),
+                        page: link.target as u32,
+                        uri,
+                    },
+                ));
+                fz_free(context(), link.uri as _);
+            }
+            fz_free(context(), ptr as _);
+        }
+        Ok(links)
+    }
+
+    /// Same as `all_links`, with the pages of non-PDF documents laid out and
+    /// searched for links on `threads` threads, 0 for one per CPU. Every
+    /// thread opens its own copy of the document.
+    pub fn all_links_parallel(filename: &str, threads: usize) -> Result<Vec<(u32, Link)>, Error> {
+        let doc = Self::open(filename)?;
+        let page_count = doc.page_count()?;
+        let threads = match threads {
+            0 => thread::available_parallelism().map_or(1, |n| n.get()),
+            n => n,
+        }
+        .min(page_count.max(1) as usize);
+        if doc.is_pdf() || threads == 1 {
+            return doc.all_links();
+        }
+
+        let chunk = (page_count as usize + threads - 1) / threads;
+        let (first, rest): (_, Vec<Result<Vec<(u32, Link)>, Error>>) = thread::scope(|scope| {
+            let workers: Vec<_> = (1..threads)
+                .map(|i| {
+                    scope.spawn(move || {
+                        let start = (i * chunk) as i32;
+                        let end = (((i + 1) * chunk) as i32).min(page_count);
+                        if start >= end {
+                            return Ok(Vec::new());
+                        }
+                        Self::open(filename)?.page_range_links(start, end)
+                    })
+                })
+                .collect();
+            // The first chunk is searched here, in the document opened above
+            let first = doc.page_range_links(0, (chunk as i32).min(page_count));
+            let rest = workers
+                .into_iter()
+                .map(|worker| worker.join().unwrap())
+                .collect();
+            (first, rest)
+        });
+        let mut links = first?;
+        for result in rest {
+            links.extend(result?);
+        }
+        Ok(links)
+    }
+
+    fn page_range_links(&self, start: i32, end: i32) -> Result<Vec<(u32, Link)>, Error> {
+        let mut links = Vec::new();
+        for page_no in start..end {
+            let page = self.load_page(page_no)?;
+            links.extend(page.links()?.map(|link| (page_no as u32, link)));
+        }
+        Ok(links)
+    }
+
+    /// Write every page as an SVG document to the writer `page_writer` returns for it.
+    ///
+    /// With a single thread every page is streamed to its writer. With more
+    /// threads, 0 for one per CPU, pages are recorded here and converted on worker
+    /// threads, a batch of `threads` pages at a time, then written in page order.
+    pub fn export_svg<F, W>(
+        &self,
+        ctm: &Matrix,
+        options: &SvgOptions,
+        threads: usize,
+        mut page_writer: F,
+    ) -> Result<(), Error>
+    where
+        F: FnMut(u32) -> io::Result<W>,
+        W: Write,
+    {
+        let page_count = self.page_count()?;
+        let threads = match threads {
+            0 => thread::available_parallelism().map_or(1, |n| n.get()),
+            n => n,
+        }
+        .min(page_count.max(1) as usize);
+        if threads == 1 {
+            for page_no in 0..page_count {
+                let page = self.load_page(page_no)?;
+                page.write_svg(ctm, options, &mut page_writer(page_no as u32)?)?;
+            }
+            return Ok(());
+        }
+
+        for start in (0..page_count).step_by(threads) {
+            let end = (start + threads as i32).min(page_count);
+            let lists = (start..end)
+                .map(|page_no| self.load_page(page_no)?.to_display_list(true))
+                .collect::<Result<Vec<_>, Error>>()?;
+            let svgs: Vec<Result<Vec<u8>, Error>> = thread::scope(|scope| {
+                let workers: Vec<_> = lists
+                    .iter()
+                    .map(|list| {
+                        scope.spawn(move || -> Result<Vec<u8>, Error> {
+                            let mut svg = Vec::new();
+                            list.write_svg(ctm, options, &mut svg)?;
+                            Ok(svg)
+                        })
+                    })
+                    .collect();
+                workers
+                    .into_iter()
+                    .map(|worker| worker.join().unwrap())
+                    .collect()
+            });
+            for (page_no, svg) in (start..end).zip(svgs) {
+                page_writer(page_no as u32)?.write_all(&svg?)?;
+            }
+        }
+        Ok(())
+    }
+
+    /// Recognize the text of every page with Tesseract, returning for each page a
+    /// display list of its content with the recognized text drawn invisibly over it
+    #[cfg(feature = "ocr")]
+    pub fn ocr(&self, options: &OcrOptions) -> Result<Vec<DisplayList>, Error> {
+        ocr::ocr_document(self, options)
+    }
+
+    /// Text of every page as recognized by `ocr`
+    #[cfg(feature = "ocr")]
+    pub fn ocr_text_pages(
+        &self,
+        options: &OcrOptions,
+        text_options: TextPageOptions,
+    ) -> Result<Vec<TextPage>, Error> {
+        self.ocr(options)?
+            .iter()
+            .map(|list| list.to_text_page(text_options))
+            .collect()
+    }
+
+    /// Write the document as a searchable PDF, each page as it is drawn with the
+    /// recognized text as an invisible layer
+    #[cfg(feature = "ocr")]
+    pub fn ocr_to_pdf<W: Write + io::Seek>(
+        &self,
+        options: &OcrOptions,
+        w: &mut W,
+    ) -> Result<(), Error> {
+        ocr::write_pdf(&self.ocr(options)?, w)
+    }
+
     pub fn pages(&self) -> Result<PageIter, Error> {
         Ok(PageIter {
             index: 0,
@@ -450,4 +662,128 @@ mod test {
         assert_eq!(out1.x, 57.0);
         assert_eq!(out1.y, 69.0);
     }
+
+    #[test]
+    fn test_document_all_links() {
+        use crate::pdf::PdfDocument;
+        use crate::Size;
+
+        let mut pdf = PdfDocument::new();
+        pdf.new_page(Size::A6).unwrap();
+        pdf.new_page(Size::A6).unwrap();
+        let page1 = pdf.find_page(1).unwrap().as_indirect().unwrap();
+        let annots = pdf
+            .new_object_from_str(&format!(
+                "[<</Type/Annot/Subtype/Link/Rect[10 10 50 50]/Dest[{} 0 R/Fit]>>\
+                 <</Type/Annot/Subtype/Link/Rect[60 60 100 100]/A<</S/URI/URI(https://example.com)>>>>\
+                 <</Type/Annot/Subtype/Square/Rect[0 0 10 10]>>]",
+                page1
+            ))
+            .unwrap();
+        pdf.find_page(0)
+            .unwrap()
+            .dict_put("Annots", annots)
+            .unwrap();
+        let mut bytes = Vec::new();
+        pdf.write_to(&mut bytes).unwrap();
+
+        let doc = Document::from_bytes(&bytes, "application/pdf").unwrap();
+        let links = doc.all_links().unwrap();
+        let expected: Vec<_> = doc.load_page(0).unwrap().links().unwrap().collect();
+        assert_eq!(links.len(), 2);
+        for ((page, link), expected) in links.iter().zip(expected.iter()) {
+            assert_eq!(*page, 0);
+            assert_eq!(link.bounds, expected.bounds);
+            assert_eq!(link.page, expected.page);
+            assert_eq!(link.uri, expected.uri);
+        }
+        assert_eq!(links[0].1.page, 1);
+        assert_eq!(links[1].1.uri, "https://example.com");
+    }
+
+    #[test]
+    fn test_document_export_svg() {
+        use crate::pdf::PdfDocument;
+        use crate::{Matrix, Size, SvgOptions};
+        use std::cell::RefCell;
+        use std::io::{self, Write};
+
+        struct PageSvg<'a>(&'a RefCell<Vec<Vec<u8>>>);
+
+        impl Write for PageSvg<'_> {
+            fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+                self.0
+                    .borrow_mut()
+                    .last_mut()
+                    .unwrap()
+                    .extend_from_slice(buf);
+                Ok(buf.len())
+            }
+
+            fn flush(&mut self) -> io::Result<()> {
+                Ok(())
+            }
+        }
+
+        let mut pdf = PdfDocument::new();
+        for _ in 0..3 {
+            pdf.new_page(Size::A6).unwrap();
+        }
+        let mut bytes = Vec::new();
+        pdf.write_to(&mut bytes).unwrap();
+        let doc = Document::from_bytes(&bytes, "application/pdf").unwrap();
+
+        for threads in &[1, 2] {
+            let pages = RefCell::new(Vec::new());
+            doc.export_svg(&Matrix::IDENTITY, &SvgOptions::default(), *threads, |_| {
+                pages.borrow_mut().push(Vec::new());
+                Ok(PageSvg(&pages))
+            })
+            .unwrap();
+            let pages = pages.into_inner();
+            assert_eq!(pages.len(), 3);
+            for (page_no, svg) in pages.iter().enumerate() {
+                let expected = doc.load_page(page_no as i32).unwrap();
+                let expected = expected.to_svg(&Matrix::IDENTITY).unwrap();
+                assert_eq!(std::str::from_utf8(svg).unwrap(), expected);
+            }
+        }
+    }
+
+    #[test]
+    fn test_document_resolve_links_bulk() {
+        use crate::pdf::PdfDocument;
+        use crate::Size;
+
+        let mut pdf = PdfDocument::new();
+        pdf.new_page(Size::A6).unwrap();
+        pdf.new_page(Size::A6).unwrap();
+        let page1 = pdf.find_page(1).unwrap().as_indirect().unwrap();
+        let names = pdf
+            .new_object_from_str(&format!(
+                "<</Dests<</Names[(second)[{} 0 R/XYZ 10 400 null]]>>>>",
+                page1
+            ))
+            .unwrap();
+        let legacy = pdf.new_object_from_str("<</first[0/Fit]>>").unwrap();
+        let mut catalog = pdf.catalog().unwrap();
+        catalog.dict_put("Names", names).unwrap();
+        catalog.dict_put("Dests", legacy).unwrap();
+        let mut bytes = Vec::new();
+        pdf.write_to(&mut bytes).unwrap();
+
+        let doc = Document::from_bytes(&bytes, "application/pdf").unwrap();
+        let dests = doc.destinations().unwrap();
+        assert_eq!(dests.len(), 2);
+        let second = dests.get("second").unwrap();
+        assert_eq!(second.page, 1);
+        assert_eq!(second.x, 10.0);
+        assert_eq!(second.y, 20.0);
+
+        let locations = doc
+            .resolve_links_bulk(&["#second", "#nameddest=first", "#missing"])
+            .unwrap();
+        let pages: Vec<_> = locations.iter().map(|loc| loc.map(|l| l.page)).collect();
+        assert_eq!(pages, vec![Some(1), Some(0), None]);
+    }
 }
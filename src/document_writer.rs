@@ -1,16 +1,29 @@
+use std::collections::BTreeMap;
 use std::ffi::CString;
+use std::io::{self, Seek, Write};
+use std::panic::{self, AssertUnwindSafe};
+use std::path::Path;
 use std::ptr;
+use std::sync::{mpsc, Mutex};
+use std::thread;
 
 use mupdf_sys::*;
 
-use crate::{context, Device, Error, Rect};
+use crate::{context, ffi_error, Device, DisplayList, Document, Error, Output, Pixmap, Rect};
+
+/// Formats that can be written to an output instead of a file
+const OUTPUT_FORMATS: &[&str] = &[
+    "cbz", "pdf", "pcl", "pclm", "ps", "pwg", "txt", "text", "html", "xhtml", "stext",
+];
 
 #[derive(Debug)]
-pub struct DocumentWriter {
+pub struct DocumentWriter<'a> {
     inner: *mut fz_document_writer,
+    // Keeps the writer of the fz_output owned by `inner` alive
+    output: Option<Output<'a>>,
 }
 
-impl DocumentWriter {
+impl DocumentWriter<'static> {
     pub fn new(filename: &str, format: &str, options: &str) -> Result<Self, Error> {
         let c_filename = CString::new(filename)?;
         let c_format = CString::new(format)?;
@@ -23,7 +36,48 @@ impl DocumentWriter {
                 c_options.as_ptr()
             ))
         };
-        Ok(Self { inner })
+        Ok(Self {
+            inner,
+            output: None,
+        })
+    }
+}
+
+impl<'a> DocumentWriter<'a> {
+    /// Write the document to `w` instead of a file.
+    ///
+    /// Only formats producing a single file are supported: CBZ, PDF, PCL, PCLm,
+    /// PS, PWG and the text formats. Writers record positions of what they wrote,
+    /// hence `Seek`.
+    pub fn with_output<W: Write + Seek>(
+        w: &'a mut W,
+        format: &str,
+        options: &str,
+    ) -> Result<Self, Error> {
+        if !OUTPUT_FORMATS.contains(&format.to_ascii_lowercase().as_str()) {
+            return Err(Error::InvalidArgument(format!(
+                "{} can't be written to an output",
+                format
+            )));
+        }
+        let c_format = CString::new(format)?;
+        let c_options = CString::new(options)?;
+        let mut output = Output::with_seek(w)?;
+        // The document writer owns the fz_output from here on, even when it fails
+        let out = output.take_inner();
+        let ret = (|| unsafe {
+            Ok(ffi_try!(mupdf_new_document_writer_with_output(
+                context(),
+                out,
+                c_format.as_ptr(),
+                c_options.as_ptr()
+            )))
+        })();
+        let inner = output.check(ret)?;
+        Ok(Self {
+            inner,
+            output: Some(output),
+        })
     }
 
     pub fn begin_page(&mut self, media_box: Rect) -> Result<Device, Error> {
@@ -38,20 +92,253 @@ impl DocumentWriter {
     }
 
     pub fn end_page(&mut self) -> Result<(), Error> {
-        unsafe {
+        let ret = (|| unsafe {
             ffi_try!(mupdf_document_writer_end_page(context(), self.inner));
+            Ok(())
+        })();
+        self.check(ret)
+    }
+
+    /// Finish the document, reporting the errors dropping the writer would ignore
+    pub fn close(mut self) -> Result<(), Error> {
+        let inner = self.inner;
+        self.inner = ptr::null_mut();
+        let ret = (|| unsafe {
+            ffi_try!(mupdf_close_document_writer(context(), inner));
+            Ok(())
+        })();
+        unsafe {
+            fz_drop_document_writer(context(), inner);
+        }
+        self.check(ret)
+    }
+
+    fn check<T>(&mut self, ret: Result<T, Error>) -> Result<T, Error> {
+        match &mut self.output {
+            Some(output) => output.check(ret),
+            None => ret,
         }
-        Ok(())
     }
 }
 
-impl Drop for DocumentWriter {
+impl Drop for DocumentWriter<'_> {
     fn drop(&mut self) {
         if !self.inner.is_null() {
             unsafe {
-                fz_close_document_writer(context(), self.inner);
+                let mut err = ptr::null_mut();
+                mupdf_close_document_writer(context(), self.inner, &mut err);
+                if !err.is_null() {
+                    ffi_error(err);
+                }
                 fz_drop_document_writer(context(), self.inner);
             }
         }
     }
 }
+
+/// Output formats whose pages are plain rasterized pixmaps
+const RASTER_FORMATS: &[&str] = &[
+    "cbz", "png", "pam", "pnm", "pgm", "ppm", "pbm", "pkm", "pcl", "pclm", "ps", "pwg",
+];
+
+/// A page drawn on a worker thread, only used by one thread at a time
+struct Drawn(Pixmap);
+
+unsafe impl Send for Drawn {}
+
+/// A document writer for raster formats that draws pages on several threads.
+///
+/// Pages are handed over as display lists and drawn on worker threads, in any
+/// order. Drawn pages are then written in page order on the calling thread, so
+/// only the encoding of the output stays sequential.
+#[derive(Debug)]
+pub struct ParallelDocumentWriter {
+    writer: DocumentWriter<'static>,
+    format: CString,
+    options: CString,
+    threads: usize,
+}
+
+impl ParallelDocumentWriter {
+    /// Same as `DocumentWriter::new` with `threads` workers, 0 for one per CPU.
+    /// Fails for formats that aren't rasterized such as PDF or SVG.
+    pub fn new(filename: &str, format: &str, options: &str, threads: usize) -> Result<Self, Error> {
+        let format = if format.is_empty() {
+            Path::new(filename)
+                .extension()
+                .and_then(|ext| ext.to_str())
+                .unwrap_or("")
+        } else {
+            format
+        };
+        if !RASTER_FORMATS.contains(&format.to_ascii_lowercase().as_str()) {
+            return Err(Error::InvalidArgument(format!(
+                "{} is not a raster output format",
+                format
+            )));
+        }
+        let threads = match threads {
+            0 => thread::available_parallelism().map_or(1, |n| n.get()),
+            n => n,
+        };
+        Ok(Self {
+            writer: DocumentWriter::new(filename, format, options)?,
+            format: CString::new(format)?,
+            options: CString::new(options)?,
+            threads,
+        })
+    }
+
+    /// Draw and write the pages of `doc`
+    pub fn write_document(&mut self, doc: &Document) -> Result<(), Error> {
+        let page_count = doc.page_count()?;
+        self.write((0..page_count).map(|page_no| doc.load_page(page_no)?.to_display_list(true)))
+    }
+
+    /// Draw and write pages
+    pub fn write_pages<I>(&mut self, pages: I) -> Result<(), Error>
+    where
+        I: IntoIterator<Item = DisplayList>,
+    {
+        self.write(pages.into_iter().map(Ok))
+    }
+
+    /// Finish the output, reporting errors that dropping the writer would ignore
+    pub fn close(self) -> Result<(), Error> {
+        self.writer.close()
+    }
+
+    fn write<I>(&mut self, mut pages: I) -> Result<(), Error>
+    where
+        I: Iterator<Item = Result<DisplayList, Error>>,
+    {
+        let format = &self.format;
+        let options = &self.options;
+        let writer = &mut self.writer;
+        let threads = self.threads;
+        // Enough pages in flight to keep every worker busy while the next page is written
+        let max_in_flight = threads * 2;
+        thread::scope(|scope| -> Result<(), Error> {
+            let (job_tx, job_rx) = mpsc::channel::<(usize, DisplayList)>();
+            let (done_tx, done_rx) = mpsc::channel();
+            let job_rx = Mutex::new(job_rx);
+            for _ in 0..threads {
+                let (job_rx, done_tx) = (&job_rx, done_tx.clone());
+                scope.spawn(move || loop {
+                    let job = job_rx.lock().unwrap().recv();
+                    let (i, list) = match job {
+                        Ok(job) => job,
+                        Err(_) => break,
+                    };
+                    // A panic is handed over so it doesn't leave its page missing
+                    let drawn =
+                        panic::catch_unwind(AssertUnwindSafe(|| draw_page(&list, format, options)));
+                    if done_tx.send((i, list.bounds(), drawn)).is_err() {
+                        break;
+                    }
+                });
+            }
+            drop(done_tx);
+
+            let mut sent = 0;
+            let mut written = 0;
+            let mut pending = BTreeMap::new();
+            loop {
+                while sent - written < max_in_flight {
+                    match pages.next() {
+                        Some(list) => {
+                            job_tx.send((sent, list?)).unwrap();
+                            sent += 1;
+                        }
+                        None => break,
+                    }
+                }
+                if written == sent {
+                    return Ok(());
+                }
+                let (i, mediabox, drawn) = done_rx.recv().map_err(|_| {
+                    io::Error::new(io::ErrorKind::Other, "page workers exited early")
+                })?;
+                pending.insert(i, (mediabox, drawn));
+                while let Some((mediabox, drawn)) = pending.remove(&written) {
+                    let Drawn(pixmap) = match drawn {
+                        Ok(drawn) => drawn?,
+                        Err(payload) => panic::resume_unwind(payload),
+                    };
+                    unsafe {
+                        ffi_try!(mupdf_document_writer_write_drawn_page(
+                            context(),
+                            writer.inner,
+                            mediabox.into(),
+                            pixmap.inner,
+                            options.as_ptr()
+                        ));
+                    }
+                    written += 1;
+                }
+            }
+        })
+    }
+}
+
+fn draw_page(list: &DisplayList, format: &CString, options: &CString) -> Result<Drawn, Error> {
+    unsafe {
+        let pixmap = ffi_try!(mupdf_document_writer_draw_page(
+            context(),
+            list.inner,
+            format.as_ptr(),
+            options.as_ptr()
+        ));
+        Ok(Drawn(Pixmap::from_raw(pixmap)))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::io::Cursor;
+
+    use super::{DocumentWriter, ParallelDocumentWriter};
+    use crate::pdf::PdfDocument;
+    use crate::{Document, Rect, Size};
+
+    #[test]
+    fn test_document_writer_with_output() {
+        let mut cursor = Cursor::new(Vec::new());
+        assert!(DocumentWriter::with_output(&mut cursor, "png", "").is_err());
+
+        let mut writer = DocumentWriter::with_output(&mut cursor, "pdf", "").unwrap();
+        for _ in 0..2 {
+            writer
+                .begin_page(Rect::new(0.0, 0.0, 298.0, 420.0))
+                .unwrap();
+            writer.end_page().unwrap();
+        }
+        writer.close().unwrap();
+
+        let doc = Document::from_bytes(cursor.get_ref(), "application/pdf").unwrap();
+        assert_eq!(doc.page_count().unwrap(), 2);
+    }
+
+    #[test]
+    fn test_parallel_document_writer() {
+        assert!(ParallelDocumentWriter::new("tests/output/parallel.pdf", "", "", 2).is_err());
+
+        let mut pdf = PdfDocument::new();
+        for _ in 0..5 {
+            pdf.new_page(Size::A6).unwrap();
+        }
+        let mut bytes = Vec::new();
+        pdf.write_to(&mut bytes).unwrap();
+        let doc = Document::from_bytes(&bytes, "application/pdf").unwrap();
+        let mut writer =
+            ParallelDocumentWriter::new("tests/output/parallel.cbz", "", "resolution=72", 2)
+                .unwrap();
+        writer.write_document(&doc).unwrap();
+        writer.close().unwrap();
+
+        let cbz = Document::open("tests/output/parallel.cbz").unwrap();
+        assert_eq!(cbz.page_count().unwrap(), 5);
+        let bounds = cbz.load_page(4).unwrap().bounds().unwrap();
+        assert_eq!(bounds.x1 - bounds.x0, 298.0);
+    }
+}
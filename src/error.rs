@@ -1,6 +1,6 @@
+use std::ffi::NulError;
 use std::fmt;
 use std::io;
-use std::ffi::NulError;
 
 use mupdf_sys::*;
 
@@ -22,13 +22,15 @@ impl fmt::Display for MuPdfError {
 
 impl std::error::Error for MuPdfError {}
 
+/// Copies the error out of the calling thread's error slot, which is then free
+/// to be reused by the next failing call.
 pub unsafe fn ffi_error(err: *mut mupdf_error_t) -> MuPdfError {
     use std::ffi::CStr;
 
     let code = (*err).type_;
-    let c_msg = (*err).message;
-    let c_str = CStr::from_ptr(c_msg);
-    let message = format!("{}", c_str.to_string_lossy());
+    let message = CStr::from_ptr((*err).message)
+        .to_string_lossy()
+        .into_owned();
     mupdf_drop_error(err);
     MuPdfError { code, message }
 }
@@ -57,6 +59,7 @@ macro_rules! ffi_try {
 #[derive(Debug)]
 pub enum Error {
     Io(io::Error),
+    InvalidArgument(String),
     InvalidLanguage(String),
     InvalidPdfDocument,
     MuPdf(MuPdfError),
@@ -67,6 +70,7 @@ impl fmt::Display for Error {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         match *self {
             Error::Io(ref err) => err.fmt(f),
+            Error::InvalidArgument(ref msg) => write!(f, "invalid argument: {}", msg),
             Error::InvalidLanguage(ref lang) => write!(f, "invalid language {}", lang),
             Error::InvalidPdfDocument => write!(f, "invalid pdf document"),
             Error::MuPdf(ref err) => err.fmt(f),
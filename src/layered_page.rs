@@ -0,0 +1,181 @@
+use std::borrow::Borrow;
+
+use crate::{Colorspace, Device, DisplayList, Error, Matrix, Page, Pixmap, Rect};
+
+/// The separately cached layers of a [`LayeredPage`], in drawing order
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PageLayer {
+    Contents,
+    Annotations,
+    Widgets,
+}
+
+/// Renders a page as separately cached layers.
+///
+/// Every layer is recorded as a display list the first time it is needed, and the
+/// contents layer is also kept rendered for the last transform. Annotations and
+/// widgets are drawn over a copy of it, so after an annotation edit only the
+/// annotation layer has to be invalidated and run again.
+///
+/// The page is owned or borrowed, e.g. a `Page`, a `PdfPage` or a `&Page`, so the
+/// cached layers always belong to it.
+#[derive(Debug)]
+pub struct LayeredPage<P: Borrow<Page>> {
+    page: P,
+    cs: Colorspace,
+    alpha: bool,
+    contents: Option<DisplayList>,
+    annotations: Option<DisplayList>,
+    widgets: Option<DisplayList>,
+    rendered: Option<(Matrix, Pixmap)>,
+}
+
+impl<P: Borrow<Page>> LayeredPage<P> {
+    pub fn new(page: P, cs: Colorspace, alpha: bool) -> Self {
+        Self {
+            page,
+            cs,
+            alpha,
+            contents: None,
+            annotations: None,
+            widgets: None,
+            rendered: None,
+        }
+    }
+
+    pub fn page(&self) -> &P {
+        &self.page
+    }
+
+    /// The page to edit, invalidate the layers the edit changes afterwards
+    pub fn page_mut(&mut self) -> &mut P {
+        &mut self.page
+    }
+
+    pub fn into_page(self) -> P {
+        self.page
+    }
+
+    /// Drop a cached layer so it is recorded again from the page on the next render
+    pub fn invalidate(&mut self, layer: PageLayer) {
+        match layer {
+            PageLayer::Contents => {
+                self.contents = None;
+                self.rendered = None;
+            }
+            PageLayer::Annotations => self.annotations = None,
+            PageLayer::Widgets => self.widgets = None,
+        }
+    }
+
+    /// Drop all cached layers
+    pub fn invalidate_all(&mut self) {
+        self.invalidate(PageLayer::Contents);
+        self.invalidate(PageLayer::Annotations);
+        self.invalidate(PageLayer::Widgets);
+    }
+
+    /// Display list of a layer, recorded from the page if it isn't cached
+    pub fn layer(&mut self, layer: PageLayer) -> Result<&DisplayList, Error> {
+        let page: &Page = self.page.borrow();
+        let slot = match layer {
+            PageLayer::Contents => &mut self.contents,
+            PageLayer::Annotations => &mut self.annotations,
+            PageLayer::Widgets => &mut self.widgets,
+        };
+        if slot.is_none() {
+            *slot = Some(record(page, layer)?);
+        }
+        Ok(slot.as_ref().unwrap())
+    }
+
+    /// Render the page contents, reusing the last rendering if `ctm` didn't change
+    pub fn render_contents(&mut self, ctm: &Matrix) -> Result<&Pixmap, Error> {
+        let cached = matches!(&self.rendered, Some((m, _)) if m == ctm);
+        if !cached {
+            self.rendered = None;
+            if self.contents.is_none() {
+                self.contents = Some(record(self.page.borrow(), PageLayer::Contents)?);
+            }
+            let list = self.contents.as_ref().unwrap();
+            let pixmap = list.to_pixmap(ctm, &self.cs, self.alpha)?;
+            self.rendered = Some((ctm.clone(), pixmap));
+        }
+        Ok(&self.rendered.as_ref().unwrap().1)
+    }
+
+    /// Composite all layers, same as `Page::to_pixmap` with `show_extras`
+    pub fn render(&mut self, ctm: &Matrix) -> Result<Pixmap, Error> {
+        let pixmap = self.render_contents(ctm)?.try_clone()?;
+        {
+            let device = Device::from_pixmap(&pixmap)?;
+            for layer in [PageLayer::Annotations, PageLayer::Widgets].iter() {
+                let list = self.layer(*layer)?;
+                if !list.is_empty() {
+                    list.run(&device, ctm, Rect::INF)?;
+                }
+            }
+        }
+        Ok(pixmap)
+    }
+}
+
+fn record(page: &Page, layer: PageLayer) -> Result<DisplayList, Error> {
+    let list = DisplayList::new(page.bounds()?)?;
+    {
+        let device = Device::from_display_list(&list)?;
+        match layer {
+            PageLayer::Contents => page.run_contents(&device, &Matrix::IDENTITY)?,
+            PageLayer::Annotations => page.run_annotations(&device, &Matrix::IDENTITY)?,
+            PageLayer::Widgets => page.run_widgets(&device, &Matrix::IDENTITY)?,
+        }
+    }
+    Ok(list)
+}
+
+#[cfg(test)]
+mod test {
+    use super::{LayeredPage, PageLayer};
+    use crate::pdf::{PdfAnnotationType, PdfDocument};
+    use crate::{Colorspace, Document, Matrix, Rect, Size};
+
+    #[test]
+    fn test_layered_page_render() {
+        let doc = Document::open("tests/files/dummy.pdf").unwrap();
+        let page0 = doc.load_page(0).unwrap();
+        let ctm = Matrix::new_scale(0.5, 0.5);
+        let expected = page0
+            .to_pixmap(&ctm, &Colorspace::device_rgb(), 0.0, true)
+            .unwrap();
+
+        let mut layers = LayeredPage::new(&page0, Colorspace::device_rgb(), false);
+        let pixmap = layers.render(&ctm).unwrap();
+        assert_eq!(pixmap.samples(), expected.samples());
+    }
+
+    #[test]
+    fn test_layered_page_render_annotations() {
+        let mut doc = PdfDocument::new();
+        let mut page = doc.new_page(Size::A6).unwrap();
+        page.create_annotation(PdfAnnotationType::Square).unwrap();
+        page.update().unwrap();
+        let ctm = Matrix::IDENTITY;
+        let cs = Colorspace::device_rgb();
+
+        let mut layers = LayeredPage::new(page, Colorspace::device_rgb(), false);
+        assert!(!layers.layer(PageLayer::Annotations).unwrap().is_empty());
+        let before = layers.render(&ctm).unwrap();
+        let expected = layers.page().to_pixmap(&ctm, &cs, 0.0, true).unwrap();
+        assert_eq!(before.samples(), expected.samples());
+
+        let page = layers.page_mut();
+        let mut annot = page.annotations().next().unwrap();
+        annot.set_rect(Rect::new(50.0, 50.0, 150.0, 100.0)).unwrap();
+        page.update().unwrap();
+        layers.invalidate(PageLayer::Annotations);
+        let after = layers.render(&ctm).unwrap();
+        let expected = layers.page().to_pixmap(&ctm, &cs, 0.0, true).unwrap();
+        assert_eq!(after.samples(), expected.samples());
+        assert_ne!(after.samples(), before.samples());
+    }
+}
@@ -12,8 +12,12 @@ pub mod colorspace;
 pub mod context;
 /// Provide two-way communication between application and library
 pub mod cookie;
+/// Named destinations resolved in one pass
+pub mod destination_map;
 /// Device interface
 pub mod device;
+/// Capture of warnings emitted while running an operation
+pub mod diagnostics;
 /// A way of packaging up a stream of graphical operations
 pub mod display_list;
 /// Common document operation interface
@@ -26,12 +30,19 @@ pub mod font;
 pub mod glyph;
 /// Image
 pub mod image;
+/// Pages rendered as separately cached layers
+pub mod layered_page;
 /// Hyperlink
 pub mod link;
 /// Matrix operations
 pub mod matrix;
+/// Text recognition with Tesseract
+#[cfg(feature = "ocr")]
+pub mod ocr;
 /// Outline
 pub mod outline;
+/// Output streams writing to Rust writers
+pub mod output;
 /// Document page
 pub mod page;
 /// Path type
@@ -46,6 +57,10 @@ pub mod point;
 pub mod quad;
 /// Rectangle types
 pub mod rect;
+/// Quality settings of a single render call
+pub mod render_options;
+/// Storage of the resources of serialized display lists
+pub mod resource_store;
 /// Separations
 pub mod separations;
 /// Shadings
@@ -54,6 +69,8 @@ pub mod shade;
 pub mod size;
 /// Stroke state
 pub mod stroke_state;
+/// SVG export settings
+pub mod svg_options;
 /// System font loading
 pub mod system_font;
 /// Text objects
@@ -68,27 +85,36 @@ pub use colorspace::Colorspace;
 pub(crate) use context::context;
 pub use context::Context;
 pub use cookie::Cookie;
+pub use destination_map::{Destination, DestinationMap};
 pub use device::{BlendMode, Device};
-pub use display_list::DisplayList;
+pub use diagnostics::{Diagnostics, Warning};
+pub use display_list::{DisplayList, DisplayListIndex, OptimizeStats};
 pub use document::{Document, MetadataName};
-pub use document_writer::DocumentWriter;
+pub use document_writer::{DocumentWriter, ParallelDocumentWriter};
 pub(crate) use error::ffi_error;
 pub use error::Error;
 pub use font::{CjkFontOrdering, Font, SimpleFontEncoding, WriteMode};
 pub use glyph::Glyph;
 pub use image::Image;
+pub use layered_page::{LayeredPage, PageLayer};
 pub use link::Link;
 pub use matrix::Matrix;
+#[cfg(feature = "ocr")]
+pub use ocr::OcrOptions;
 pub use outline::Outline;
+pub use output::Output;
 pub use page::Page;
 pub use path::{Path, PathWalker};
 pub use pixmap::{ImageFormat, Pixmap};
 pub use point::Point;
 pub use quad::Quad;
 pub use rect::{IRect, Rect};
+pub use render_options::{RenderOptions, RenderOptionsGuard};
+pub use resource_store::{DirectoryStore, MemoryStore, ResourceStore};
 pub use separations::Separations;
 pub use shade::Shade;
 pub use size::Size;
 pub use stroke_state::{LineCap, LineJoin, StrokeState};
+pub use svg_options::{SvgOptions, SvgTextFormat};
 pub use text::{Text, TextItem, TextSpan};
 pub use text_page::{TextBlock, TextChar, TextLine, TextPage, TextPageOptions};
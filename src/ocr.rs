@@ -0,0 +1,254 @@
+use std::ffi::{CStr, CString};
+use std::io::{Seek, Write};
+use std::mem;
+use std::ops::Range;
+use std::slice;
+use std::thread;
+
+use mupdf_sys::*;
+
+use crate::{context, DisplayList, Document, DocumentWriter, Error, Matrix, Rect};
+
+/// Height in pixels of the pages recognized together, Tesseract works on 16 bit coordinates
+const MAX_STACK_HEIGHT: f32 = 32000.0;
+/// Space between stacked pages, same as `MUPDF_OCR_GAP` of the wrapper
+const STACK_GAP: f32 = 72.0;
+
+/// Options of recognizing text with Tesseract
+#[derive(Debug, Clone, PartialEq)]
+pub struct OcrOptions {
+    /// Tesseract languages, such as `eng` or `eng+deu`
+    pub language: String,
+    /// Resolution pages are rendered at for recognition
+    pub dpi: f32,
+    /// Threads recognizing pages, 0 for one per CPU
+    pub threads: usize,
+}
+
+impl Default for OcrOptions {
+    fn default() -> Self {
+        Self {
+            language: "eng".to_string(),
+            dpi: 300.0,
+            threads: 0,
+        }
+    }
+}
+
+/// Recognize a batch of pages at once, Tesseract is set up once per batch
+fn recognize(lists: &[DisplayList], dpi: f32, language: &CStr) -> Result<Vec<DisplayList>, Error> {
+    let mut ptrs: Vec<*mut fz_display_list> = lists.iter().map(|list| list.inner).collect();
+    unsafe {
+        let results = ffi_try!(mupdf_ocr_display_lists(
+            context(),
+            ptrs.as_mut_ptr(),
+            ptrs.len() as i32,
+            dpi,
+            language.as_ptr()
+        ));
+        let recognized = slice::from_raw_parts(results, ptrs.len())
+            .iter()
+            .map(|&list| DisplayList::from_raw(list))
+            .collect();
+        fz_free(context(), results as _);
+        Ok(recognized)
+    }
+}
+
+fn stack_height(list: &DisplayList, dpi: f32) -> f32 {
+    let bounds = list.bounds();
+    (bounds.y1 - bounds.y0 + STACK_GAP) * dpi / 72.0
+}
+
+/// Whether a page of stacked height `h` joins a batch of stacked height `height`,
+/// 0 for an empty batch. A page taller than `MAX_STACK_HEIGHT` gets a batch of its own.
+fn fits_batch(height: f32, h: f32) -> bool {
+    height == 0.0 || height + h <= MAX_STACK_HEIGHT
+}
+
+/// Split pages of stacked `heights` into batches of consecutive pages
+fn split_batches(heights: &[f32]) -> Vec<Range<usize>> {
+    let mut batches = Vec::new();
+    let mut start = 0;
+    let mut height = 0.0;
+    for (i, &h) in heights.iter().enumerate() {
+        if !fits_batch(height, h) {
+            batches.push(start..i);
+            start = i;
+            height = 0.0;
+        }
+        height += h;
+    }
+    if start < heights.len() {
+        batches.push(start..heights.len());
+    }
+    batches
+}
+
+/// Recognize the text of `lists` on the current thread
+pub(crate) fn ocr_lists(
+    lists: &[DisplayList],
+    options: &OcrOptions,
+) -> Result<Vec<DisplayList>, Error> {
+    let language = CString::new(options.language.as_str())?;
+    let heights: Vec<f32> = lists
+        .iter()
+        .map(|list| stack_height(list, options.dpi))
+        .collect();
+    let mut recognized = Vec::with_capacity(lists.len());
+    for batch in split_batches(&heights) {
+        recognized.extend(recognize(&lists[batch], options.dpi, &language)?);
+    }
+    Ok(recognized)
+}
+
+/// Recognize the text of every page of `doc`.
+///
+/// Pages are recorded on the calling thread and grouped into batches that each
+/// worker thread recognizes with a single Tesseract instance.
+pub(crate) fn ocr_document(
+    doc: &Document,
+    options: &OcrOptions,
+) -> Result<Vec<DisplayList>, Error> {
+    let c_language = CString::new(options.language.as_str())?;
+    let language = c_language.as_c_str();
+    let page_count = doc.page_count()?;
+    let threads = match options.threads {
+        0 => thread::available_parallelism().map_or(1, |n| n.get()),
+        n => n,
+    };
+    let mut recognized = Vec::with_capacity(page_count as usize);
+    let mut next = 0;
+    let mut carry = None;
+    loop {
+        // Record enough pages to give every worker a batch
+        let mut batches: Vec<Vec<DisplayList>> = Vec::new();
+        let mut current = Vec::new();
+        let mut height = 0.0;
+        loop {
+            let list = match carry.take() {
+                Some(list) => list,
+                None if next < page_count => {
+                    let list = doc.load_page(next)?.to_display_list(true)?;
+                    next += 1;
+                    list
+                }
+                None => break,
+            };
+            let h = stack_height(&list, options.dpi);
+            if !fits_batch(height, h) {
+                batches.push(mem::take(&mut current));
+                height = 0.0;
+                if batches.len() == threads {
+                    carry = Some(list);
+                    break;
+                }
+            }
+            height += h;
+            current.push(list);
+        }
+        if !current.is_empty() {
+            batches.push(current);
+        }
+        if batches.is_empty() {
+            return Ok(recognized);
+        }
+
+        let done: Vec<Result<Vec<DisplayList>, Error>> = thread::scope(|scope| {
+            let workers: Vec<_> = batches
+                .iter()
+                .map(|batch| scope.spawn(move || recognize(batch, options.dpi, language)))
+                .collect();
+            workers
+                .into_iter()
+                .map(|worker| worker.join().unwrap())
+                .collect()
+        });
+        for batch in done {
+            recognized.extend(batch?);
+        }
+    }
+}
+
+/// Write recognized pages as a PDF, the recognized text is an invisible layer over the page
+pub(crate) fn write_pdf<W: Write + Seek>(lists: &[DisplayList], w: &mut W) -> Result<(), Error> {
+    let mut writer = DocumentWriter::with_output(w, "pdf", "")?;
+    for list in lists {
+        {
+            let device = writer.begin_page(list.bounds())?;
+            list.run(&device, &Matrix::IDENTITY, Rect::INF)?;
+        }
+        writer.end_page()?;
+    }
+    writer.close()
+}
+
+#[cfg(test)]
+mod test {
+    use super::{ocr_lists, split_batches, stack_height, OcrOptions, MAX_STACK_HEIGHT};
+    use crate::{ColorParams, Colorspace, Device, DisplayList, Document, Image, Matrix, Rect};
+
+    #[test]
+    fn test_ocr_batches() {
+        assert!(split_batches(&[]).is_empty());
+        let half = MAX_STACK_HEIGHT / 2.0;
+        assert_eq!(split_batches(&[half, half]), vec![0..2]);
+        assert_eq!(split_batches(&[half, half, 1.0]), vec![0..2, 2..3]);
+        // A page taller than a batch is recognized on its own
+        assert_eq!(
+            split_batches(&[1.0, MAX_STACK_HEIGHT * 2.0, 1.0, 1.0]),
+            vec![0..1, 1..2, 2..4]
+        );
+
+        let list = DisplayList::new(Rect::new(0.0, 0.0, 612.0, 792.0)).unwrap();
+        assert_eq!(stack_height(&list, 300.0), 3600.0);
+    }
+
+    #[test]
+    fn test_ocr_unknown_language() {
+        let list = DisplayList::new(Rect::new(0.0, 0.0, 100.0, 100.0)).unwrap();
+        let options = OcrOptions {
+            language: "no-such-language".to_string(),
+            ..OcrOptions::default()
+        };
+        assert!(ocr_lists(&[list], &options).is_err());
+    }
+
+    #[test]
+    #[ignore = "needs Tesseract language data for eng"]
+    fn test_ocr_lists() {
+        let doc = Document::open("tests/files/dummy.pdf").unwrap();
+        let page0 = doc.load_page(0).unwrap();
+        let pixmap = page0
+            .to_pixmap(
+                &Matrix::new_scale(2.0, 2.0),
+                &Colorspace::device_rgb(),
+                0.0,
+                false,
+            )
+            .unwrap();
+        // The page as a picture, without any text
+        let bounds = page0.bounds().unwrap();
+        let list = DisplayList::new(bounds).unwrap();
+        {
+            let device = Device::from_display_list(&list).unwrap();
+            let image = Image::from_pixmap(&pixmap).unwrap();
+            let ctm = Matrix::new(
+                bounds.x1 - bounds.x0,
+                0.0,
+                0.0,
+                bounds.y1 - bounds.y0,
+                bounds.x0,
+                bounds.y0,
+            );
+            device
+                .fill_image(&image, &ctm, 1.0, ColorParams::default())
+                .unwrap();
+        }
+        assert!(list.search("Dummy", 1).unwrap().is_empty());
+
+        let recognized = ocr_lists(&[list], &OcrOptions::default()).unwrap();
+        assert_eq!(recognized.len(), 1);
+        assert!(!recognized[0].search("Dummy", 1).unwrap().is_empty());
+    }
+}
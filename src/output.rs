@@ -0,0 +1,185 @@
+use std::fmt;
+use std::io::{self, Seek, SeekFrom, Write};
+use std::os::raw::{c_int, c_void};
+use std::panic::{self, AssertUnwindSafe};
+use std::ptr;
+use std::slice;
+
+use mupdf_sys::*;
+
+use crate::{context, Error};
+
+trait WriteSeek: Write + Seek {
+    fn as_write(&mut self) -> &mut dyn Write;
+}
+
+impl<T: Write + Seek> WriteSeek for T {
+    fn as_write(&mut self) -> &mut dyn Write {
+        self
+    }
+}
+
+enum Sink<'a> {
+    Stream(&'a mut dyn Write),
+    Seekable(&'a mut dyn WriteSeek),
+}
+
+impl Sink<'_> {
+    fn writer(&mut self) -> &mut dyn Write {
+        match self {
+            Sink::Stream(w) => &mut **w,
+            Sink::Seekable(w) => w.as_write(),
+        }
+    }
+
+    fn seeker(&mut self) -> io::Result<&mut dyn WriteSeek> {
+        match self {
+            Sink::Stream(_) => Err(io::Error::new(
+                io::ErrorKind::Other,
+                "output is not seekable",
+            )),
+            Sink::Seekable(w) => Ok(&mut **w),
+        }
+    }
+}
+
+struct OutputState<'a> {
+    sink: Sink<'a>,
+    error: Option<io::Error>,
+}
+
+impl OutputState<'_> {
+    /// Run `f` on the sink, keeping the first error for the caller of the MuPDF function
+    fn call<T, F>(&mut self, f: F) -> Option<T>
+    where
+        F: FnOnce(&mut Sink) -> io::Result<T>,
+    {
+        if self.error.is_some() {
+            return None;
+        }
+        let sink = &mut self.sink;
+        match panic::catch_unwind(AssertUnwindSafe(|| f(sink))) {
+            Ok(Ok(value)) => Some(value),
+            Ok(Err(err)) => {
+                self.error = Some(err);
+                None
+            }
+            Err(_) => {
+                self.error = Some(io::Error::new(io::ErrorKind::Other, "output panicked"));
+                None
+            }
+        }
+    }
+}
+
+unsafe extern "C" fn output_write(opaque: *mut c_void, data: *const c_void, n: usize) -> c_int {
+    if n == 0 {
+        return 0;
+    }
+    let state = &mut *(opaque as *mut OutputState);
+    let data = slice::from_raw_parts(data as *const u8, n);
+    match state.call(|sink| sink.writer().write_all(data)) {
+        Some(()) => 0,
+        None => -1,
+    }
+}
+
+unsafe extern "C" fn output_seek(opaque: *mut c_void, offset: i64, whence: c_int) -> c_int {
+    let state = &mut *(opaque as *mut OutputState);
+    let pos = match whence {
+        0 => SeekFrom::Start(offset as u64),
+        1 => SeekFrom::Current(offset),
+        _ => SeekFrom::End(offset),
+    };
+    match state.call(|sink| sink.seeker()?.seek(pos)) {
+        Some(_) => 0,
+        None => -1,
+    }
+}
+
+unsafe extern "C" fn output_tell(opaque: *mut c_void) -> i64 {
+    let state = &mut *(opaque as *mut OutputState);
+    match state.call(|sink| sink.seeker()?.stream_position()) {
+        Some(pos) => pos as i64,
+        None => -1,
+    }
+}
+
+/// A MuPDF output stream writing to a Rust writer.
+///
+/// Data is buffered on the MuPDF side and handed to the writer in chunks, I/O
+/// errors of the writer are returned by the operation that was writing.
+pub struct Output<'a> {
+    pub(crate) inner: *mut fz_output,
+    state: Box<OutputState<'a>>,
+}
+
+impl<'a> Output<'a> {
+    pub fn new<W: Write>(w: &'a mut W) -> Result<Self, Error> {
+        Self::from_sink(Sink::Stream(w))
+    }
+
+    /// An output that can also seek, needed by formats that go back to patch
+    /// what they wrote
+    pub fn with_seek<W: Write + Seek>(w: &'a mut W) -> Result<Self, Error> {
+        Self::from_sink(Sink::Seekable(w))
+    }
+
+    fn from_sink(sink: Sink<'a>) -> Result<Self, Error> {
+        let seekable = matches!(sink, Sink::Seekable(_));
+        let mut state = Box::new(OutputState { sink, error: None });
+        let opaque = &mut *state as *mut OutputState as *mut c_void;
+        let inner = unsafe {
+            ffi_try!(mupdf_new_callback_output(
+                context(),
+                opaque,
+                Some(output_write),
+                if seekable { Some(output_seek) } else { None },
+                if seekable { Some(output_tell) } else { None }
+            ))
+        };
+        Ok(Self { inner, state })
+    }
+
+    /// Flush the buffered data to the writer and close the output
+    pub fn close(mut self) -> Result<(), Error> {
+        let ret = (|| unsafe {
+            ffi_try!(mupdf_close_output(context(), self.inner));
+            Ok(())
+        })();
+        self.check(ret)
+    }
+
+    /// Hand the fz_output over to an object that will drop it
+    pub(crate) fn take_inner(&mut self) -> *mut fz_output {
+        let inner = self.inner;
+        self.inner = ptr::null_mut();
+        inner
+    }
+
+    /// Prefer the error of the writer to the one MuPDF reported for it
+    pub(crate) fn check<T>(&mut self, ret: Result<T, Error>) -> Result<T, Error> {
+        match (ret, self.state.error.take()) {
+            (Err(_), Some(err)) => Err(err.into()),
+            (ret, _) => ret,
+        }
+    }
+}
+
+impl fmt::Debug for Output<'_> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("Output")
+            .field("inner", &self.inner)
+            .finish()
+    }
+}
+
+impl Drop for Output<'_> {
+    fn drop(&mut self) {
+        if !self.inner.is_null() {
+            unsafe {
+                fz_drop_output(context(), self.inner);
+            }
+        }
+    }
+}
@@ -1,13 +1,14 @@
 use std::ffi::{CStr, CString};
-use std::io::Read;
+use std::io::{Read, Write};
 use std::ptr;
 use std::slice;
 
 use mupdf_sys::*;
 
 use crate::{
-    context, Buffer, Colorspace, Cookie, Device, DisplayList, Error, Link, Matrix, Pixmap, Quad,
-    Rect, Separations, TextPage, TextPageOptions,
+    context, diagnostics, Buffer, Colorspace, Cookie, Device, Diagnostics, DisplayList, Error,
+    IRect, Link, Matrix, Output, Pixmap, Quad, Rect, RenderOptions, Separations, SvgOptions,
+    TextPage, TextPageOptions,
 };
 
 #[derive(Debug)]
@@ -49,6 +50,107 @@ impl Page {
         }
     }
 
+    /// Render with the quality settings of `options` instead of those of the thread context.
+    pub fn to_pixmap_with_options(
+        &self,
+        ctm: &Matrix,
+        cs: &Colorspace,
+        alpha: bool,
+        show_extras: bool,
+        options: &RenderOptions,
+    ) -> Result<Pixmap, Error> {
+        let _guard = options.apply();
+        unsafe {
+            let inner = ffi_try!(mupdf_page_to_pixmap_with_hints(
+                context(),
+                self.inner,
+                ctm.into(),
+                cs.inner,
+                alpha,
+                show_extras,
+                options.device_hints()
+            ));
+            Ok(Pixmap::from_raw(inner))
+        }
+    }
+
+    /// Redraw the `damage` areas, in page coordinates, of a pixmap previously rendered
+    /// with the same `ctm`, e.g. the areas returned by `PdfPage::update_with_damage`.
+    /// The rest of the pixmap is left untouched.
+    pub fn rerender_damage(
+        &self,
+        pixmap: &mut Pixmap,
+        ctm: &Matrix,
+        damage: &[Rect],
+        show_extras: bool,
+    ) -> Result<(), Error> {
+        self.rerender_areas(pixmap, ctm, damage, show_extras, 0)
+    }
+
+    /// Same as `rerender_damage` for a pixmap rendered by `to_pixmap_with_options`
+    pub fn rerender_damage_with_options(
+        &self,
+        pixmap: &mut Pixmap,
+        ctm: &Matrix,
+        damage: &[Rect],
+        show_extras: bool,
+        options: &RenderOptions,
+    ) -> Result<(), Error> {
+        let _guard = options.apply();
+        self.rerender_areas(pixmap, ctm, damage, show_extras, options.device_hints())
+    }
+
+    fn rerender_areas(
+        &self,
+        pixmap: &mut Pixmap,
+        ctm: &Matrix,
+        damage: &[Rect],
+        show_extras: bool,
+        hints: i32,
+    ) -> Result<(), Error> {
+        let mut areas: Vec<IRect> = Vec::with_capacity(damage.len());
+        for rect in damage {
+            let mut area: IRect =
+                unsafe { fz_round_rect(fz_transform_rect((*rect).into(), ctm.into())) }.into();
+            if area.is_empty() {
+                continue;
+            }
+            // Merge overlapping areas so nothing is drawn twice
+            while let Some(i) = areas.iter().position(|other| {
+                area.x0 < other.x1 && other.x0 < area.x1 && area.y0 < other.y1 && other.y0 < area.y1
+            }) {
+                area.union(areas.swap_remove(i));
+            }
+            areas.push(area);
+        }
+        for area in areas {
+            unsafe {
+                ffi_try!(mupdf_page_rerender_area(
+                    context(),
+                    self.inner,
+                    pixmap.inner,
+                    ctm.into(),
+                    area.into(),
+                    show_extras,
+                    hints
+                ));
+            }
+        }
+        Ok(())
+    }
+
+    /// Same as `to_pixmap`, also returning the warnings emitted while rendering,
+    /// e.g. about broken streams or missing fonts.
+    pub fn render_with_diagnostics(
+        &self,
+        ctm: &Matrix,
+        cs: &Colorspace,
+        alpha: f32,
+        show_extras: bool,
+    ) -> (Result<Pixmap, Error>, Diagnostics) {
+        diagnostics::capture(|| self.to_pixmap(ctm, cs, alpha, show_extras))
+    }
+
     pub fn to_svg(&self, ctm: &Matrix) -> Result<String, Error> {
         let mut buf = unsafe {
             let inner = ffi_try!(mupdf_page_to_svg(
@@ -79,6 +181,36 @@ impl Page {
         Ok(svg)
     }
 
+    /// Write the page as SVG to `w` while it is generated, instead of building it in memory
+    pub fn write_svg<W: Write>(
+        &self,
+        ctm: &Matrix,
+        options: &SvgOptions,
+        w: &mut W,
+    ) -> Result<(), Error> {
+        let mut out = Output::new(w)?;
+        let ret = (|| unsafe {
+            ffi_try!(mupdf_page_write_svg(
+                context(),
+                self.inner,
+                out.inner,
+                ctm.into(),
+                options.text_format as _,
+                options.reuse_images,
+                ptr::null_mut()
+            ));
+            Ok(())
+        })();
+        out.check(ret)
+    }
+
+    /// Recognize the text of the page with Tesseract, see `Document::ocr`
+    #[cfg(feature = "ocr")]
+    pub fn ocr(&self, options: &crate::ocr::OcrOptions) -> Result<DisplayList, Error> {
+        let lists = crate::ocr::ocr_lists(&[self.to_display_list(true)?], options)?;
+        Ok(lists.into_iter().next().unwrap())
+    }
+
     pub fn to_text_page(&self, opts: TextPageOptions) -> Result<TextPage, Error> {
         unsafe {
             let inner = ffi_try!(mupdf_page_to_text_page(
@@ -371,6 +503,81 @@ mod test {
         assert!(!svg.is_empty());
     }
 
+    #[test]
+    fn test_page_write_svg() {
+        use crate::{SvgOptions, SvgTextFormat};
+        use std::io::{self, Write};
+
+        let doc = Document::open("tests/files/dummy.pdf").unwrap();
+        let page0 = doc.load_page(0).unwrap();
+        let mut svg = Vec::new();
+        page0
+            .write_svg(&Matrix::IDENTITY, &SvgOptions::default(), &mut svg)
+            .unwrap();
+        assert_eq!(
+            String::from_utf8(svg).unwrap(),
+            page0.to_svg(&Matrix::IDENTITY).unwrap()
+        );
+
+        let options = SvgOptions {
+            text_format: SvgTextFormat::Text,
+            ..SvgOptions::default()
+        };
+        let mut svg = Vec::new();
+        page0
+            .write_svg(&Matrix::IDENTITY, &options, &mut svg)
+            .unwrap();
+        assert!(String::from_utf8(svg).unwrap().contains("<text"));
+
+        struct Closed;
+
+        impl Write for Closed {
+            fn write(&mut self, _buf: &[u8]) -> io::Result<usize> {
+                Err(io::ErrorKind::BrokenPipe.into())
+            }
+
+            fn flush(&mut self) -> io::Result<()> {
+                Ok(())
+            }
+        }
+
+        let err = page0
+            .write_svg(&Matrix::IDENTITY, &options, &mut Closed)
+            .unwrap_err();
+        assert!(matches!(err, crate::Error::Io(e) if e.kind() == io::ErrorKind::BrokenPipe));
+    }
+
+    #[test]
+    fn test_page_render_with_diagnostics() {
+        use crate::Colorspace;
+
+        let doc = Document::open("tests/files/dummy.pdf").unwrap();
+        let page0 = doc.load_page(0).unwrap();
+        let (pixmap, diagnostics) =
+            page0.render_with_diagnostics(&Matrix::IDENTITY, &Colorspace::device_rgb(), 0.0, true);
+        assert!(pixmap.is_ok());
+        assert!(diagnostics.is_empty());
+    }
+
+    #[test]
+    fn test_page_to_pixmap_with_options() {
+        use crate::{Colorspace, RenderOptions};
+
+        let doc = Document::open("tests/files/dummy.pdf").unwrap();
+        let page0 = doc.load_page(0).unwrap();
+        let cs = Colorspace::device_rgb();
+        let print = page0
+            .to_pixmap_with_options(&Matrix::IDENTITY, &cs, false, true, &RenderOptions::print())
+            .unwrap();
+        let fast = page0
+            .to_pixmap_with_options(&Matrix::IDENTITY, &cs, false, true, &RenderOptions::fast())
+            .unwrap();
+        assert_eq!(print.width(), fast.width());
+        // Without antialiasing the text edges are pure black or white
+        assert!(fast.samples().iter().all(|&v| v == 0 || v == 255));
+        assert!(print.samples().iter().any(|&v| v != 0 && v != 255));
+    }
+
     #[test]
     fn test_page_to_html() {
         let doc = Document::open("tests/files/dummy.pdf").unwrap();
@@ -1,11 +1,13 @@
+use std::cell::RefCell;
 use std::convert::TryFrom;
 use std::ffi::{CStr, CString};
+use std::rc::Rc;
 
 use mupdf_sys::*;
 use num_enum::TryFromPrimitive;
 
 use crate::pdf::PdfFilterOptions;
-use crate::{context, Error};
+use crate::{context, Error, Rect};
 
 #[derive(Debug, Clone, Copy, PartialEq, TryFromPrimitive)]
 #[repr(i32)]
@@ -54,14 +56,27 @@ pub enum LineEndingStyle {
     Slash = 9,
 }
 
+/// Areas of a page to redraw, shared by a `PdfPage` and its annotations
+pub(crate) type Damage = Rc<RefCell<Vec<Rect>>>;
+
 #[derive(Debug)]
 pub struct PdfAnnotation {
     pub(crate) inner: *mut pdf_annot,
+    damage: Option<Damage>,
 }
 
 impl PdfAnnotation {
     pub(crate) unsafe fn from_raw(ptr: *mut pdf_annot) -> Self {
-        Self { inner: ptr }
+        Self {
+            inner: ptr,
+            damage: None,
+        }
+    }
+
+    /// Report the areas left by edits to `damage`
+    pub(crate) fn with_damage(mut self, damage: &Damage) -> Self {
+        self.damage = Some(damage.clone());
+        self
     }
 
     pub fn r#type(&self) -> Result<PdfAnnotationType, Error> {
@@ -70,6 +85,25 @@ impl PdfAnnotation {
         Ok(typ)
     }
 
+    /// Bounds of the annotation in page coordinates
+    pub fn bounds(&self) -> Result<Rect, Error> {
+        let rect = unsafe { ffi_try!(mupdf_pdf_bound_annot(context(), self.inner)) };
+        Ok(rect.into())
+    }
+
+    /// Move or resize the annotation, the area it covered is reported by the next
+    /// `PdfPage::update_with_damage`
+    pub fn set_rect(&mut self, rect: Rect) -> Result<(), Error> {
+        let before = self.bounds().unwrap_or(Rect::INF);
+        unsafe {
+            ffi_try!(mupdf_pdf_set_annot_rect(context(), self.inner, rect.into()));
+        }
+        if let Some(damage) = &self.damage {
+            damage.borrow_mut().push(before);
+        }
+        Ok(())
+    }
+
     pub fn is_hot(&self) -> bool {
         unsafe { pdf_annot_hot(context(), self.inner) != 0 }
     }
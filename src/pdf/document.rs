@@ -3,14 +3,16 @@ use std::ffi::{CStr, CString};
 use std::io::{self, Write};
 use std::ops::{Deref, DerefMut};
 use std::ptr;
+use std::thread;
 
 use bitflags::bitflags;
 use mupdf_sys::*;
 use num_enum::TryFromPrimitive;
 
-use crate::pdf::{PdfGraftMap, PdfObject, PdfPage};
+use crate::pdf::image_optimizer::{self, ImageOptimizeOptions};
+use crate::pdf::{PdfFilterOptions, PdfGraftMap, PdfObject, PdfPage, PdfRedactOptions};
 use crate::{
-    context, Buffer, CjkFontOrdering, Document, Error, Font, Image, SimpleFontEncoding, Size,
+    context, Buffer, CjkFontOrdering, Document, Error, Font, Image, Rect, SimpleFontEncoding, Size,
     WriteMode,
 };
 
@@ -237,6 +239,16 @@ impl PdfDocument {
         Self { inner: ptr, doc }
     }
 
+    /// Open a document over `bytes` without copying them, the document must not outlive them
+    pub(crate) unsafe fn from_shared_bytes(bytes: &[u8]) -> Result<Self, Error> {
+        let inner = ffi_try!(mupdf_pdf_open_document_from_shared_bytes(
+            context(),
+            bytes.as_ptr(),
+            bytes.len()
+        ));
+        Ok(Self::from_raw(inner))
+    }
+
     pub fn new() -> Self {
         unsafe {
             let inner = pdf_create_document(context());
@@ -453,6 +465,139 @@ impl PdfDocument {
         Ok(())
     }
 
+    /// Set the values of many form fields, by fully qualified field name.
+    ///
+    /// Unlike setting fields one by one, the fields' triggers are not run, the form is
+    /// calculated once and the appearances of all pages are regenerated in one pass.
+    /// Returns the number of fields that were set, unknown fields are skipped.
+    pub fn fill_fields<I, K, V>(&mut self, fields: I) -> Result<usize, Error>
+    where
+        I: IntoIterator<Item = (K, V)>,
+        K: AsRef<str>,
+        V: AsRef<str>,
+    {
+        let mut names = Vec::new();
+        let mut values = Vec::new();
+        for (name, value) in fields {
+            names.push(CString::new(name.as_ref())?);
+            values.push(CString::new(value.as_ref())?);
+        }
+        let mut name_ptrs: Vec<_> = names.iter().map(|name| name.as_ptr()).collect();
+        let mut value_ptrs: Vec<_> = values.iter().map(|value| value.as_ptr()).collect();
+        let filled = unsafe {
+            ffi_try!(mupdf_pdf_fill_fields(
+                context(),
+                self.inner,
+                name_ptrs.as_mut_ptr(),
+                value_ptrs.as_mut_ptr(),
+                names.len() as i32
+            ))
+        };
+        Ok(filled as usize)
+    }
+
+    /// Redact regions of many pages, given as page numbers and regions in page
+    /// coordinates. Returns the number of pages that had something redacted.
+    pub fn redact_regions(
+        &mut self,
+        regions: &[(i32, Vec<Rect>)],
+        options: &PdfRedactOptions,
+    ) -> Result<usize, Error> {
+        let mut redacted = 0;
+        for (page_no, rects) in regions {
+            let mut page = PdfPage::from(self.load_page(*page_no)?);
+            if page.redact_regions(rects, options)? {
+                redacted += 1;
+            }
+        }
+        Ok(redacted)
+    }
+
+    /// Downsample the images drawn above `options.threshold_dpi` anywhere in the
+    /// document to `options.target_dpi`, decoding and scaling them on several threads.
+    /// Returns the number of images replaced.
+    ///
+    /// `options.target_dpi` must be above 0 and no higher than `options.threshold_dpi`.
+    pub fn optimize_images(&mut self, options: &ImageOptimizeOptions) -> Result<usize, Error> {
+        image_optimizer::optimize_images(self, options)
+    }
+
+    /// Filter the contents of every page, see `PdfPage::filter`.
+    ///
+    /// With more than one thread, 0 for one per CPU, the pages are split between
+    /// copies of the document that are filtered in parallel, and the objects each copy
+    /// changed are then merged back one copy at a time. `options` is called once per
+    /// thread, as filter callbacks can't be shared between threads.
+    pub fn filter_all<'f, F>(&mut self, options: F, threads: usize) -> Result<(), Error>
+    where
+        F: Fn() -> PdfFilterOptions<'f> + Sync,
+    {
+        let page_count = self.page_count()?;
+        let threads = match threads {
+            0 => thread::available_parallelism().map_or(1, |n| n.get()),
+            n => n,
+        }
+        .min(page_count.max(1) as usize);
+        if threads == 1 {
+            let mut opts = options();
+            for page_no in 0..page_count {
+                let mut page = PdfPage::from(self.load_page(page_no)?);
+                page.filter_with(&mut opts)?;
+            }
+            return Ok(());
+        }
+
+        struct Filtered {
+            doc: PdfDocument,
+            base_len: i32,
+        }
+
+        // Only moved back to the thread that merges it
+        unsafe impl Send for Filtered {}
+
+        // The copies are written unencrypted so they open without the password
+        let mut write_options = PdfWriteOptions::default();
+        write_options.set_encryption(Encryption::None);
+        let mut bytes = Vec::new();
+        self.write_to_with_options(&mut bytes, write_options)?;
+        let results: Vec<Result<Filtered, Error>> = thread::scope(|scope| {
+            let workers: Vec<_> = (0..threads)
+                .map(|i| {
+                    let (bytes, options) = (&bytes, &options);
+                    scope.spawn(move || {
+                        let doc = unsafe { PdfDocument::from_shared_bytes(bytes)? };
+                        let base_len = doc.count_objects()? as i32;
+                        let mut opts = options();
+                        // Balanced and never empty, as there are no more threads than pages
+                        let start = (i * page_count as usize / threads) as i32;
+                        let end = ((i + 1) * page_count as usize / threads) as i32;
+                        for page_no in start..end {
+                            let mut page = PdfPage::from(doc.load_page(page_no)?);
+                            page.filter_with(&mut opts)?;
+                        }
+                        Ok(Filtered { doc, base_len })
+                    })
+                })
+                .collect();
+            workers
+                .into_iter()
+                .map(|worker| worker.join().unwrap())
+                .collect()
+        });
+        for result in results {
+            let filtered = result?;
+            unsafe {
+                ffi_try!(mupdf_pdf_merge_changes(
+                    context(),
+                    self.inner,
+                    filtered.doc.inner,
+                    filtered.base_len
+                ));
+            }
+        }
+        Ok(())
+    }
+
     pub fn trailer(&self) -> Result<PdfObject, Error> {
         unsafe {
             let inner = ffi_try!(mupdf_pdf_trailer(context(), self.inner));
@@ -524,6 +669,24 @@ impl PdfDocument {
         }
     }
 
+    /// Write the changes made since the document was opened from `base_len` bytes, as an
+    /// incremental update to append to them. Returns the whole document instead, and
+    /// `false`, if it can't be saved incrementally.
+    pub(crate) fn write_changes(&self, base_len: usize) -> Result<(Buffer, bool), Error> {
+        let options = PdfWriteOptions::default();
+        let mut incremental = false;
+        unsafe {
+            let buf = ffi_try!(mupdf_pdf_write_changes(
+                context(),
+                self.inner,
+                options.inner,
+                base_len,
+                &mut incremental
+            ));
+            Ok((Buffer::from_raw(buf), incremental))
+        }
+    }
+
     pub fn write_to_with_options<W: Write>(
         &self,
         w: &mut W,
@@ -779,6 +942,92 @@ mod test {
         assert_eq!(bounds.y1, 842.0);
     }
 
+    #[test]
+    fn test_pdf_document_fill_fields() {
+        use std::collections::HashMap;
+
+        use crate::Size;
+
+        let mut pdf = PdfDocument::new();
+        let mut page_obj = pdf.new_page(Size::A6).unwrap().object();
+        let field = pdf
+            .new_object_from_str(
+                "<</Type/Annot/Subtype/Widget/FT/Tx/T(name)/Rect[10 10 200 40]/DA(/Helv 12 Tf 0 g)>>",
+            )
+            .unwrap();
+        let field = pdf.add_object(&field).unwrap();
+        let mut annots = pdf.new_array().unwrap();
+        annots.array_push(field.try_clone().unwrap()).unwrap();
+        page_obj.dict_put("Annots", annots).unwrap();
+        let form = pdf
+            .new_object_from_str(
+                "<</Fields[]/DR<</Font<</Helv<</Type/Font/Subtype/Type1/BaseFont/Helvetica>>>>>>>>",
+            )
+            .unwrap();
+        form.get_dict("Fields")
+            .unwrap()
+            .unwrap()
+            .array_push(field.try_clone().unwrap())
+            .unwrap();
+        pdf.catalog().unwrap().dict_put("AcroForm", form).unwrap();
+
+        let mut values = HashMap::new();
+        values.insert("name", "Alice");
+        values.insert("missing", "Bob");
+        assert_eq!(pdf.fill_fields(&values).unwrap(), 1);
+        let value = field.get_dict("V").unwrap().unwrap();
+        assert_eq!(value.as_string().unwrap(), "Alice");
+    }
+
+    #[test]
+    fn test_pdf_document_redact_regions() {
+        use crate::pdf::PdfRedactOptions;
+        use crate::Rect;
+
+        let mut doc = PdfDocument::open("tests/files/dummy.pdf").unwrap();
+        let hits = doc.load_page(0).unwrap().search("Dummy", 1).unwrap();
+        let regions = vec![(0, hits.into_iter().map(Rect::from).collect())];
+        let redacted = doc
+            .redact_regions(&regions, &PdfRedactOptions::default())
+            .unwrap();
+        assert_eq!(redacted, 1);
+        let text = doc.load_page(0).unwrap().to_text().unwrap();
+        assert!(!text.contains("Dummy"));
+    }
+
+    #[test]
+    fn test_pdf_document_optimize_images() {
+        use crate::pdf::ImageOptimizeOptions;
+        use crate::{Colorspace, Matrix};
+
+        let mut doc = PdfDocument::open("tests/files/multiple-images.pdf").unwrap();
+        let options = ImageOptimizeOptions {
+            threshold_dpi: 10.0,
+            target_dpi: 10.0,
+            threads: 2,
+        };
+        assert!(doc.optimize_images(&options).unwrap() > 0);
+        let page0 = doc.load_page(0).unwrap();
+        page0
+            .to_pixmap(&Matrix::IDENTITY, &Colorspace::device_rgb(), 0.0, true)
+            .unwrap();
+        // Nothing is drawn above the threshold anymore
+        let options = ImageOptimizeOptions {
+            threshold_dpi: 20.0,
+            ..options
+        };
+        assert_eq!(doc.optimize_images(&options).unwrap(), 0);
+
+        for (threshold_dpi, target_dpi) in [(10.0, 20.0), (10.0, 0.0), (10.0, -1.0)] {
+            let options = ImageOptimizeOptions {
+                threshold_dpi,
+                target_dpi,
+                threads: 2,
+            };
+            assert!(doc.optimize_images(&options).is_err());
+        }
+    }
+
     #[test]
     fn test_pdf_document_find_page() {
         let doc = PdfDocument::open("tests/files/dummy.pdf").unwrap();
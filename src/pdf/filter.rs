@@ -1,5 +1,6 @@
 use mupdf_sys::*;
 
+use std::collections::HashMap;
 use std::ffi::CStr;
 use std::marker::PhantomData;
 use std::mem::{self, ManuallyDrop};
@@ -124,7 +125,8 @@ impl<'a> PdfFilterOptions<'a> {
             });
 
             if let Ok(Some(ret)) = ret {
-                ret.inner
+                // MuPDF drops the returned image once it has been added
+                ManuallyDrop::new(ret).inner
             } else {
                 ptr::null_mut()
             }
@@ -133,4 +135,34 @@ impl<'a> PdfFilterOptions<'a> {
         self.inner.image_filter = Some(image_filter_callback::<Cb>);
         self
     }
+
+    /// Same as `set_image_filter`, but the callback runs once per image rather than
+    /// once per use of the image: the result for an image drawn on many pages is
+    /// reused, so the replacement image is shared by all of them.
+    ///
+    /// With `by_scale`, images drawn at sizes more than a factor of 2 apart are
+    /// filtered separately, e.g. to downsample each size to its own resolution.
+    pub fn set_shared_image_filter<Cb: 'a>(&mut self, by_scale: bool, mut filter: Cb) -> &mut Self
+    where
+        Cb: FnMut(Matrix, &str, &Image) -> Option<Image>,
+    {
+        // The source images are kept, so MuPDF hands out the same image for the same
+        // object on every page and the pointer identifies the object
+        let mut cache: HashMap<(*mut fz_image, i32), (Image, Option<Image>)> = HashMap::new();
+        self.set_image_filter(move |ctm, name, image| {
+            let class = if by_scale {
+                let scale = (ctm.a * ctm.d - ctm.b * ctm.c).abs().sqrt();
+                scale.log2().round() as i32
+            } else {
+                0
+            };
+            let key = (image.inner, class);
+            if let Some((_, result)) = cache.get(&key) {
+                return result.clone();
+            }
+            let result = filter(ctm, name, image);
+            cache.insert(key, (image.clone(), result.clone()));
+            result
+        })
+    }
 }
@@ -0,0 +1,126 @@
+use std::fs;
+use std::io::{self, Write};
+use std::sync::Arc;
+
+use crate::pdf::PdfDocument;
+use crate::Error;
+
+/// A PDF form filled many times, e.g. once per recipient of a mail merge.
+///
+/// The template bytes are loaded once and shared by every fill, including fills on
+/// other threads. Each filled output is the unchanged template followed by an
+/// incremental update holding only the changed fields and their appearances.
+#[derive(Debug, Clone)]
+pub struct FormTemplate {
+    data: Arc<[u8]>,
+}
+
+impl FormTemplate {
+    pub fn open(filename: &str) -> Result<Self, Error> {
+        Self::from_bytes(fs::read(filename)?)
+    }
+
+    pub fn from_bytes<B: Into<Vec<u8>>>(bytes: B) -> Result<Self, Error> {
+        let data: Arc<[u8]> = bytes.into().into();
+        // Fail early on documents that aren't PDF
+        unsafe { PdfDocument::from_shared_bytes(&data)? };
+        Ok(Self { data })
+    }
+
+    /// The template document
+    pub fn as_bytes(&self) -> &[u8] {
+        &self.data
+    }
+
+    /// Fill the template and write the filled document to `w`,
+    /// see `PdfDocument::fill_fields`.
+    pub fn fill_to<W, I, K, V>(&self, fields: I, w: &mut W) -> Result<u64, Error>
+    where
+        W: Write,
+        I: IntoIterator<Item = (K, V)>,
+        K: AsRef<str>,
+        V: AsRef<str>,
+    {
+        let (mut changes, incremental) = {
+            let mut doc = unsafe { PdfDocument::from_shared_bytes(&self.data)? };
+            doc.fill_fields(fields)?;
+            doc.write_changes(self.data.len())?
+        };
+        let mut written = 0;
+        if incremental {
+            w.write_all(&self.data)?;
+            written += self.data.len() as u64;
+        }
+        written += io::copy(&mut changes, w)?;
+        Ok(written)
+    }
+
+    /// Fill the template, returning the filled document
+    pub fn fill<I, K, V>(&self, fields: I) -> Result<Vec<u8>, Error>
+    where
+        I: IntoIterator<Item = (K, V)>,
+        K: AsRef<str>,
+        V: AsRef<str>,
+    {
+        let mut out = Vec::with_capacity(self.data.len() + 4096);
+        self.fill_to(fields, &mut out)?;
+        Ok(out)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::FormTemplate;
+    use crate::pdf::PdfDocument;
+    use crate::Size;
+
+    #[test]
+    fn test_form_template_fill() {
+        let mut pdf = PdfDocument::new();
+        let mut page_obj = pdf.new_page(Size::A6).unwrap().object();
+        let field = pdf
+            .new_object_from_str(
+                "<</Type/Annot/Subtype/Widget/FT/Tx/T(name)/Rect[10 10 200 40]/DA(/Helv 12 Tf 0 g)>>",
+            )
+            .unwrap();
+        let field = pdf.add_object(&field).unwrap();
+        let mut annots = pdf.new_array().unwrap();
+        annots.array_push(field.try_clone().unwrap()).unwrap();
+        page_obj.dict_put("Annots", annots).unwrap();
+        let form = pdf
+            .new_object_from_str(
+                "<</Fields[]/DR<</Font<</Helv<</Type/Font/Subtype/Type1/BaseFont/Helvetica>>>>>>>>",
+            )
+            .unwrap();
+        form.get_dict("Fields")
+            .unwrap()
+            .unwrap()
+            .array_push(field)
+            .unwrap();
+        pdf.catalog().unwrap().dict_put("AcroForm", form).unwrap();
+        let mut bytes = Vec::new();
+        pdf.write_to(&mut bytes).unwrap();
+
+        let template = FormTemplate::from_bytes(bytes).unwrap();
+        for name in &["Alice", "Bob"] {
+            let filled = template.fill(vec![("name", *name)]).unwrap();
+            assert!(filled.starts_with(template.as_bytes()));
+
+            let doc = PdfDocument::from_bytes(&filled).unwrap();
+            let field = doc
+                .catalog()
+                .unwrap()
+                .get_dict("AcroForm")
+                .unwrap()
+                .unwrap()
+                .get_dict("Fields")
+                .unwrap()
+                .unwrap()
+                .get_array(0)
+                .unwrap()
+                .unwrap();
+            let value = field.get_dict("V").unwrap().unwrap();
+            assert_eq!(value.as_string().unwrap(), *name);
+        }
+    }
+}
@@ -0,0 +1,176 @@
+use std::slice;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
+
+use mupdf_sys::*;
+
+use crate::pdf::PdfDocument;
+use crate::{context, Buffer, Error};
+
+/// Options of `PdfDocument::optimize_images`
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct ImageOptimizeOptions {
+    /// Images drawn above this resolution are downsampled
+    pub threshold_dpi: f32,
+    /// Resolution downsampled images are scaled to
+    pub target_dpi: f32,
+    /// Threads decoding and scaling images, 0 for one per CPU
+    pub threads: usize,
+}
+
+impl Default for ImageOptimizeOptions {
+    fn default() -> Self {
+        Self {
+            threshold_dpi: 225.0,
+            target_dpi: 150.0,
+            threads: 0,
+        }
+    }
+}
+
+/// The image XObjects of a document, holding a reference to each image
+struct ImageUsage {
+    ptr: *mut mupdf_image_usage_t,
+    len: usize,
+}
+
+impl ImageUsage {
+    fn as_slice(&self) -> &[mupdf_image_usage_t] {
+        if self.ptr.is_null() {
+            return &[];
+        }
+        unsafe { slice::from_raw_parts(self.ptr, self.len) }
+    }
+}
+
+impl Drop for ImageUsage {
+    fn drop(&mut self) {
+        unsafe {
+            for usage in self.as_slice() {
+                fz_drop_image(context(), usage.image);
+            }
+            fz_free(context(), self.ptr as _);
+        }
+    }
+}
+
+/// An image to downsample, decoding only reads the image so it can move to worker threads
+struct Job {
+    num: i32,
+    image: *mut fz_image,
+    w: i32,
+    h: i32,
+}
+
+unsafe impl Send for Job {}
+unsafe impl Sync for Job {}
+
+struct Downsampled(*mut fz_buffer, i32, i32);
+
+unsafe impl Send for Downsampled {}
+
+fn downsample(job: &Job) -> Result<Downsampled, Error> {
+    let (mut w, mut h) = (job.w, job.h);
+    let buf = unsafe { ffi_try!(mupdf_downsample_image(context(), job.image, &mut w, &mut h)) };
+    Ok(Downsampled(buf, w, h))
+}
+
+/// Downsample the images of `doc` drawn above the threshold, returning how many were replaced
+pub(crate) fn optimize_images(
+    doc: &mut PdfDocument,
+    options: &ImageOptimizeOptions,
+) -> Result<usize, Error> {
+    if !(options.target_dpi > 0.0 && options.target_dpi <= options.threshold_dpi) {
+        return Err(Error::InvalidArgument(format!(
+            "target_dpi must be above 0 and at most threshold_dpi, got {} and {}",
+            options.target_dpi, options.threshold_dpi
+        )));
+    }
+    let mut len = 0;
+    let usage = unsafe {
+        let ptr = ffi_try!(mupdf_pdf_image_usage(context(), doc.inner, &mut len));
+        ImageUsage {
+            ptr,
+            len: len as usize,
+        }
+    };
+    let jobs: Vec<Job> = usage
+        .as_slice()
+        .iter()
+        .filter(|usage| usage.dpi > options.threshold_dpi)
+        .map(|usage| {
+            let scale = (options.target_dpi / usage.dpi).min(1.0);
+            let (w, h) = unsafe { ((*usage.image).w, (*usage.image).h) };
+            Job {
+                num: usage.num,
+                image: usage.image,
+                w: ((w as f32 * scale).ceil() as i32).max(1),
+                h: ((h as f32 * scale).ceil() as i32).max(1),
+            }
+        })
+        .collect();
+    if jobs.is_empty() {
+        return Ok(0);
+    }
+
+    let threads = match options.threads {
+        0 => thread::available_parallelism().map_or(1, |n| n.get()),
+        n => n,
+    }
+    .min(jobs.len());
+    let next = AtomicUsize::new(0);
+    let mut results: Vec<(usize, Result<Downsampled, Error>)> = thread::scope(|scope| {
+        let workers: Vec<_> = (0..threads)
+            .map(|_| {
+                scope.spawn(|| {
+                    let mut done = Vec::new();
+                    loop {
+                        let i = next.fetch_add(1, Ordering::Relaxed);
+                        if i >= jobs.len() {
+                            break;
+                        }
+                        done.push((i, downsample(&jobs[i])));
+                    }
+                    done
+                })
+            })
+            .collect();
+        workers
+            .into_iter()
+            .flat_map(|worker| worker.join().unwrap())
+            .collect()
+    });
+    results.sort_by_key(|(i, _)| *i);
+
+    // Take ownership of every buffer before bailing out on an error
+    let mut replacements = Vec::with_capacity(results.len());
+    let mut error = None;
+    for (i, result) in results {
+        match result {
+            Ok(Downsampled(buf, w, h)) if !buf.is_null() => {
+                replacements.push((i, unsafe { Buffer::from_raw(buf) }, w, h))
+            }
+            Ok(_) => {}
+            Err(err) => error = error.or(Some(err)),
+        }
+    }
+    if let Some(err) = error {
+        return Err(err);
+    }
+
+    for (i, buf, w, h) in &replacements {
+        let job = &jobs[*i];
+        unsafe {
+            ffi_try!(mupdf_pdf_replace_image_samples(
+                context(),
+                doc.inner,
+                job.num,
+                buf.inner,
+                *w,
+                *h,
+                (*job.image).n as i32
+            ));
+        }
+    }
+    Ok(replacements.len())
+}
@@ -1,15 +1,21 @@
 pub mod annotation;
 pub mod document;
 pub mod filter;
+pub mod form_template;
 pub mod graft_map;
+pub mod image_optimizer;
 pub mod object;
 pub mod page;
+pub mod redact;
 pub mod widget;
 
 pub use annotation::{LineEndingStyle, PdfAnnotation, PdfAnnotationType};
 pub use document::{Encryption, PdfDocument, PdfWriteOptions, Permission};
 pub use filter::PdfFilterOptions;
+pub use form_template::FormTemplate;
 pub use graft_map::PdfGraftMap;
+pub use image_optimizer::ImageOptimizeOptions;
 pub use object::PdfObject;
 pub use page::PdfPage;
+pub use redact::{PdfRedactOptions, RedactImageMethod};
 pub use widget::PdfWidget;
@@ -1,14 +1,20 @@
+use std::borrow::Borrow;
 use std::ops::{Deref, DerefMut};
+use std::slice;
 
 use mupdf_sys::*;
 
-use crate::pdf::{PdfAnnotation, PdfAnnotationType, PdfFilterOptions, PdfObject};
+use crate::pdf::annotation::Damage;
+use crate::pdf::{PdfAnnotation, PdfAnnotationType, PdfFilterOptions, PdfObject, PdfRedactOptions};
 use crate::{context, Error, Matrix, Page, Rect};
 
 #[derive(Debug)]
 pub struct PdfPage {
     pub(crate) inner: *mut pdf_page,
     page: Page,
+    /// Areas annotations covered before being moved or deleted, not yet reported
+    /// by `update_with_damage`
+    damage: Damage,
 }
 
 impl PdfPage {
@@ -16,6 +22,7 @@ impl PdfPage {
         Self {
             inner: ptr,
             page: Page::from_raw(ptr as *mut fz_page),
+            damage: Damage::default(),
         }
     }
 
@@ -29,20 +36,26 @@ impl PdfPage {
                 self.inner,
                 subtype as i32
             ));
-            Ok(PdfAnnotation::from_raw(annot))
+            Ok(PdfAnnotation::from_raw(annot).with_damage(&self.damage))
         }
     }
 
     pub fn delete_annotation(&mut self, annot: &PdfAnnotation) -> Result<(), Error> {
+        // Redraw everything if the annotation can't be bounded
+        let bounds = annot.bounds().unwrap_or(Rect::INF);
         unsafe {
             ffi_try!(mupdf_pdf_delete_annot(context(), self.inner, annot.inner));
         }
+        self.damage.borrow_mut().push(bounds);
         Ok(())
     }
 
     pub fn annotations(&self) -> AnnotationIter {
         let next = unsafe { pdf_first_annot(context(), self.inner) };
-        AnnotationIter { next }
+        AnnotationIter {
+            next,
+            damage: self.damage.clone(),
+        }
     }
 
     pub fn update(&mut self) -> Result<bool, Error> {
@@ -50,11 +63,77 @@ impl PdfPage {
         Ok(ret)
     }
 
+    /// Same as `update`, returning the areas of the page that need to be redrawn:
+    /// the bounds of every annotation whose appearance changed, before and after
+    /// the update, and the areas annotations covered before being moved or deleted
+    /// since the last call.
+    pub fn update_with_damage(&mut self) -> Result<Vec<Rect>, Error> {
+        struct Rects(*mut fz_rect);
+
+        impl Drop for Rects {
+            fn drop(&mut self) {
+                if !self.0.is_null() {
+                    unsafe { fz_free(context(), self.0 as _) };
+                }
+            }
+        }
+
+        let mut count = 0;
+        let mut damage = unsafe {
+            let rects = Rects(ffi_try!(mupdf_pdf_update_page_with_damage(
+                context(),
+                self.inner,
+                &mut count
+            )));
+            if count == 0 {
+                Vec::new()
+            } else {
+                slice::from_raw_parts(rects.0, count as usize)
+                    .iter()
+                    .map(|rect| (*rect).into())
+                    .collect()
+            }
+        };
+        damage.append(&mut self.damage.borrow_mut());
+        Ok(damage)
+    }
+
     pub fn redact(&mut self) -> Result<bool, Error> {
         let ret = unsafe { ffi_try!(mupdf_pdf_redact_page(context(), self.inner)) };
         Ok(ret)
     }
 
+    pub fn redact_with_options(&mut self, options: &PdfRedactOptions) -> Result<bool, Error> {
+        let ret = unsafe {
+            ffi_try!(mupdf_pdf_redact_page_with_options(
+                context(),
+                self.inner,
+                options.into()
+            ))
+        };
+        Ok(ret)
+    }
+
+    /// Redact `regions`, in page coordinates, along with the redaction annotations
+    /// already on the page
+    pub fn redact_regions(
+        &mut self,
+        regions: &[Rect],
+        options: &PdfRedactOptions,
+    ) -> Result<bool, Error> {
+        let rects: Vec<fz_rect> = regions.iter().map(|rect| (*rect).into()).collect();
+        let ret = unsafe {
+            ffi_try!(mupdf_pdf_redact_regions(
+                context(),
+                self.inner,
+                rects.as_ptr(),
+                rects.len() as i32,
+                options.into()
+            ))
+        };
+        Ok(ret)
+    }
+
     pub fn object(&self) -> PdfObject {
         unsafe { PdfObject::from_raw_keep_ref((*self.inner).obj) }
     }
@@ -109,6 +188,12 @@ impl PdfPage {
     }
 
     pub fn filter(&mut self, mut opt: PdfFilterOptions) -> Result<(), Error> {
+        self.filter_with(&mut opt)
+    }
+
+    /// Same as `filter`, keeping the options so they can be used for other pages,
+    /// e.g. to share the results of `PdfFilterOptions::set_shared_image_filter`
+    pub fn filter_with(&mut self, opt: &mut PdfFilterOptions) -> Result<(), Error> {
         unsafe {
             ffi_try!(mupdf_pdf_filter_page_contents(
                 context(),
@@ -135,12 +220,19 @@ impl DerefMut for PdfPage {
     }
 }
 
+impl Borrow<Page> for PdfPage {
+    fn borrow(&self) -> &Page {
+        &self.page
+    }
+}
+
 impl From<Page> for PdfPage {
     fn from(page: Page) -> Self {
         let ptr = page.inner;
         Self {
             inner: ptr as *mut pdf_page,
             page,
+            damage: Damage::default(),
         }
     }
 }
@@ -148,6 +240,7 @@ impl From<Page> for PdfPage {
 #[derive(Debug)]
 pub struct AnnotationIter {
     next: *mut pdf_annot,
+    damage: Damage,
 }
 
 impl Iterator for AnnotationIter {
@@ -160,7 +253,7 @@ impl Iterator for AnnotationIter {
         let node = self.next;
         unsafe {
             self.next = pdf_next_annot(context(), node);
-            Some(PdfAnnotation::from_raw(node))
+            Some(PdfAnnotation::from_raw(node).with_damage(&self.damage))
         }
     }
 }
@@ -209,4 +302,32 @@ mod test {
         let annots: Vec<PdfAnnotation> = page0.annotations().collect();
         assert_eq!(annots.len(), 0);
     }
+
+    #[test]
+    fn test_page_update_with_damage() {
+        use crate::pdf::PdfAnnotationType;
+        use crate::{Colorspace, Rect, Size};
+
+        let mut doc = PdfDocument::new();
+        let mut page = doc.new_page(Size::A6).unwrap();
+        let cs = Colorspace::device_rgb();
+        let mut pixmap = page.to_pixmap(&Matrix::IDENTITY, &cs, 0.0, true).unwrap();
+
+        let mut annot = page.create_annotation(PdfAnnotationType::Square).unwrap();
+        let damage = page.update_with_damage().unwrap();
+        assert_eq!(damage.len(), 1);
+        page.rerender_damage(&mut pixmap, &Matrix::IDENTITY, &damage, true)
+            .unwrap();
+        // Nothing changed since
+        assert!(page.update_with_damage().unwrap().is_empty());
+
+        // The area the annotation covered before it was moved is redrawn too
+        let before = annot.bounds().unwrap();
+        annot.set_rect(Rect::new(10.0, 10.0, 20.0, 20.0)).unwrap();
+        assert!(page.update_with_damage().unwrap().contains(&before));
+
+        let bounds = annot.bounds().unwrap();
+        page.delete_annotation(&annot).unwrap();
+        assert_eq!(page.update_with_damage().unwrap(), [bounds]);
+    }
 }
@@ -0,0 +1,41 @@
+use mupdf_sys::*;
+
+/// What happens to images under a redaction
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(i32)]
+pub enum RedactImageMethod {
+    /// Leave images untouched
+    None = PDF_REDACT_IMAGE_NONE as i32,
+    /// Remove images that overlap a redaction
+    Remove = PDF_REDACT_IMAGE_REMOVE as i32,
+    /// Blank out the redacted pixels of images
+    Pixels = PDF_REDACT_IMAGE_PIXELS as i32,
+}
+
+/// Options of applying redactions.
+///
+/// Text under a redaction is always removed.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct PdfRedactOptions {
+    /// Draw black boxes over the redacted areas
+    pub black_boxes: bool,
+    pub image_method: RedactImageMethod,
+}
+
+impl Default for PdfRedactOptions {
+    fn default() -> Self {
+        Self {
+            black_boxes: true,
+            image_method: RedactImageMethod::Pixels,
+        }
+    }
+}
+
+impl From<&PdfRedactOptions> for pdf_redact_options {
+    fn from(opts: &PdfRedactOptions) -> Self {
+        pdf_redact_options {
+            black_boxes: opts.black_boxes as _,
+            image_method: opts.image_method as _,
+        }
+    }
+}
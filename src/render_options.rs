@@ -0,0 +1,143 @@
+use mupdf_sys::*;
+
+use crate::Context;
+
+/// Rendering quality settings for a single render call.
+///
+/// MuPDF keeps antialiasing, minimum line width and color management on the
+/// context, these are set on the current thread's context for the duration of
+/// the call and restored afterwards, so renders of different quality can
+/// share worker threads.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct RenderOptions {
+    /// Bits of antialiasing for text, from 0 (none) to 8
+    pub text_aa_level: i32,
+    /// Bits of antialiasing for graphics, from 0 (none) to 8
+    pub graphics_aa_level: i32,
+    /// Minimum width of stroked lines, in pixels
+    pub min_line_width: f32,
+    /// Smooth images when scaling them up
+    pub interpolate_images: bool,
+    /// Use ICC color management, DeviceRGB/DeviceCMYK conversions are plain formulas otherwise
+    pub icc: bool,
+}
+
+impl Default for RenderOptions {
+    fn default() -> Self {
+        Self::print()
+    }
+}
+
+impl RenderOptions {
+    /// Best quality, MuPDF's own defaults
+    pub fn print() -> Self {
+        Self {
+            text_aa_level: 8,
+            graphics_aa_level: 8,
+            min_line_width: 0.0,
+            interpolate_images: true,
+            icc: true,
+        }
+    }
+
+    /// Small previews where thin lines should not vanish
+    pub fn thumbnail() -> Self {
+        Self {
+            text_aa_level: 4,
+            graphics_aa_level: 4,
+            min_line_width: 1.0,
+            interpolate_images: false,
+            icc: false,
+        }
+    }
+
+    /// As fast as possible
+    pub fn fast() -> Self {
+        Self {
+            text_aa_level: 0,
+            graphics_aa_level: 0,
+            min_line_width: 0.0,
+            interpolate_images: false,
+            icc: false,
+        }
+    }
+
+    /// Hints to enable on draw devices
+    pub(crate) fn device_hints(&self) -> i32 {
+        if self.interpolate_images {
+            0
+        } else {
+            FZ_DONT_INTERPOLATE_IMAGES as i32
+        }
+    }
+
+    /// Apply the context settings to the current thread until the guard is dropped.
+    pub fn apply(&self) -> RenderOptionsGuard {
+        let mut ctx = Context::get();
+        let saved = RenderOptionsGuard {
+            text_aa_level: ctx.text_aa_level(),
+            graphics_aa_level: ctx.graphics_aa_level(),
+            min_line_width: ctx.graphics_min_line_width(),
+            icc: ctx.icc_enabled(),
+        };
+        ctx.set_text_aa_level(self.text_aa_level);
+        ctx.set_graphics_aa_level(self.graphics_aa_level);
+        ctx.set_graphics_min_line_width(self.min_line_width);
+        if self.icc != saved.icc {
+            if self.icc {
+                ctx.enable_icc();
+            } else {
+                ctx.disable_icc();
+            }
+        }
+        saved
+    }
+}
+
+/// Restores the settings changed by [`RenderOptions::apply`] when dropped.
+#[derive(Debug)]
+#[must_use]
+pub struct RenderOptionsGuard {
+    text_aa_level: i32,
+    graphics_aa_level: i32,
+    min_line_width: f32,
+    icc: bool,
+}
+
+impl Drop for RenderOptionsGuard {
+    fn drop(&mut self) {
+        let mut ctx = Context::get();
+        ctx.set_text_aa_level(self.text_aa_level);
+        ctx.set_graphics_aa_level(self.graphics_aa_level);
+        ctx.set_graphics_min_line_width(self.min_line_width);
+        if ctx.icc_enabled() != self.icc {
+            if self.icc {
+                ctx.enable_icc();
+            } else {
+                ctx.disable_icc();
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::RenderOptions;
+    use crate::Context;
+
+    #[test]
+    fn test_render_options_restore() {
+        let ctx = Context::get();
+        let aa_level = ctx.aa_level();
+        let min_line_width = ctx.graphics_min_line_width();
+        {
+            let _guard = RenderOptions::thumbnail().apply();
+            assert_eq!(ctx.text_aa_level(), 4);
+            assert_eq!(ctx.graphics_min_line_width(), 1.0);
+            assert!(!ctx.icc_enabled());
+        }
+        assert_eq!(ctx.aa_level(), aa_level);
+        assert_eq!(ctx.graphics_min_line_width(), min_line_width);
+        assert!(ctx.icc_enabled());
+    }
+}
@@ -0,0 +1,117 @@
+use std::collections::HashMap;
+use std::fs;
+use std::io;
+use std::path::PathBuf;
+use std::process;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+/// Makes temporary file names unique across the threads of this process
+static TMP_COUNTER: AtomicUsize = AtomicUsize::new(0);
+
+/// Storage of the fonts and images referenced by serialized display lists.
+///
+/// Resources are keyed by the hex MD5 digest of their data, so a resource that
+/// is already stored doesn't need to be written again.
+pub trait ResourceStore {
+    fn get(&self, digest: &str) -> io::Result<Option<Vec<u8>>>;
+
+    fn put(&mut self, digest: &str, data: &[u8]) -> io::Result<()>;
+
+    fn contains(&self, digest: &str) -> io::Result<bool> {
+        Ok(self.get(digest)?.is_some())
+    }
+}
+
+/// Resources kept in memory
+#[derive(Debug, Clone, Default)]
+pub struct MemoryStore {
+    resources: HashMap<String, Vec<u8>>,
+}
+
+impl MemoryStore {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn len(&self) -> usize {
+        self.resources.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.resources.is_empty()
+    }
+}
+
+impl ResourceStore for MemoryStore {
+    fn get(&self, digest: &str) -> io::Result<Option<Vec<u8>>> {
+        Ok(self.resources.get(digest).cloned())
+    }
+
+    fn put(&mut self, digest: &str, data: &[u8]) -> io::Result<()> {
+        self.resources
+            .entry(digest.to_string())
+            .or_insert_with(|| data.to_vec());
+        Ok(())
+    }
+
+    fn contains(&self, digest: &str) -> io::Result<bool> {
+        Ok(self.resources.contains_key(digest))
+    }
+}
+
+/// Resources kept as files named after their digest in a directory
+#[derive(Debug, Clone)]
+pub struct DirectoryStore {
+    dir: PathBuf,
+}
+
+impl DirectoryStore {
+    pub fn new<P: Into<PathBuf>>(dir: P) -> io::Result<Self> {
+        let dir = dir.into();
+        fs::create_dir_all(&dir)?;
+        Ok(Self { dir })
+    }
+
+    fn path(&self, digest: &str) -> io::Result<PathBuf> {
+        if digest.is_empty() || !digest.bytes().all(|b| b.is_ascii_hexdigit()) {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                format!("invalid resource digest {:?}", digest),
+            ));
+        }
+        Ok(self.dir.join(digest))
+    }
+}
+
+impl ResourceStore for DirectoryStore {
+    fn get(&self, digest: &str) -> io::Result<Option<Vec<u8>>> {
+        match fs::read(self.path(digest)?) {
+            Ok(data) => Ok(Some(data)),
+            Err(err) if err.kind() == io::ErrorKind::NotFound => Ok(None),
+            Err(err) => Err(err),
+        }
+    }
+
+    fn put(&mut self, digest: &str, data: &[u8]) -> io::Result<()> {
+        let path = self.path(digest)?;
+        if path.exists() {
+            return Ok(());
+        }
+        // Write to a temporary file first so readers never see a partial resource
+        let tmp = self.dir.join(format!(
+            ".{}.{}.{}.tmp",
+            digest,
+            process::id(),
+            TMP_COUNTER.fetch_add(1, Ordering::Relaxed)
+        ));
+        let ret = fs::write(&tmp, data).and_then(|_| fs::rename(&tmp, &path));
+        if ret.is_err() {
+            let _ = fs::remove_file(&tmp);
+        }
+        ret
+    }
+
+    fn contains(&self, digest: &str) -> io::Result<bool> {
+        Ok(self.path(digest)?.exists())
+    }
+}
@@ -0,0 +1,30 @@
+use mupdf_sys::*;
+
+/// How text is written to SVG
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(i32)]
+pub enum SvgTextFormat {
+    /// Glyph outlines, looks the same everywhere
+    Path = FZ_SVG_TEXT_AS_PATH as i32,
+    /// `<text>` elements, selectable and smaller but drawn with the viewer's fonts
+    Text = FZ_SVG_TEXT_AS_TEXT as i32,
+}
+
+/// Options of SVG export.
+///
+/// Images are always embedded as data URIs, MuPDF can't reference external files.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct SvgOptions {
+    pub text_format: SvgTextFormat,
+    /// Embed an image drawn several times once and draw it with `<use>`
+    pub reuse_images: bool,
+}
+
+impl Default for SvgOptions {
+    fn default() -> Self {
+        Self {
+            text_format: SvgTextFormat::Path,
+            reuse_images: true,
+        }
+    }
+}
@@ -1,5 +1,5 @@
-use mupdf::pdf::{PdfDocument, PdfFilterOptions, PdfPage};
-use mupdf::Error;
+use mupdf::pdf::{Encryption, PdfDocument, PdfFilterOptions, PdfPage, PdfWriteOptions};
+use mupdf::{Colorspace, Error, Image, Pixmap, Size};
 
 fn count_images(doc: &PdfDocument, page_num: i32) -> Result<i32, Error> {
     let page = doc.find_page(page_num).unwrap();
@@ -49,3 +49,109 @@ fn test_filter_page() {
 
     assert_eq!(count_images(&doc, page_num).unwrap(), 2);
 }
+
+/// A document whose pages all draw the same image twice
+fn doc_with_shared_image(pages: usize) -> PdfDocument {
+    let mut doc = PdfDocument::new();
+    let mut pixmap = Pixmap::new_with_w_h(&Colorspace::device_rgb(), 8, 8, false).unwrap();
+    pixmap.clear_with(0x80).unwrap();
+    let image = doc
+        .add_image(&Image::from_pixmap(&pixmap).unwrap())
+        .unwrap();
+    for _ in 0..pages {
+        let mut page = doc.new_page(Size::A6).unwrap().object();
+        let mut xobjects = doc.new_dict().unwrap();
+        xobjects
+            .dict_put("Im0", image.try_clone().unwrap())
+            .unwrap();
+        page.get_dict("Resources")
+            .unwrap()
+            .unwrap()
+            .dict_put("XObject", xobjects)
+            .unwrap();
+        let mut contents = doc.add_object(&doc.new_dict().unwrap()).unwrap();
+        contents
+            .write_stream_string("q 100 0 0 100 0 0 cm /Im0 Do Q q 50 0 0 50 100 100 cm /Im0 Do Q")
+            .unwrap();
+        page.dict_put("Contents", contents).unwrap();
+    }
+    doc
+}
+
+#[test]
+fn test_shared_image_filter() {
+    let doc = doc_with_shared_image(3);
+
+    let mut calls = 0;
+    let mut opts = PdfFilterOptions::default();
+    opts.set_sanitize(true);
+    opts.set_shared_image_filter(false, |_ctm, _name, image| {
+        calls += 1;
+        Some(image.clone())
+    });
+    for page_num in 0..3 {
+        let mut page: PdfPage = doc.load_page(page_num).unwrap().into();
+        page.filter_with(&mut opts).unwrap();
+    }
+    drop(opts);
+    assert_eq!(calls, 1);
+}
+
+/// Filter options removing every image
+fn remove_images() -> PdfFilterOptions<'static> {
+    let mut opts = PdfFilterOptions::default();
+    opts.set_sanitize(true);
+    opts.set_image_filter(|_ctm, _name, _image| None);
+    opts
+}
+
+fn assert_no_images(doc: &PdfDocument, pages: i32) {
+    for page_num in 0..pages {
+        let contents = doc
+            .find_page(page_num)
+            .unwrap()
+            .get_dict("Contents")
+            .unwrap()
+            .unwrap()
+            .read_stream()
+            .unwrap();
+        assert!(!String::from_utf8_lossy(&contents).contains("Do"));
+    }
+}
+
+#[test]
+fn test_filter_all_parallel() {
+    let mut doc = doc_with_shared_image(5);
+    doc.filter_all(remove_images, 2).unwrap();
+    assert_no_images(&doc, 5);
+
+    let mut out = Vec::new();
+    doc.write_to(&mut out).unwrap();
+    assert!(PdfDocument::from_bytes(&out).unwrap().page_count().unwrap() == 5);
+}
+
+#[test]
+fn test_filter_all_uneven_split() {
+    // 9 pages on 4 threads don't split evenly
+    let mut doc = doc_with_shared_image(9);
+    doc.filter_all(remove_images, 4).unwrap();
+    assert_no_images(&doc, 9);
+}
+
+#[test]
+fn test_filter_all_encrypted() {
+    let mut options = PdfWriteOptions::default();
+    options
+        .set_encryption(Encryption::Aes128)
+        .set_owner_password("owner")
+        .set_user_password("user");
+    let mut bytes = Vec::new();
+    doc_with_shared_image(4)
+        .write_to_with_options(&mut bytes, options)
+        .unwrap();
+
+    let mut doc = PdfDocument::from_bytes(&bytes).unwrap();
+    assert!(doc.authenticate("user").unwrap());
+    doc.filter_all(remove_images, 2).unwrap();
+    assert_no_images(&doc, 4);
+}